@@ -34,9 +34,59 @@
 #  include <iostream>
 #endif
 
+// Define this (and link with -lz) to let rotating_writer
+// compress rotated segments with zlib.
+#ifdef FS_MINI_ZLIB
+#  include <zlib.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#ifdef __linux__
+#  include <linux/futex.h>
+#  include <linux/io_uring.h>
+#  include <linux/memfd.h>
+#  include <linux/openat2.h>
+#  include <linux/fiemap.h>
+#  include <linux/fs.h>
+#  include <sys/inotify.h>
+#  include <sys/ioctl.h>
+#  include <sys/sendfile.h>
+#  include <sys/syscall.h>
+#  include <sys/xattr.h>
+#endif
 
 namespace fs_error {
 
@@ -50,6 +100,15 @@ const std::system_error get(const std::string& err)
         return std::system_error(eno, std::generic_category(), err);
 }
 
+/**
+ *  @breif   Same as above, but with an explicit error number.
+ *  @return  A throwable std::system_error.
+ */
+const std::system_error get(int eno, const std::string& err)
+{
+	return std::system_error(eno, std::generic_category(), err);
+}
+
 };
 
 /**
@@ -126,8 +185,294 @@ constexpr auto unknown       = 0xffff;
 
 };
 
+#ifdef __linux__
+
+/**
+ *  @breif memfd_create() flags.
+ *
+ *  These constants are derived from C header.
+ */
+namespace fs_mfd {
+
+constexpr auto close_exec    = MFD_CLOEXEC;
+constexpr auto allow_sealing = MFD_ALLOW_SEALING;
+constexpr auto hugetlb       = MFD_HUGETLB;
+constexpr auto huge_2mb      = MFD_HUGETLB | MFD_HUGE_2MB;
+constexpr auto huge_1gb      = MFD_HUGETLB | MFD_HUGE_1GB;
+
+};
+
+/**
+ *  @breif File seals (F_ADD_SEALS).
+ *
+ *  These constants are derived from C header.
+ */
+namespace fs_seal {
+
+constexpr auto seal          = F_SEAL_SEAL;
+constexpr auto shrink        = F_SEAL_SHRINK;
+constexpr auto grow          = F_SEAL_GROW;
+constexpr auto write         = F_SEAL_WRITE;
+constexpr auto future_write  = F_SEAL_FUTURE_WRITE;
+constexpr auto immutable     = F_SEAL_SEAL | F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE;
+
+};
+
+#endif
+
 namespace fs {
 
+/**
+ *  @breif  Plain copy of the counters of an io_account.
+ */
+struct io_stats {
+	std::uint64_t opens = 0;
+	std::uint64_t reads = 0;
+	std::uint64_t writes = 0;
+	std::uint64_t read_bytes = 0;
+	std::uint64_t write_bytes = 0;
+	std::uint64_t syscalls = 0;
+	std::uint64_t nanoseconds = 0;
+};
+
+/**
+ *  @breif  Named bucket that I/O done under an io_scope is charged to,
+ *  for example one per tenant or per request.
+ *
+ *  Counters are relaxed atomics, so one account can be shared by any
+ *  number of threads and read at any time.
+ */
+class io_account {
+public:
+	explicit io_account(std::string name = "")
+		: name_(std::move(name))
+	{}
+
+	io_account(const io_account&) = delete;
+	io_account& operator=(const io_account&) = delete;
+
+	/**
+	 *  @breif  Name given at construction.
+	 */
+	[[nodiscard]]
+	const std::string& name() const noexcept
+	{ return name_; }
+
+	/**
+	 *  @breif  Read the counters.
+	 *  @return The counters as of now, each one read atomically.
+	 */
+	[[nodiscard]]
+	io_stats snapshot() const noexcept
+	{
+		io_stats s;
+		s.opens = opens_.load(std::memory_order_relaxed);
+		s.reads = reads_.load(std::memory_order_relaxed);
+		s.writes = writes_.load(std::memory_order_relaxed);
+		s.read_bytes = read_bytes_.load(std::memory_order_relaxed);
+		s.write_bytes = write_bytes_.load(std::memory_order_relaxed);
+		s.syscalls = syscalls_.load(std::memory_order_relaxed);
+		s.nanoseconds = nanoseconds_.load(std::memory_order_relaxed);
+		return s;
+	}
+
+	/**
+	 *  @breif  Read the counters and set them back to zero.
+	 *  @return The counters before the reset.
+	 */
+	io_stats exchange() noexcept
+	{
+		io_stats s;
+		s.opens = opens_.exchange(0, std::memory_order_relaxed);
+		s.reads = reads_.exchange(0, std::memory_order_relaxed);
+		s.writes = writes_.exchange(0, std::memory_order_relaxed);
+		s.read_bytes = read_bytes_.exchange(0, std::memory_order_relaxed);
+		s.write_bytes = write_bytes_.exchange(0, std::memory_order_relaxed);
+		s.syscalls = syscalls_.exchange(0, std::memory_order_relaxed);
+		s.nanoseconds = nanoseconds_.exchange(0, std::memory_order_relaxed);
+		return s;
+	}
+
+private:
+	friend class io_probe;
+
+	std::string name_;
+	std::atomic<std::uint64_t> opens_ { 0 };
+	std::atomic<std::uint64_t> reads_ { 0 };
+	std::atomic<std::uint64_t> writes_ { 0 };
+	std::atomic<std::uint64_t> read_bytes_ { 0 };
+	std::atomic<std::uint64_t> write_bytes_ { 0 };
+	std::atomic<std::uint64_t> syscalls_ { 0 };
+	std::atomic<std::uint64_t> nanoseconds_ { 0 };
+};
+
+/**
+ *  @breif  Charge the fs:: I/O of the current thread to an account
+ *  until the scope ends.
+ *
+ *  Scopes nest, the innermost one wins and the previous account comes
+ *  back when it ends. Worker threads started by fs:: functions inherit
+ *  the scope of the calling thread. Operations submitted through
+ *  io_uring are charged like the syscalls they stand for, and bytes
+ *  moved in the kernel (copy_file_range(), sendfile()) count as both
+ *  read and written. A null account turns accounting off for the
+ *  scope. The account has to outlive the scope.
+ */
+class io_scope {
+public:
+	explicit io_scope(io_account* account) noexcept
+		: prev_(slot())
+	{ slot() = account; }
+
+	explicit io_scope(io_account& account) noexcept
+		: io_scope(&account)
+	{}
+
+	io_scope(const io_scope&) = delete;
+	io_scope& operator=(const io_scope&) = delete;
+
+	~io_scope()
+	{ slot() = prev_; }
+
+	/**
+	 *  @breif  Account the current thread is charging to.
+	 *  @return The account, or nullptr outside of any scope.
+	 */
+	[[nodiscard]]
+	static io_account* current() noexcept
+	{ return slot(); }
+
+private:
+	static io_account*& slot() noexcept
+	{
+		static thread_local io_account* account = nullptr;
+		return account;
+	}
+
+	io_account* prev_;
+};
+
+/**
+ *  @breif  Charges one fs:: call to the current io_scope: syscalls and
+ *  bytes as they happen, the elapsed time when it goes out of scope.
+ *  A probe inside another one for the same account (an fs:: call made
+ *  by another) leaves the time to the outer one, so time is counted
+ *  once. Does nothing but one thread-local load outside of any scope.
+ *  @type   Private function (intended)
+ */
+class io_probe {
+public:
+	io_probe() noexcept
+		: acct_(io_scope::current())
+	{
+		if (acct_ != nullptr && timing() != acct_) {
+			prev_ = timing();
+			timing() = acct_;
+			outer_ = true;
+			start_ = std::chrono::steady_clock::now();
+		}
+	}
+
+	io_probe(const io_probe&) = delete;
+	io_probe& operator=(const io_probe&) = delete;
+
+	~io_probe()
+	{
+		if (!outer_)
+			return;
+
+		timing() = prev_;
+		const auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			std::chrono::steady_clock::now() - start_).count();
+		acct_->nanoseconds_.fetch_add(static_cast<std::uint64_t>(ns),
+					      std::memory_order_relaxed);
+	}
+
+	void open() noexcept
+	{
+		if (acct_ != nullptr) {
+			acct_->opens_.fetch_add(1, std::memory_order_relaxed);
+			acct_->syscalls_.fetch_add(1, std::memory_order_relaxed);
+		}
+	}
+
+	void read(ssize_t n) noexcept
+	{
+		if (acct_ != nullptr) {
+			acct_->reads_.fetch_add(1, std::memory_order_relaxed);
+			acct_->syscalls_.fetch_add(1, std::memory_order_relaxed);
+			if (n > 0)
+				acct_->read_bytes_.fetch_add(static_cast<std::uint64_t>(n),
+							     std::memory_order_relaxed);
+		}
+	}
+
+	void write(ssize_t n) noexcept
+	{
+		if (acct_ != nullptr) {
+			acct_->writes_.fetch_add(1, std::memory_order_relaxed);
+			acct_->syscalls_.fetch_add(1, std::memory_order_relaxed);
+			if (n > 0)
+				acct_->write_bytes_.fetch_add(static_cast<std::uint64_t>(n),
+							      std::memory_order_relaxed);
+		}
+	}
+
+	// One call that moved n bytes from one file to another.
+	void copy(ssize_t n) noexcept
+	{
+		if (acct_ != nullptr) {
+			acct_->reads_.fetch_add(1, std::memory_order_relaxed);
+			acct_->writes_.fetch_add(1, std::memory_order_relaxed);
+			acct_->syscalls_.fetch_add(1, std::memory_order_relaxed);
+			if (n > 0) {
+				acct_->read_bytes_.fetch_add(static_cast<std::uint64_t>(n),
+							     std::memory_order_relaxed);
+				acct_->write_bytes_.fetch_add(static_cast<std::uint64_t>(n),
+							      std::memory_order_relaxed);
+			}
+		}
+	}
+
+	void call() noexcept
+	{
+		if (acct_ != nullptr)
+			acct_->syscalls_.fetch_add(1, std::memory_order_relaxed);
+	}
+
+private:
+	// The account whose time the outermost probe of this thread is
+	// measuring.
+	static io_account*& timing() noexcept
+	{
+		static thread_local io_account* account = nullptr;
+		return account;
+	}
+
+	io_account* acct_;
+	io_account* prev_ = nullptr;
+	bool outer_ = false;
+	std::chrono::steady_clock::time_point start_;
+};
+
+/**
+ *  @breif  Start a worker thread that runs under the io_scope of the
+ *  thread creating it.
+ *  @return The thread.
+ *  @type   Private function (intended)
+ */
+template <typename F>
+std::thread scoped_thread(F fn)
+{
+	auto account = io_scope::current();
+
+	return std::thread([account, fn]() mutable
+	{
+		io_scope scope(account);
+		fn();
+	});
+}
+
 /**
  *  @breif  Open a file descriptor.
  *  @return If successful, open() returns the file descriptor.
@@ -135,7 +480,9 @@ namespace fs {
 [[nodiscard]]
 int open_file(const std::string& file_path, int flags)
 {
+	io_probe probe;
 	auto fd = ::open(file_path.c_str(), flags);
+	probe.open();
 	if (fd == -1)
 		throw fs_error::get("open()");
 	
@@ -149,7 +496,9 @@ int open_file(const std::string& file_path, int flags)
 [[nodiscard]]
 int open_file(const std::string& file_path, int flags, mode_t mode)
 {
+	io_probe probe;
 	auto fd = ::open(file_path.c_str(), flags, mode);
+	probe.open();
 	if (fd == -1)
 		throw fs_error::get("open()");
 	
@@ -162,6 +511,8 @@ int open_file(const std::string& file_path, int flags, mode_t mode)
  */
 inline void close_file(int fd)
 {
+	io_probe probe;
+	probe.call();
 	if (::close(fd) == -1)
 		throw fs_error::get("close()");
 }
@@ -174,7 +525,9 @@ inline void close_file(int fd)
 template <typename T>
 ssize_t read_object(int fd, T* ptr, std::size_t nbytes)
 {
+	io_probe probe;
 	auto sz = ::read(fd, ptr, nbytes);
+	probe.read(sz);
         if (sz == -1)
 		throw fs_error::get("read()");
 
@@ -189,7 +542,9 @@ ssize_t read_object(int fd, T* ptr, std::size_t nbytes)
 template <typename T>
 ssize_t write_object(int fd, const T* ptr, std::size_t nbytes)
 {
+	io_probe probe;
 	auto sz = ::write(fd, ptr, nbytes);
+	probe.write(sz);
 	if (sz == -1)
 		throw fs_error::get("write()");
 
@@ -208,6 +563,19 @@ std::intmax_t file_size(const std::string& path)
 	if (::stat(path.c_str(), &st) == -1)
 		throw fs_error::get("stat()");
 
+#ifdef __linux__
+	// st_size is 0 for block devices, ask the device instead.
+	if (S_ISBLK(st.st_mode)) {
+		auto fd = open_file(path, fs_omode::readonly | fs_omode::close_exec);
+		std::uint64_t size = 0;
+		const auto ret = ::ioctl(fd, BLKGETSIZE64, &size);
+		::close(fd);
+		if (ret == -1)
+			throw fs_error::get("ioctl(BLKGETSIZE64)");
+		return static_cast<std::intmax_t>(size);
+	}
+#endif
+
 	return static_cast<std::intmax_t>(st.st_size);
 }
 
@@ -223,6 +591,15 @@ std::intmax_t file_size(int fd)
 	if (::fstat(fd, &st) == -1)
 		throw fs_error::get("fstat()");
 
+#ifdef __linux__
+	if (S_ISBLK(st.st_mode)) {
+		std::uint64_t size = 0;
+		if (::ioctl(fd, BLKGETSIZE64, &size) == -1)
+			throw fs_error::get("ioctl(BLKGETSIZE64)");
+		return static_cast<std::intmax_t>(size);
+	}
+#endif
+
 	return static_cast<std::intmax_t>(st.st_size);
 }
 
@@ -286,40 +663,6 @@ bool is_symlink_exists(const std::string& path)
 	return (st.st_mode & S_IFMT) == S_IFLNK;
 }
 
-/**
- *  @breif  Copy a file on the filesystem.
- *  @return None.
- */
-void copy_file(const std::string& target, const std::string& dest_path)
-{
-	auto rfd = ::open(target.c_str(), fs_omode::readonly);
-	if (rfd == -1)
-	        throw fs_error::get("open()");
-
-	auto wfd = ::open(
-		dest_path.c_str(), fs_omode::writeonly | fs_omode::create);
-	if (wfd == -1)
-		throw fs_error::get("open()");
-
-	struct stat st;
-
-	if (::fstat(rfd, &st) != -1)
-		throw fs_error::get("fstat()");
-
-        std::size_t len, c_range;
-
-        len = static_cast<std::size_t>(st.st_size);
-	do {
-		c_range = ::copy_file_range(rfd, nullptr, wfd, nullptr, len, 0);
-		if (c_range == -1UL)
-			throw fs_error::get("copy_file_range()");
-		len -= c_range;
-	} while (len > 0);
-
-	::close(rfd);
-	::close(wfd);
-}
-
 /**
  *  @breif  Create a symlink of a file or directory on the filesystem.
  *  @return None.
@@ -397,6 +740,29 @@ void rename_path(const std::string& old_path, const std::string& new_path)
 		throw fs_error::get("rename()");
 }
 
+/**
+ *  @breif  Create a new file next to a path under a name nobody else
+ *  uses, to be renamed over the path once it is complete.
+ *  @return The file descriptor, opened for writing. name receives the
+ *  path of the file.
+ *  @type   Private function (intended)
+ */
+[[nodiscard]]
+int create_sibling(const std::string& path, std::string& name, mode_t mode)
+{
+	static std::atomic<unsigned> seq { 0 };
+
+	for (;;) {
+		name = path + ".fs_mini." + std::to_string(::getpid()) + "." +
+			std::to_string(seq.fetch_add(1, std::memory_order_relaxed));
+		auto fd = ::open(name.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, mode);
+		if (fd != -1)
+			return fd;
+		if (errno != EEXIST)
+			throw fs_error::get("open()");
+	}
+}
+
 /**
  *  @breif  Check whether an environment variable key exists or not.
  *  @return If successful, this function returns true, otherwise false.
@@ -529,6 +895,7150 @@ unsigned int get_file_type(const std::string& file)
 	return st.st_mode & S_IFMT;
 }
 
+/**
+ *  @breif  Raise the soft RLIMIT_NOFILE of the process to its hard limit.
+ *  @return The new soft limit.
+ *
+ *  On macOS the soft limit is also capped by OPEN_MAX.
+ */
+rlim_t raise_fd_limit()
+{
+	struct rlimit rl;
+
+	if (::getrlimit(RLIMIT_NOFILE, &rl) == -1)
+		throw fs_error::get("getrlimit()");
+
+	auto want = rl.rlim_max;
+#ifdef __APPLE__
+	want = std::min<rlim_t>(want, OPEN_MAX);
+#endif
+	if (want != RLIM_INFINITY && rl.rlim_cur < want) {
+		rl.rlim_cur = want;
+		if (::setrlimit(RLIMIT_NOFILE, &rl) == -1)
+			throw fs_error::get("setrlimit()");
+	}
+
+	return rl.rlim_cur;
+}
+
+/**
+ *  @breif  Close every descriptor in [first, last].
+ *  @return None.
+ *
+ *  Uses close_range() where the kernel has it. Otherwise the open
+ *  descriptors are listed from /proc/self/fd with getdents64() into a
+ *  stack buffer, so only the ones that are open get a close() call.
+ *  It neither allocates nor takes locks, so it is safe between fork()
+ *  and exec() in a multithreaded process. With cloexec set they are
+ *  only marked close-on-exec, which is what a child about to exec()
+ *  usually wants.
+ */
+void close_fds(int first, int last = INT_MAX, bool cloexec = false)
+{
+	auto act = [cloexec](int fd)
+	{
+		if (cloexec)
+			::fcntl(fd, F_SETFD, ::fcntl(fd, F_GETFD) | FD_CLOEXEC);
+		else
+			::close(fd);
+	};
+
+#ifdef __linux__
+#  ifdef SYS_close_range
+	const unsigned flags = cloexec ? 4u /* CLOSE_RANGE_CLOEXEC */ : 0u;
+	if (::syscall(SYS_close_range, static_cast<unsigned>(first),
+		      static_cast<unsigned>(last), flags) == 0)
+		return;
+#  endif
+
+	const auto dir = ::open("/proc/self/fd", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir != -1) {
+		// procfs keeps its place by descriptor number, so closing
+		// entries while reading does not skip any.
+		alignas(struct dirent64) char buf[4096];
+		long len;
+		while ((len = ::syscall(SYS_getdents64, dir, buf, sizeof(buf))) > 0) {
+			for (long pos = 0; pos < len; ) {
+				const auto ent = reinterpret_cast<struct dirent64*>(buf + pos);
+				pos += ent->d_reclen;
+
+				long fd = 0;
+				const char* c = ent->d_name;
+				for (; *c >= '0' && *c <= '9' && fd <= INT_MAX; ++c)
+					fd = fd * 10 + (*c - '0');
+				if (*c == '\0' && c != ent->d_name && fd != dir &&
+				    fd >= first && fd <= last)
+					act(static_cast<int>(fd));
+			}
+		}
+		::close(dir);
+		if (len == 0)
+			return;
+	}
+#endif
+
+	const auto max = ::sysconf(_SC_OPEN_MAX);
+	for (long fd = first; fd <= std::min<long>(last, max - 1); ++fd)
+		act(static_cast<int>(fd));
+}
+
+/**
+ *  @breif  Share of the process descriptor limit handed out to the
+ *  subsystems that hold many files open at once.
+ *
+ *  The soft RLIMIT_NOFILE is raised to the hard limit when the budget
+ *  is made. headroom descriptors are never handed out, they are left
+ *  for ordinary opens. Walkers, caches and pools reserve what they
+ *  would like and get what is left, possibly less or nothing, and
+ *  size themselves to that instead of running into EMFILE. Within this
+ *  library fd_broker's cache, cached_file and move_paths() draw from
+ *  global().
+ */
+class fd_budget {
+public:
+	/**
+	 *  @breif  Descriptors granted by an fd_budget, given back when
+	 *  the reservation goes away.
+	 */
+	class reservation {
+	public:
+		reservation() = default;
+
+		reservation(reservation&& o) noexcept
+			: owner_(o.owner_), count_(o.count_)
+		{
+			o.owner_ = nullptr;
+			o.count_ = 0;
+		}
+
+		reservation& operator=(reservation&& o) noexcept
+		{
+			if (this != &o) {
+				release();
+				owner_ = o.owner_;
+				count_ = o.count_;
+				o.owner_ = nullptr;
+				o.count_ = 0;
+			}
+			return *this;
+		}
+
+		~reservation()
+		{ release(); }
+
+		/**
+		 *  @breif  Number of descriptors granted.
+		 */
+		[[nodiscard]]
+		std::size_t count() const noexcept
+		{ return count_; }
+
+		explicit operator bool() const noexcept
+		{ return count_ > 0; }
+
+		/**
+		 *  @breif  Give the descriptors back early.
+		 *  @return None.
+		 */
+		void release() noexcept
+		{
+			if (owner_ != nullptr)
+				owner_->give_back(count_);
+			owner_ = nullptr;
+			count_ = 0;
+		}
+
+	private:
+		friend class fd_budget;
+
+		reservation(fd_budget* owner, std::size_t n)
+			: owner_(owner), count_(n)
+		{}
+
+		fd_budget* owner_ = nullptr;
+		std::size_t count_ = 0;
+	};
+
+	explicit fd_budget(std::size_t headroom = 64)
+	{
+		const auto lim = raise_fd_limit();
+		const auto cap = lim == RLIM_INFINITY ?
+			static_cast<std::size_t>(INT_MAX) : static_cast<std::size_t>(lim);
+		total_ = cap > headroom ? cap - headroom : 0;
+	}
+
+	fd_budget(const fd_budget&) = delete;
+	fd_budget& operator=(const fd_budget&) = delete;
+
+	/**
+	 *  @breif  The budget shared by the whole process.
+	 *  @return A reference to it.
+	 */
+	static fd_budget& global()
+	{
+		static fd_budget budget;
+		return budget;
+	}
+
+	/**
+	 *  @breif  Reserve up to want descriptors, but no fewer than min.
+	 *  @return The reservation, empty when min could not be met.
+	 */
+	[[nodiscard]]
+	reservation reserve(std::size_t want, std::size_t min = 1)
+	{
+		std::lock_guard<std::mutex> lk(mtx_);
+
+		const auto n = std::min(want, total_ - used_);
+		if (n < min || n == 0)
+			return reservation();
+		used_ += n;
+		return reservation(this, n);
+	}
+
+	/**
+	 *  @breif  Descriptors not reserved yet.
+	 */
+	[[nodiscard]]
+	std::size_t available() const
+	{
+		std::lock_guard<std::mutex> lk(mtx_);
+		return total_ - used_;
+	}
+
+	/**
+	 *  @breif  Descriptors this budget can hand out at all.
+	 */
+	[[nodiscard]]
+	std::size_t capacity() const noexcept
+	{ return total_; }
+
+private:
+	void give_back(std::size_t n) noexcept
+	{
+		std::lock_guard<std::mutex> lk(mtx_);
+		used_ -= n;
+	}
+
+	mutable std::mutex mtx_;
+	std::size_t total_ = 0;
+	std::size_t used_ = 0;
+};
+
+#ifdef __linux__
+
+/**
+ *  @breif  Follow a growing file, like "tail -F".
+ *
+ *  The follower sleeps on inotify instead of polling, notices when
+ *  the followed path is rotated (replaced by a new inode) or truncated,
+ *  drains whatever is left in the old file and then switches to the
+ *  new one. Data is read with pread() in large chunks.
+ */
+class file_follower {
+public:
+	/**
+	 *  @breif  Start following a file.
+	 *
+	 *  If from_end is true, only data appended after this call is
+	 *  delivered, otherwise the file is read from the beginning.
+	 */
+	explicit file_follower(const std::string& path, bool from_end = true,
+			       std::size_t chunk_size = 1 << 20)
+		: path_(path), chunk_size_(chunk_size)
+	{
+		const auto pos = path_.rfind('/');
+		const auto dir = pos == std::string::npos ? std::string(".") :
+			pos == 0 ? std::string("/") : path_.substr(0, pos);
+
+		ifd_ = ::inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (ifd_ == -1)
+			throw fs_error::get("inotify_init1()");
+
+		dir_wd_ = ::inotify_add_watch(ifd_, dir.c_str(),
+					      IN_CREATE | IN_MOVED_TO);
+		if (dir_wd_ == -1) {
+			const auto err = fs_error::get("inotify_add_watch()");
+			::close(ifd_);
+			throw err;
+		}
+
+		try {
+			reopen();
+		} catch (...) {
+			::close(ifd_);
+			throw;
+		}
+
+		if (from_end)
+			offset_ = static_cast<off_t>(file_size(fd_));
+	}
+
+	file_follower(const file_follower&) = delete;
+	file_follower& operator=(const file_follower&) = delete;
+
+	~file_follower()
+	{
+		if (fd_ != -1)
+			::close(fd_);
+		::close(ifd_);
+	}
+
+	/**
+	 *  @breif  Wait for new data and append it to out.
+	 *  @return Number of bytes appended, 0 if timeout_ms expired first.
+	 *
+	 *  A negative timeout_ms waits forever. At most chunk_size bytes
+	 *  are delivered per call.
+	 */
+	std::size_t read(std::string& out, int timeout_ms = -1)
+	{
+		for (;;) {
+			auto n = drain(out);
+			if (n > 0)
+				return n;
+
+			// EOF on the current file, check if it went away.
+			if (file_size(fd_) < offset_) {
+				offset_ = 0;
+				continue;
+			}
+			if (rotated()) {
+				reopen();
+				continue;
+			}
+
+			struct pollfd pfd = { ifd_, POLLIN, 0 };
+			auto ret = ::poll(&pfd, 1, timeout_ms);
+			if (ret == -1) {
+				if (errno == EINTR)
+					continue;
+				throw fs_error::get("poll()");
+			}
+			if (ret == 0)
+				return 0;
+			consume_events();
+		}
+	}
+
+	/**
+	 *  @breif  Read offset inside the currently followed file.
+	 *  @return Offset in bytes.
+	 */
+	[[nodiscard]]
+	off_t offset() const noexcept
+	{ return offset_; }
+
+	/**
+	 *  @breif  Inotify descriptor, for use in external event loops.
+	 *  @return The file descriptor.
+	 */
+	[[nodiscard]]
+	int native_handle() const noexcept
+	{ return ifd_; }
+
+private:
+	std::size_t drain(std::string& out)
+	{
+		// Size the read from what is there, an idle poll then costs
+		// one fstat() and leaves out alone.
+		const auto size = file_size(fd_);
+		if (size <= offset_)
+			return 0;
+
+		const auto want = static_cast<std::size_t>(
+			std::min<std::uintmax_t>(chunk_size_, static_cast<std::uintmax_t>(size - offset_)));
+		if (buf_.size() < want)
+			buf_.resize(want);
+
+		std::size_t got = 0;
+		io_probe probe;
+		while (got < want) {
+			auto sz = ::pread(fd_, &buf_[got], want - got, offset_);
+			probe.read(sz);
+			if (sz == -1) {
+				if (errno == EINTR)
+					continue;
+				throw fs_error::get("pread()");
+			}
+			if (sz == 0)
+				break;
+			got += static_cast<std::size_t>(sz);
+			offset_ += sz;
+		}
+
+		out.append(buf_.data(), got);
+		return got;
+	}
+
+	bool rotated() const
+	{
+		struct stat st;
+
+		if (::stat(path_.c_str(), &st) == -1) {
+			if (errno == ENOENT)
+				return false;
+			throw fs_error::get("stat()");
+		}
+
+		return st.st_ino != ino_ || st.st_dev != dev_;
+	}
+
+	void reopen()
+	{
+		auto fd = open_file(path_, fs_omode::readonly | fs_omode::close_exec);
+		struct stat st;
+
+		if (::fstat(fd, &st) == -1) {
+			const auto err = fs_error::get("fstat()");
+			::close(fd);
+			throw err;
+		}
+
+		auto wd = ::inotify_add_watch(ifd_, path_.c_str(),
+					      IN_MODIFY | IN_ATTRIB |
+					      IN_MOVE_SELF | IN_DELETE_SELF);
+		if (wd == -1) {
+			const auto err = fs_error::get("inotify_add_watch()");
+			::close(fd);
+			throw err;
+		}
+
+		if (fd_ != -1) {
+			::close(fd_);
+			if (file_wd_ != wd)
+				::inotify_rm_watch(ifd_, file_wd_);
+		}
+
+		fd_ = fd;
+		file_wd_ = wd;
+		ino_ = st.st_ino;
+		dev_ = st.st_dev;
+		offset_ = 0;
+	}
+
+	void consume_events()
+	{
+		alignas(struct inotify_event) char buf[4096];
+
+		for (;;) {
+			auto sz = ::read(ifd_, buf, sizeof(buf));
+			if (sz == -1) {
+				if (errno == EINTR)
+					continue;
+				if (errno == EAGAIN)
+					return;
+				throw fs_error::get("read()");
+			}
+			if (sz == 0)
+				return;
+		}
+	}
+
+	std::string path_;
+	std::size_t chunk_size_;
+	int ifd_ = -1;
+	int dir_wd_ = -1;
+	int file_wd_ = -1;
+	int fd_ = -1;
+	ino_t ino_ = 0;
+	dev_t dev_ = 0;
+	off_t offset_ = 0;
+	std::vector<char> buf_;
+};
+
+#endif
+
+/**
+ *  @breif  Rotation and retention settings for rotating_writer.
+ *
+ *  A zero value disables the corresponding limit. Compression of
+ *  rotated segments needs FS_MINI_ZLIB (and -lz), without it asking
+ *  for compress makes rotating_writer throw EOPNOTSUPP.
+ */
+struct rotate_policy {
+	std::uintmax_t max_size = 0;
+	std::chrono::seconds max_age { 0 };
+	std::size_t max_files = 0;
+	std::uintmax_t max_total = 0;
+	bool compress = false;
+};
+
+/**
+ *  @breif  Append-only log writer with built-in rotation.
+ *
+ *  The active file is rotated with a single rename() to
+ *  "<path>.<seq>" and a fresh file is opened in its place, so writers
+ *  only ever wait for those two syscalls. Compression and retention
+ *  run on a background thread with idle CPU and I/O priority. The
+ *  list of segments is scanned once at construction and then kept in
+ *  memory.
+ */
+class rotating_writer {
+public:
+	rotating_writer(const std::string& path, const rotate_policy& policy,
+			mode_t mode = fs_perms::owner_read | fs_perms::owner_write |
+			fs_perms::group_read | fs_perms::others_read)
+		: path_(path), policy_(policy), mode_(mode)
+	{
+#ifndef FS_MINI_ZLIB
+		if (policy_.compress)
+			throw fs_error::get(EOPNOTSUPP, "rotating_writer(): compress needs FS_MINI_ZLIB");
+#endif
+		scan_segments();
+		// Segments left by earlier runs count against the limits
+		// right away, not only after the next rotation.
+		enforce_retention();
+		open_active();
+		worker_ = scoped_thread([this] { background(); });
+	}
+
+	rotating_writer(const rotating_writer&) = delete;
+	rotating_writer& operator=(const rotating_writer&) = delete;
+
+	~rotating_writer()
+	{
+		{
+			std::lock_guard<std::mutex> lk(queue_mtx_);
+			stop_ = true;
+		}
+		queue_cv_.notify_one();
+		worker_.join();
+		::close(fd_);
+	}
+
+	/**
+	 *  @breif  Append data to the active file, rotating first if needed.
+	 *  @return The size of the data it wrote in bytes.
+	 */
+	template <typename T>
+	ssize_t write(const T* ptr, std::size_t nbytes)
+	{
+		std::lock_guard<std::mutex> lk(write_mtx_);
+
+		if (size_ > 0 && need_rotate(nbytes))
+			rotate_locked();
+
+		auto sz = write_object(fd_, ptr, nbytes);
+		size_ += static_cast<std::uintmax_t>(sz);
+		return sz;
+	}
+
+	/**
+	 *  @breif  Force a rotation of the active file.
+	 *  @return None.
+	 */
+	void rotate()
+	{
+		std::lock_guard<std::mutex> lk(write_mtx_);
+		rotate_locked();
+	}
+
+	/**
+	 *  @breif  Flush the active file to the disk.
+	 *  @return None.
+	 */
+	void flush()
+	{
+		std::lock_guard<std::mutex> lk(write_mtx_);
+		if (::fdatasync(fd_) == -1)
+			throw fs_error::get("fdatasync()");
+	}
+
+private:
+	struct segment {
+		std::uintmax_t seq;
+		std::uintmax_t size;
+		bool compressed;
+	};
+
+	std::string segment_name(const segment& seg) const
+	{
+		auto name = path_ + "." + std::to_string(seg.seq);
+		return seg.compressed ? name + ".gz" : name;
+	}
+
+	bool need_rotate(std::size_t nbytes) const
+	{
+		if (policy_.max_size > 0 && size_ + nbytes > policy_.max_size)
+			return true;
+		if (policy_.max_age.count() > 0 &&
+		    std::chrono::steady_clock::now() - opened_ >= policy_.max_age)
+			return true;
+
+		return false;
+	}
+
+	void open_active()
+	{
+		fd_ = open_file(path_, fs_omode::writeonly | fs_omode::create |
+				fs_omode::append | fs_omode::close_exec, mode_);
+		size_ = static_cast<std::uintmax_t>(file_size(fd_));
+		opened_ = std::chrono::steady_clock::now();
+	}
+
+	void rotate_locked()
+	{
+		const segment seg = { next_seq_, size_, false };
+
+		rename_path(path_, segment_name(seg));
+		++next_seq_;
+
+		auto old = fd_;
+		open_active();
+		::close(old);
+
+		{
+			std::lock_guard<std::mutex> lk(queue_mtx_);
+			queue_.push_back(seg);
+		}
+		queue_cv_.notify_one();
+	}
+
+	// Find "<name>.<seq>" and "<name>.<seq>.gz" next to the active file.
+	void scan_segments()
+	{
+		const auto pos = path_.rfind('/');
+		const auto dir = pos == std::string::npos ? std::string(".") :
+			pos == 0 ? std::string("/") : path_.substr(0, pos);
+		const auto prefix = (pos == std::string::npos ?
+				     path_ : path_.substr(pos + 1)) + ".";
+
+		auto dp = ::opendir(dir.c_str());
+		if (dp == nullptr)
+			throw fs_error::get("opendir()");
+
+		while (auto ent = ::readdir(dp)) {
+			std::string name = ent->d_name;
+			if (name.compare(0, prefix.size(), prefix) != 0)
+				continue;
+
+			auto rest = name.substr(prefix.size());
+			segment seg = { 0, 0, false };
+			if (rest.size() > 3 &&
+			    rest.compare(rest.size() - 3, 3, ".gz") == 0) {
+				seg.compressed = true;
+				rest.resize(rest.size() - 3);
+			}
+			if (rest.empty() ||
+			    rest.find_first_not_of("0123456789") != std::string::npos)
+				continue;
+
+			seg.seq = std::stoull(rest);
+			struct stat st;
+			if (::stat(segment_name(seg).c_str(), &st) == -1)
+				continue;
+			seg.size = static_cast<std::uintmax_t>(st.st_size);
+			segments_.push_back(seg);
+		}
+		::closedir(dp);
+
+		std::sort(segments_.begin(), segments_.end(),
+			  [](const segment& a, const segment& b)
+			  { return a.seq < b.seq; });
+		for (const auto& seg : segments_)
+			total_ += seg.size;
+		next_seq_ = segments_.empty() ? 1 : segments_.back().seq + 1;
+	}
+
+	void background()
+	{
+#ifdef __linux__
+		// Lowest CPU priority and the idle I/O class, for this thread only.
+		::setpriority(PRIO_PROCESS,
+			      static_cast<id_t>(::syscall(SYS_gettid)), 19);
+		::syscall(SYS_ioprio_set, 1, 0, 3 << 13);
+#endif
+		for (;;) {
+			std::unique_lock<std::mutex> lk(queue_mtx_);
+			queue_cv_.wait(lk, [this] { return stop_ || !queue_.empty(); });
+			if (queue_.empty())
+				return;
+
+			auto seg = queue_.front();
+			queue_.pop_front();
+			lk.unlock();
+
+			if (policy_.compress)
+				compress(seg);
+			segments_.push_back(seg);
+			total_ += seg.size;
+			enforce_retention();
+		}
+	}
+
+	// Failures here are not fatal, the plain segment is kept.
+	void compress(segment& seg)
+	{
+#ifdef FS_MINI_ZLIB
+		const auto plain = segment_name(seg);
+		segment gz = { seg.seq, 0, true };
+		const auto tmp = segment_name(gz) + ".tmp";
+
+		auto rfd = ::open(plain.c_str(), fs_omode::readonly | fs_omode::close_exec);
+		if (rfd == -1)
+			return;
+
+		auto out = ::gzopen(tmp.c_str(), "wb");
+		if (out == nullptr) {
+			::close(rfd);
+			return;
+		}
+
+		std::unique_ptr<char[]> buf(new char[1 << 16]);
+		bool ok = true;
+		io_probe probe;
+		for (;;) {
+			auto sz = ::read(rfd, buf.get(), 1 << 16);
+			probe.read(sz);
+			if (sz == -1 && errno == EINTR)
+				continue;
+			if (sz <= 0) {
+				ok = sz == 0;
+				break;
+			}
+			if (::gzwrite(out, buf.get(), static_cast<unsigned>(sz)) != sz) {
+				ok = false;
+				break;
+			}
+		}
+		::close(rfd);
+		ok = ::gzclose(out) == Z_OK && ok;
+
+		struct stat st;
+		if (!ok || ::stat(tmp.c_str(), &st) == -1 ||
+		    ::rename(tmp.c_str(), segment_name(gz).c_str()) == -1) {
+			::unlink(tmp.c_str());
+			return;
+		}
+
+		::unlink(plain.c_str());
+		seg.compressed = true;
+		seg.size = static_cast<std::uintmax_t>(st.st_size);
+#else
+		(void)seg;
+#endif
+	}
+
+	void enforce_retention()
+	{
+		while (!segments_.empty() &&
+		       ((policy_.max_files > 0 && segments_.size() > policy_.max_files) ||
+			(policy_.max_total > 0 && total_ > policy_.max_total))) {
+			const auto& seg = segments_.front();
+			::unlink(segment_name(seg).c_str());
+			total_ -= seg.size;
+			segments_.pop_front();
+		}
+	}
+
+	std::string path_;
+	rotate_policy policy_;
+	mode_t mode_;
+
+	std::mutex write_mtx_;
+	int fd_ = -1;
+	std::uintmax_t size_ = 0;
+	std::uintmax_t next_seq_ = 1;
+	std::chrono::steady_clock::time_point opened_;
+
+	std::mutex queue_mtx_;
+	std::condition_variable queue_cv_;
+	std::deque<segment> queue_;
+	bool stop_ = false;
+
+	// Only touched by the constructor and then the background thread.
+	std::deque<segment> segments_;
+	std::uintmax_t total_ = 0;
+
+	std::thread worker_;
+};
+
+/**
+ *  @breif  Hash a block of memory with XXH64.
+ *  @return The 64-bit hash value.
+ */
+[[nodiscard]]
+std::uint64_t checksum64(const void* data, std::size_t len, std::uint64_t seed = 0)
+{
+	constexpr std::uint64_t p1 = 0x9e3779b185ebca87ULL;
+	constexpr std::uint64_t p2 = 0xc2b2ae3d27d4eb4fULL;
+	constexpr std::uint64_t p3 = 0x165667b19e3779f9ULL;
+	constexpr std::uint64_t p4 = 0x85ebca77c2b2ae63ULL;
+	constexpr std::uint64_t p5 = 0x27d4eb2f165667c5ULL;
+
+	const auto rotl = [](std::uint64_t x, int r)
+	{ return (x << r) | (x >> (64 - r)); };
+	const auto round = [&](std::uint64_t acc, std::uint64_t in)
+	{ return rotl(acc + in * p2, 31) * p1; };
+	const auto merge = [&](std::uint64_t acc, std::uint64_t val)
+	{ return (acc ^ round(0, val)) * p1 + p4; };
+	const auto load64 = [](const unsigned char* p)
+	{ std::uint64_t v; std::memcpy(&v, p, 8); return v; };
+	const auto load32 = [](const unsigned char* p)
+	{ std::uint32_t v; std::memcpy(&v, p, 4); return std::uint64_t(v); };
+
+	auto p = static_cast<const unsigned char*>(data);
+	const auto end = p + len;
+	std::uint64_t h;
+
+	if (len >= 32) {
+		std::uint64_t v1 = seed + p1 + p2, v2 = seed + p2;
+		std::uint64_t v3 = seed, v4 = seed - p1;
+		do {
+			v1 = round(v1, load64(p));
+			v2 = round(v2, load64(p + 8));
+			v3 = round(v3, load64(p + 16));
+			v4 = round(v4, load64(p + 24));
+			p += 32;
+		} while (end - p >= 32);
+
+		h = rotl(v1, 1) + rotl(v2, 7) + rotl(v3, 12) + rotl(v4, 18);
+		h = merge(h, v1);
+		h = merge(h, v2);
+		h = merge(h, v3);
+		h = merge(h, v4);
+	} else {
+		h = seed + p5;
+	}
+
+	h += static_cast<std::uint64_t>(len);
+	for (; end - p >= 8; p += 8)
+		h = rotl(h ^ round(0, load64(p)), 27) * p1 + p4;
+	if (end - p >= 4) {
+		h = rotl(h ^ (load32(p) * p1), 23) * p2 + p3;
+		p += 4;
+	}
+	for (; p < end; ++p)
+		h = rotl(h ^ (*p * p5), 11) * p1;
+
+	h ^= h >> 33;
+	h *= p2;
+	h ^= h >> 29;
+	h *= p3;
+	h ^= h >> 32;
+	return h;
+}
+
+/**
+ *  @breif  Write a whole iovec array, retrying on short writes.
+ *  @return None.
+ */
+void writev_all(int fd, struct iovec* iov, int iovcnt)
+{
+	io_probe probe;
+
+	while (iovcnt > 0) {
+		auto sz = ::writev(fd, iov, iovcnt);
+		probe.write(sz);
+		if (sz == -1) {
+			if (errno == EINTR)
+				continue;
+			throw fs_error::get("writev()");
+		}
+
+		auto left = static_cast<std::size_t>(sz);
+		while (iovcnt > 0 && left >= iov->iov_len) {
+			left -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+			iov->iov_len -= left;
+		}
+	}
+}
+
+/**
+ *  @breif  Write a whole iovec array at an offset, retrying on short
+ *  writes.
+ *  @return None.
+ */
+void pwritev_all(int fd, struct iovec* iov, int iovcnt, off_t off)
+{
+	io_probe probe;
+
+	while (iovcnt > 0) {
+		auto sz = ::pwritev(fd, iov, std::min(iovcnt, IOV_MAX), off);
+		probe.write(sz);
+		if (sz == -1) {
+			if (errno == EINTR)
+				continue;
+			throw fs_error::get("pwritev()");
+		}
+
+		off += sz;
+		auto left = static_cast<std::size_t>(sz);
+		while (iovcnt > 0 && left >= iov->iov_len) {
+			left -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = static_cast<char*>(iov->iov_base) + left;
+			iov->iov_len -= left;
+		}
+	}
+}
+
+/**
+ *  @breif  Read-only memory mapping of a whole file.
+ *
+ *  Empty files are represented by a null mapping of size 0.
+ */
+class mapped_file {
+public:
+	mapped_file() = default;
+
+	explicit mapped_file(const std::string& path)
+	{
+		auto fd = open_file(path, fs_omode::readonly | fs_omode::close_exec);
+		try {
+			map(fd);
+		} catch (...) {
+			::close(fd);
+			throw;
+		}
+		::close(fd);
+	}
+
+	/**
+	 *  @breif  Map an already opened file, the descriptor stays owned
+	 *  by the caller.
+	 *
+	 *  A writable mapping needs a descriptor opened for writing.
+	 */
+	explicit mapped_file(int fd, bool writable = false)
+	{ map(fd, writable); }
+
+	mapped_file(const mapped_file&) = delete;
+	mapped_file& operator=(const mapped_file&) = delete;
+
+	mapped_file(mapped_file&& other) noexcept
+		: data_(other.data_), size_(other.size_)
+	{
+		other.data_ = nullptr;
+		other.size_ = 0;
+	}
+
+	mapped_file& operator=(mapped_file&& other) noexcept
+	{
+		if (this != &other) {
+			unmap();
+			data_ = other.data_;
+			size_ = other.size_;
+			other.data_ = nullptr;
+			other.size_ = 0;
+		}
+		return *this;
+	}
+
+	~mapped_file()
+	{ unmap(); }
+
+	[[nodiscard]]
+	const char* data() const noexcept
+	{ return static_cast<const char*>(data_); }
+
+	/**
+	 *  @breif  Mapped memory, only to be written through when the
+	 *  mapping was created writable.
+	 */
+	[[nodiscard]]
+	char* mutable_data() const noexcept
+	{ return static_cast<char*>(data_); }
+
+	[[nodiscard]]
+	std::size_t size() const noexcept
+	{ return size_; }
+
+	/**
+	 *  @breif  Pass an access pattern hint (MADV_*) to the kernel.
+	 *  @return None.
+	 */
+	void advise(int advice) const
+	{
+		if (size_ > 0 && ::madvise(data_, size_, advice) == -1)
+			throw fs_error::get("madvise()");
+	}
+
+private:
+	void map(int fd, bool writable = false)
+	{
+		size_ = static_cast<std::size_t>(file_size(fd));
+		if (size_ == 0)
+			return;
+
+		data_ = ::mmap(nullptr, size_,
+			       writable ? PROT_READ | PROT_WRITE : PROT_READ,
+			       MAP_SHARED, fd, 0);
+		if (data_ == MAP_FAILED) {
+			data_ = nullptr;
+			size_ = 0;
+			throw fs_error::get("mmap()");
+		}
+	}
+
+	void unmap() noexcept
+	{
+		if (data_ != nullptr)
+			::munmap(data_, size_);
+		data_ = nullptr;
+		size_ = 0;
+	}
+
+	void* data_ = nullptr;
+	std::size_t size_ = 0;
+};
+
+/**
+ *  @breif  On-disk header of a typed record file.
+ *
+ *  The payload (count records of record_size bytes) starts right
+ *  after the header, at a 64 byte boundary.
+ */
+struct record_header {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t endian;
+	std::uint32_t record_size;
+	std::uint32_t reserved;
+	std::uint64_t count;
+	std::uint64_t checksum;
+	char padding[24];
+};
+
+static_assert(sizeof(record_header) == 64, "record_header must be 64 bytes");
+
+constexpr char record_magic[8] = { 'F', 'S', 'M', 'R', 'E', 'C', '\0', '\0' };
+constexpr std::uint32_t record_version = 1;
+constexpr std::uint32_t record_endian = 0x01020304;
+
+/**
+ *  @breif  Write an array of trivially copyable records to a file.
+ *  @return None.
+ *
+ *  The header and the payload go out in one writev() to a temporary
+ *  file of its own next to path, which is synced and renamed over
+ *  path, so concurrent writers never share it.
+ */
+template <typename T>
+void write_records(const std::string& path, const T* ptr, std::size_t count)
+{
+	static_assert(std::is_trivially_copyable<T>::value,
+		      "records must be trivially copyable");
+	static_assert(alignof(T) <= sizeof(record_header),
+		      "record alignment is larger than the header");
+
+	record_header hdr;
+	std::memset(&hdr, 0, sizeof(hdr));
+	std::memcpy(hdr.magic, record_magic, sizeof(hdr.magic));
+	hdr.version = record_version;
+	hdr.endian = record_endian;
+	hdr.record_size = static_cast<std::uint32_t>(sizeof(T));
+	hdr.count = count;
+	hdr.checksum = checksum64(ptr, count * sizeof(T));
+
+	std::string tmp;
+	auto fd = create_sibling(path, tmp, fs_perms::owner_read | fs_perms::owner_write |
+				 fs_perms::group_read | fs_perms::others_read);
+
+	struct iovec iov[2] = {
+		{ &hdr, sizeof(hdr) },
+		{ const_cast<T*>(ptr), count * sizeof(T) },
+	};
+
+	try {
+		writev_all(fd, iov, 2);
+		if (::fdatasync(fd) == -1)
+			throw fs_error::get("fdatasync()");
+		close_file(fd);
+		fd = -1;
+		rename_path(tmp, path);
+	} catch (...) {
+		if (fd != -1)
+			::close(fd);
+		::unlink(tmp.c_str());
+		throw;
+	}
+}
+
+/**
+ *  @breif  Typed, zero-copy view of a record file.
+ *
+ *  The payload is used straight from the mapping, so loading is
+ *  independent of the file size unless the checksum is verified.
+ */
+template <typename T>
+class record_view {
+public:
+	static_assert(std::is_trivially_copyable<T>::value,
+		      "records must be trivially copyable");
+
+	explicit record_view(const std::string& path, bool verify = false)
+		: map_(path)
+	{
+		if (map_.size() < sizeof(record_header))
+			throw fs_error::get(EINVAL, "record_view(): short file");
+
+		record_header hdr;
+		std::memcpy(&hdr, map_.data(), sizeof(hdr));
+
+		if (std::memcmp(hdr.magic, record_magic, sizeof(hdr.magic)) != 0)
+			throw fs_error::get(EINVAL, "record_view(): bad magic");
+		if (hdr.version != record_version)
+			throw fs_error::get(EINVAL, "record_view(): unknown version");
+		if (hdr.endian != record_endian)
+			throw fs_error::get(EINVAL, "record_view(): byte order mismatch");
+		if (hdr.record_size != sizeof(T))
+			throw fs_error::get(EINVAL, "record_view(): record size mismatch");
+		if (hdr.count > (map_.size() - sizeof(hdr)) / sizeof(T))
+			throw fs_error::get(EINVAL, "record_view(): truncated payload");
+
+		data_ = reinterpret_cast<const T*>(map_.data() + sizeof(hdr));
+		size_ = static_cast<std::size_t>(hdr.count);
+
+		if (verify && checksum64(data_, size_ * sizeof(T)) != hdr.checksum)
+			throw fs_error::get(EILSEQ, "record_view(): checksum mismatch");
+	}
+
+	[[nodiscard]]
+	const T* data() const noexcept
+	{ return data_; }
+
+	[[nodiscard]]
+	std::size_t size() const noexcept
+	{ return size_; }
+
+	[[nodiscard]]
+	bool empty() const noexcept
+	{ return size_ == 0; }
+
+	const T* begin() const noexcept
+	{ return data_; }
+
+	const T* end() const noexcept
+	{ return data_ + size_; }
+
+	const T& operator[](std::size_t i) const noexcept
+	{ return data_[i]; }
+
+private:
+	mapped_file map_;
+	const T* data_ = nullptr;
+	std::size_t size_ = 0;
+};
+
+/**
+ *  @breif  Allocator that default-initializes instead of value-initializing.
+ *
+ *  Resizing a container that uses it leaves trivial elements
+ *  uninitialized, so buffers about to be overwritten by read() are
+ *  not zero-filled first.
+ */
+template <typename T>
+struct default_init_allocator : std::allocator<T> {
+	template <typename U>
+	struct rebind { using other = default_init_allocator<U>; };
+
+	default_init_allocator() = default;
+
+	template <typename U>
+	default_init_allocator(const default_init_allocator<U>&) noexcept {}
+
+	template <typename U>
+	void construct(U* p) noexcept(std::is_nothrow_default_constructible<U>::value)
+	{ ::new (static_cast<void*>(p)) U; }
+
+	template <typename U, typename... Args>
+	void construct(U* p, Args&&... args)
+	{ ::new (static_cast<void*>(p)) U(std::forward<Args>(args)...); }
+};
+
+/**
+ *  @breif  Byte container whose resize() does not zero-fill: a
+ *  std::vector<std::byte> but for the allocator.
+ */
+using byte_buffer = std::vector<std::byte, default_init_allocator<std::byte>>;
+
+/**
+ *  @breif  Resize a container without caring about the new contents.
+ *  @return None.
+ *  @type   Private function (intended)
+ */
+template <typename C>
+void resize_uninit(C& c, std::size_t n)
+{
+#ifdef __cpp_lib_string_resize_and_overwrite
+	if constexpr (std::is_same<C, std::string>::value) {
+		c.resize_and_overwrite(n, [](char*, std::size_t len) { return len; });
+		return;
+	}
+#endif
+	c.resize(n);
+}
+
+/**
+ *  @breif  Write all data, retrying on short writes.
+ *  @return None.
+ */
+void write_all(int fd, const void* ptr, std::size_t nbytes)
+{
+	auto p = static_cast<const char*>(ptr);
+	io_probe probe;
+
+	while (nbytes > 0) {
+		auto sz = ::write(fd, p, nbytes);
+		probe.write(sz);
+		if (sz == -1) {
+			if (errno == EINTR)
+				continue;
+			throw fs_error::get("write()");
+		}
+		p += sz;
+		nbytes -= static_cast<std::size_t>(sz);
+	}
+}
+
+/**
+ *  @breif  Read a whole file into a container.
+ *  @return The file contents, as fs::byte_buffer by default.
+ *
+ *  The buffer is sized from a single fstat() and grows geometrically
+ *  when the file turns out to be larger, which also covers procfs
+ *  files and pipes that report a size of 0. Regular files of at least
+ *  mmap_threshold bytes are copied out of a mapping instead; pass 0
+ *  to always use read(). The mapping path must not be used on files
+ *  that may be truncated while being read.
+ *
+ *  Only fs::byte_buffer skips zero-filling the buffer everywhere.
+ *  read_file<std::string>() does so only with C++23's
+ *  resize_and_overwrite(), and std::vector<std::byte> or std::string
+ *  before C++23 are zero-filled before the read.
+ */
+template <typename C = byte_buffer>
+[[nodiscard]]
+C read_file(const std::string& path, std::size_t mmap_threshold = 64 << 20)
+{
+	static_assert(sizeof(typename C::value_type) == 1,
+		      "read_file() needs a byte sized container");
+
+	auto fd = open_file(path, fs_omode::readonly | fs_omode::close_exec);
+	C out;
+
+	try {
+		struct stat st;
+		if (::fstat(fd, &st) == -1)
+			throw fs_error::get("fstat()");
+
+		const auto hint = static_cast<std::size_t>(st.st_size);
+		if (S_ISREG(st.st_mode) && mmap_threshold > 0 &&
+		    hint >= mmap_threshold) {
+			mapped_file map(fd);
+			map.advise(MADV_SEQUENTIAL);
+			resize_uninit(out, map.size());
+			std::memcpy(&out[0], map.data(), map.size());
+			::close(fd);
+			return out;
+		}
+
+		// One spare byte lets a file of the expected size hit EOF
+		// without growing the buffer.
+		std::size_t len = 0;
+		io_probe probe;
+		resize_uninit(out, hint > 0 ? hint + 1 : 4096);
+		for (;;) {
+			if (len == out.size())
+				resize_uninit(out, out.size() * 2);
+
+			auto sz = ::read(fd, &out[len], out.size() - len);
+			probe.read(sz);
+			if (sz == -1) {
+				if (errno == EINTR)
+					continue;
+				throw fs_error::get("read()");
+			}
+			if (sz == 0)
+				break;
+			len += static_cast<std::size_t>(sz);
+		}
+		out.resize(len);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+
+	close_file(fd);
+	return out;
+}
+
+/**
+ *  @breif  Read at an offset until nbytes are read or EOF is hit.
+ *  @return The size of the data it read in bytes.
+ */
+std::size_t pread_all(int fd, void* ptr, std::size_t nbytes, off_t offset)
+{
+	auto p = static_cast<char*>(ptr);
+	std::size_t done = 0;
+	io_probe probe;
+
+	while (done < nbytes) {
+		auto sz = ::pread(fd, p + done, nbytes - done,
+				  offset + static_cast<off_t>(done));
+		probe.read(sz);
+		if (sz == -1) {
+			if (errno == EINTR)
+				continue;
+			throw fs_error::get("pread()");
+		}
+		if (sz == 0)
+			break;
+		done += static_cast<std::size_t>(sz);
+	}
+
+	return done;
+}
+
+/**
+ *  @breif  Write all data at an offset, retrying on short writes.
+ *  @return None.
+ */
+void pwrite_all(int fd, const void* ptr, std::size_t nbytes, off_t offset)
+{
+	auto p = static_cast<const char*>(ptr);
+	io_probe probe;
+
+	while (nbytes > 0) {
+		auto sz = ::pwrite(fd, p, nbytes, offset);
+		probe.write(sz);
+		if (sz == -1) {
+			if (errno == EINTR)
+				continue;
+			throw fs_error::get("pwrite()");
+		}
+		p += sz;
+		offset += sz;
+		nbytes -= static_cast<std::size_t>(sz);
+	}
+}
+
+/**
+ *  @breif  Check whether a memory range holds only zero bytes.
+ *  @return True if every byte is zero.
+ *
+ *  Works a 64-byte line at a time with eight independent word loads
+ *  OR-ed together, a shape the compiler turns into vector loads, and
+ *  only branches once per line.
+ */
+[[nodiscard]]
+bool is_zero(const void* ptr, std::size_t nbytes) noexcept
+{
+	auto p = static_cast<const unsigned char*>(ptr);
+
+	for (; nbytes >= 64; p += 64, nbytes -= 64) {
+		std::uint64_t w[8];
+		std::memcpy(w, p, sizeof(w));
+		if ((w[0] | w[1] | w[2] | w[3] | w[4] | w[5] | w[6] | w[7]) != 0)
+			return false;
+	}
+
+	unsigned char acc = 0;
+	while (nbytes-- > 0)
+		acc |= *p++;
+	return acc == 0;
+}
+
+/**
+ *  @breif  Write data at an offset, skipping blocks that are all zero.
+ *  @return The number of bytes that were not written, left or made
+ *  into holes.
+ *
+ *  Zero blocks past the end of the file are skipped and come back as
+ *  holes once the file is extended to off + nbytes. Zero blocks over
+ *  existing data have their range deallocated with
+ *  FALLOC_FL_PUNCH_HOLE, so they read back as zeros as well; where
+ *  that is not supported the zeros are written.
+ */
+std::size_t pwrite_sparse(int fd, const void* ptr, std::size_t nbytes, off_t off,
+			  std::size_t block_size = 4096)
+{
+	auto p = static_cast<const char*>(ptr);
+	const auto eof = static_cast<off_t>(file_size(fd));
+	std::size_t skipped = 0;
+
+	const auto clear = [&](std::size_t at, std::size_t len)
+	{
+		const auto from = off + static_cast<off_t>(at);
+		if (from < eof) {
+			const auto n = static_cast<std::size_t>(
+				std::min<off_t>(static_cast<off_t>(len), eof - from));
+#ifdef __linux__
+			if (::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, from,
+					static_cast<off_t>(n)) == -1) {
+				if (errno != EOPNOTSUPP && errno != ENOSYS)
+					throw fs_error::get("fallocate()");
+				pwrite_all(fd, p + at, n, from);
+				len -= n;
+			}
+#else
+			pwrite_all(fd, p + at, n, from);
+			len -= n;
+#endif
+		}
+		skipped += len;
+	};
+
+	// Runs of data blocks and of zero blocks, each handled in one call.
+	const auto block = [&](std::size_t pos)
+	{ return std::min(block_size, nbytes - pos); };
+	for (std::size_t pos = 0; pos < nbytes; ) {
+		const bool zero = is_zero(p + pos, block(pos));
+		auto end = pos + block(pos);
+		while (end < nbytes && is_zero(p + end, block(end)) == zero)
+			end += block(end);
+
+		if (zero)
+			clear(pos, end - pos);
+		else
+			pwrite_all(fd, p + pos, end - pos, off + static_cast<off_t>(pos));
+		pos = end;
+	}
+
+	const auto end = off + static_cast<off_t>(nbytes);
+	if (skipped > 0 && eof < end && ::ftruncate(fd, end) == -1)
+		throw fs_error::get("ftruncate()");
+
+	return skipped;
+}
+
+/**
+ *  @breif  Replace the contents of a file.
+ *  @return None.
+ *
+ *  With sparse set, all-zero blocks are left as holes instead of being
+ *  written.
+ */
+template <typename T>
+void write_file(const std::string& path, const T* ptr, std::size_t nbytes,
+		mode_t mode = fs_perms::owner_read | fs_perms::owner_write |
+		fs_perms::group_read | fs_perms::others_read, bool sparse = false)
+{
+	auto fd = open_file(path, fs_omode::writeonly | fs_omode::create |
+			    fs_omode::truncate | fs_omode::close_exec, mode);
+	try {
+		if (sparse)
+			pwrite_sparse(fd, ptr, nbytes, 0);
+		else
+			write_all(fd, ptr, nbytes);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	close_file(fd);
+}
+
+/**
+ *  @breif  Replace the contents of a file with a contiguous container.
+ *  @return None.
+ */
+template <typename C>
+void write_file(const std::string& path, const C& data)
+{
+	write_file(path, data.data(), data.size() * sizeof(*data.data()));
+}
+
+/**
+ *  @breif  Knobs for external_sort().
+ *
+ *  An empty temp_dir places the sorted runs next to the output file,
+ *  a temp_limit of 0 leaves temporary space unbounded and 0 threads
+ *  means one per hardware thread. temp_limit only covers the sorted
+ *  runs; the output, as big as the input, is written next to it on
+ *  top of that.
+ */
+struct sort_options {
+	std::string temp_dir;
+	std::uintmax_t temp_limit = 0;
+	unsigned threads = 0;
+};
+
+/**
+ *  @breif  Sort a file of fixed size records that may not fit in memory.
+ *  @return None.
+ *
+ *  Sorted runs are built in parallel, each thread using its share of
+ *  memory_budget, and spilled to unlinked temporary files. The runs
+ *  are then merged in one pass through a loser tree, with a large
+ *  read buffer per run and readahead hints for the next block. The
+ *  output only replaces the old file once it is complete, so sorting a
+ *  file onto itself is fine. It keeps the permissions of the file it
+ *  replaces, or takes those of the input when output is new.
+ */
+template <typename T, typename Compare = std::less<T>>
+void external_sort(const std::string& input, const std::string& output,
+		   Compare comp = Compare(), std::size_t memory_budget = 256 << 20,
+		   const sort_options& opts = sort_options())
+{
+	static_assert(std::is_trivially_copyable<T>::value,
+		      "records must be trivially copyable");
+
+	struct fd_guard {
+		std::vector<int> fds;
+		std::string temp;
+		~fd_guard()
+		{
+			for (auto fd : fds)
+				if (fd != -1)
+					::close(fd);
+			if (!temp.empty())
+				::unlink(temp.c_str());
+		}
+	} guard;
+
+	auto in = open_file(input, fs_omode::readonly | fs_omode::close_exec);
+	guard.fds.push_back(in);
+
+	const auto in_size = static_cast<std::uintmax_t>(file_size(in));
+	if (in_size % sizeof(T) != 0)
+		throw fs_error::get(EINVAL, "external_sort(): partial record");
+	const auto total = static_cast<std::size_t>(in_size / sizeof(T));
+	::posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	// The result goes to a sibling that replaces output at the end, so
+	// output may be the input itself (or a link to it).
+	auto out = create_sibling(output, guard.temp,
+				  fs_perms::owner_read | fs_perms::owner_write |
+				  fs_perms::group_read | fs_perms::others_read);
+	guard.fds.push_back(out);
+
+	struct stat mode;
+	if (::stat(output.c_str(), &mode) == -1 && ::fstat(in, &mode) == -1)
+		throw fs_error::get("fstat()");
+	if (::fchmod(out, mode.st_mode & fs_perms::mask) == -1)
+		throw fs_error::get("fchmod()");
+
+	auto finish = [&]
+	{
+		rename_path(guard.temp, output);
+		guard.temp.clear();
+	};
+
+	// Small enough, sort in memory.
+	if (in_size <= memory_budget) {
+		std::vector<T, default_init_allocator<T>> buf(total);
+		if (pread_all(in, buf.data(), total * sizeof(T), 0) != total * sizeof(T))
+			throw fs_error::get(EIO, "external_sort(): input shrank");
+		std::sort(buf.begin(), buf.end(), comp);
+		write_all(out, buf.data(), total * sizeof(T));
+		finish();
+		return;
+	}
+
+	auto threads = opts.threads ? opts.threads : std::thread::hardware_concurrency();
+	if (threads == 0)
+		threads = 1;
+	const auto run_len = std::max<std::size_t>(1, memory_budget / threads / sizeof(T));
+	const auto nruns = (total + run_len - 1) / run_len;
+	threads = static_cast<unsigned>(std::min<std::size_t>(threads, nruns));
+
+	std::string temp_dir = opts.temp_dir;
+	if (temp_dir.empty()) {
+		const auto pos = output.rfind('/');
+		temp_dir = pos == std::string::npos ? "." :
+			pos == 0 ? "/" : output.substr(0, pos);
+	}
+
+	std::vector<int> runs(nruns, -1);
+	std::atomic<std::size_t> next { 0 };
+	std::atomic<std::uintmax_t> temp_used { 0 };
+	std::mutex err_mtx;
+	std::exception_ptr err;
+
+	auto make_runs = [&]
+	{
+		std::vector<T, default_init_allocator<T>> buf(run_len);
+		try {
+			for (auto i = next++; i < nruns; i = next++) {
+				const auto first = i * run_len;
+				const auto n = std::min(run_len, total - first);
+				const auto bytes = n * sizeof(T);
+
+				if (opts.temp_limit > 0 &&
+				    (temp_used += bytes) > opts.temp_limit)
+					throw fs_error::get(ENOSPC, "external_sort(): temp_limit");
+
+				if (pread_all(in, buf.data(), bytes,
+					      static_cast<off_t>(first * sizeof(T))) != bytes)
+					throw fs_error::get(EIO, "external_sort(): input shrank");
+				std::sort(buf.begin(), buf.begin() + n, comp);
+
+				auto name = temp_dir + "/.fs_mini_run.XXXXXX";
+				auto fd = ::mkostemp(&name[0], O_CLOEXEC);
+				if (fd == -1)
+					throw fs_error::get("mkostemp()");
+				::unlink(name.c_str());
+				runs[i] = fd;
+				write_all(fd, buf.data(), bytes);
+			}
+		} catch (...) {
+			std::lock_guard<std::mutex> lk(err_mtx);
+			if (!err)
+				err = std::current_exception();
+			next = nruns;
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned t = 1; t < threads; ++t)
+		pool.push_back(scoped_thread(make_runs));
+	make_runs();
+	for (auto& t : pool)
+		t.join();
+	guard.fds.insert(guard.fds.end(), runs.begin(), runs.end());
+	if (err)
+		std::rethrow_exception(err);
+
+	// Merge phase: one read buffer per run plus the output buffer.
+	struct run_state {
+		int fd;
+		std::size_t left;
+		std::size_t pos;
+		std::size_t len;
+		off_t off;
+		std::vector<T, default_init_allocator<T>> buf;
+	};
+
+	const auto k = nruns;
+	const auto buf_len = std::max<std::size_t>(
+		(64 << 10) / sizeof(T) + 1, memory_budget / (k + 1) / sizeof(T));
+	std::vector<run_state> st(k);
+
+	auto refill = [&](run_state& r)
+	{
+		const auto n = std::min(buf_len, r.left);
+		const auto bytes = n * sizeof(T);
+		if (pread_all(r.fd, r.buf.data(), bytes, r.off) != bytes)
+			throw fs_error::get(EIO, "external_sort(): short run");
+		r.off += static_cast<off_t>(bytes);
+		r.left -= n;
+		r.pos = 0;
+		r.len = n;
+		if (r.left > 0)
+			::posix_fadvise(r.fd, r.off,
+					static_cast<off_t>(std::min(buf_len, r.left) * sizeof(T)),
+					POSIX_FADV_WILLNEED);
+	};
+
+	for (std::size_t i = 0; i < k; ++i) {
+		st[i].fd = runs[i];
+		st[i].left = std::min(run_len, total - i * run_len);
+		st[i].off = 0;
+		st[i].buf.resize(buf_len);
+		refill(st[i]);
+	}
+
+	// Exhausted runs compare greater than everything.
+	auto less = [&](std::size_t a, std::size_t b)
+	{
+		if (st[a].len == 0)
+			return false;
+		if (st[b].len == 0)
+			return true;
+		const auto& x = st[a].buf[st[a].pos];
+		const auto& y = st[b].buf[st[b].pos];
+		if (comp(y, x))
+			return false;
+		return comp(x, y) || a < b;
+	};
+
+	// tree[0] holds the winner, tree[1..k-1] the losers of each match.
+	std::vector<std::size_t> tree(k), win(2 * k);
+	for (std::size_t i = 0; i < k; ++i)
+		win[k + i] = i;
+	for (auto n = k - 1; n >= 1; --n) {
+		const auto a = win[2 * n], b = win[2 * n + 1];
+		const auto b_wins = less(b, a);
+		win[n] = b_wins ? b : a;
+		tree[n] = b_wins ? a : b;
+	}
+	tree[0] = k > 1 ? win[1] : 0;
+
+	std::vector<T, default_init_allocator<T>> obuf(buf_len);
+	std::size_t olen = 0;
+
+	for (std::size_t done = 0; done < total; ++done) {
+		auto s = tree[0];
+		auto& r = st[s];
+
+		obuf[olen++] = r.buf[r.pos];
+		if (olen == buf_len) {
+			write_all(out, obuf.data(), olen * sizeof(T));
+			olen = 0;
+		}
+
+		if (++r.pos == r.len) {
+			if (r.left > 0)
+				refill(r);
+			else
+				r.len = 0;
+		}
+
+		for (auto n = (s + k) / 2; n > 0; n /= 2) {
+			if (less(tree[n], s))
+				std::swap(tree[n], s);
+		}
+		tree[0] = s;
+	}
+
+	write_all(out, obuf.data(), olen * sizeof(T));
+	finish();
+}
+
+#ifdef __linux__
+
+/**
+ *  @breif  Wait on a futex word shared between processes.
+ *  @return False if the timeout expired, true otherwise.
+ *  @type   Private function (intended)
+ */
+bool futex_wait(std::atomic<std::uint32_t>* addr, std::uint32_t val, int timeout_ms)
+{
+	struct timespec ts, *tsp = nullptr;
+
+	if (timeout_ms >= 0) {
+		ts.tv_sec = timeout_ms / 1000;
+		ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+		tsp = &ts;
+	}
+
+	if (::syscall(SYS_futex, addr, FUTEX_WAIT, val, tsp, nullptr, 0) == -1) {
+		if (errno == ETIMEDOUT)
+			return false;
+		if (errno != EAGAIN && errno != EINTR)
+			throw fs_error::get("futex()");
+	}
+
+	return true;
+}
+
+/**
+ *  @breif  Wake waiters on a futex word shared between processes.
+ *  @return None.
+ *  @type   Private function (intended)
+ */
+void futex_wake(std::atomic<std::uint32_t>* addr, int count)
+{
+	if (::syscall(SYS_futex, addr, FUTEX_WAKE, count, nullptr, nullptr, 0) == -1)
+		throw fs_error::get("futex()");
+}
+
+/**
+ *  @breif  Multi-producer, single-consumer message ring in shared memory.
+ *
+ *  The ring lives in a file (typically on /dev/shm, or a memfd) that
+ *  every process maps. Producers reserve space with a CAS on the head
+ *  index, copy their message in and commit it by stamping the record
+ *  header with its position; they never wait for each other. The
+ *  consumer owns the read index and takes records in reservation
+ *  order as their stamps appear. The indices sit on separate cache
+ *  lines and futexes are only touched when a side actually sleeps, so
+ *  a busy ring passes messages without any syscall.
+ *
+ *  A producer that dies between reserving and committing leaves a
+ *  record that is never committed: the consumer stops there for good,
+ *  and once the ring fills so do the producers. After a producer
+ *  crashed, recreate the ring.
+ */
+class shm_ring {
+public:
+	/**
+	 *  @breif  Create (or reset) a ring at path with capacity bytes of
+	 *  message space, rounded up to a power of two.
+	 */
+	shm_ring(const std::string& path, std::size_t capacity,
+		 mode_t mode = fs_perms::owner_read | fs_perms::owner_write)
+	{
+		auto fd = open_file(path, fs_omode::read_write | fs_omode::create |
+				    fs_omode::close_exec, mode);
+		init(fd, capacity);
+	}
+
+	/**
+	 *  @breif  Attach to an existing ring.
+	 */
+	explicit shm_ring(const std::string& path)
+	{
+		auto fd = open_file(path, fs_omode::read_write | fs_omode::close_exec);
+		init(fd, 0);
+	}
+
+	/**
+	 *  @breif  Create a ring on an open descriptor (e.g. a memfd), or
+	 *  attach to it if capacity is 0. The ring takes ownership of fd.
+	 */
+	shm_ring(int fd, std::size_t capacity)
+	{ init(fd, capacity); }
+
+	shm_ring(const shm_ring&) = delete;
+	shm_ring& operator=(const shm_ring&) = delete;
+
+	~shm_ring()
+	{
+		::munmap(hdr_, map_size_);
+		::close(fd_);
+	}
+
+	/**
+	 *  @breif  Append a message if there is room for it.
+	 *  @return True if the message was queued.
+	 */
+	template <typename T>
+	bool try_push(const T* ptr, std::size_t nbytes)
+	{
+		const auto rec = record_size(nbytes);
+		const auto cap = hdr_->capacity;
+		std::uint64_t h, need;
+
+		h = hdr_->head.load(std::memory_order_relaxed);
+		do {
+			const auto to_end = cap - (h & (cap - 1));
+			need = rec <= to_end ? rec : to_end + rec;
+			if (h + need - hdr_->read.load(std::memory_order_acquire) > cap)
+				return false;
+		} while (!hdr_->head.compare_exchange_weak(h, h + need,
+							   std::memory_order_relaxed));
+
+		auto pos = h & (cap - 1);
+		if (need != rec) {
+			put_header(pos, 0, pad_flag);
+			commit(pos, h);
+			h += cap - pos;
+			pos = 0;
+		}
+		put_header(pos, static_cast<std::uint32_t>(nbytes), 0);
+		std::memcpy(data_ + pos + record_header, ptr, nbytes);
+		commit(pos, h);
+
+		if (hdr_->consumer_waiting.load(std::memory_order_seq_cst)) {
+			hdr_->data_seq.fetch_add(1, std::memory_order_seq_cst);
+			futex_wake(&hdr_->data_seq, 1);
+		}
+
+		return true;
+	}
+
+	/**
+	 *  @breif  Append a message, sleeping while the ring is full.
+	 *  @return False if timeout_ms expired first.
+	 */
+	template <typename T>
+	bool push(const T* ptr, std::size_t nbytes, int timeout_ms = -1)
+	{
+		const auto deadline = std::chrono::steady_clock::now() +
+			std::chrono::milliseconds(timeout_ms);
+
+		for (;;) {
+			if (try_push(ptr, nbytes))
+				return true;
+
+			hdr_->producers_waiting.fetch_add(1, std::memory_order_seq_cst);
+			const auto seq = hdr_->space_seq.load(std::memory_order_seq_cst);
+			bool ok = true;
+			if (!has_space(nbytes))
+				ok = futex_wait(&hdr_->space_seq, seq, remaining(deadline, timeout_ms));
+			hdr_->producers_waiting.fetch_sub(1, std::memory_order_seq_cst);
+
+			if (!ok || (timeout_ms >= 0 && std::chrono::steady_clock::now() >= deadline))
+				return try_push(ptr, nbytes);
+		}
+	}
+
+	/**
+	 *  @breif  Hand the next message to fn(const char*, std::size_t)
+	 *  in place, then release its space.
+	 *  @return False if the ring was empty.
+	 *
+	 *  Only one thread (in one process) may consume.
+	 */
+	template <typename F>
+	bool try_consume(F&& fn)
+	{
+		const auto cap = hdr_->capacity;
+		auto r = hdr_->read.load(std::memory_order_relaxed);
+
+		for (;;) {
+			if (!committed(r))
+				return false;
+
+			std::uint32_t len, flags;
+			const auto pos = r & (cap - 1);
+			std::memcpy(&len, data_ + pos, 4);
+			std::memcpy(&flags, data_ + pos + 4, 4);
+
+			if (flags & pad_flag) {
+				r += cap - pos;
+				hdr_->read.store(r, std::memory_order_release);
+				continue;
+			}
+
+			fn(static_cast<const char*>(data_ + pos + record_header),
+			   static_cast<std::size_t>(len));
+			hdr_->read.store(r + record_size(len), std::memory_order_seq_cst);
+			break;
+		}
+
+		if (hdr_->producers_waiting.load(std::memory_order_seq_cst)) {
+			hdr_->space_seq.fetch_add(1, std::memory_order_seq_cst);
+			futex_wake(&hdr_->space_seq, INT_MAX);
+		}
+
+		return true;
+	}
+
+	/**
+	 *  @breif  Copy the next message into out.
+	 *  @return False if the ring was empty.
+	 */
+	bool try_pop(std::string& out)
+	{
+		return try_consume([&out](const char* p, std::size_t n)
+				   { out.assign(p, n); });
+	}
+
+	/**
+	 *  @breif  Copy the next message into out, sleeping while the ring
+	 *  is empty.
+	 *  @return False if timeout_ms expired first.
+	 */
+	bool pop(std::string& out, int timeout_ms = -1)
+	{
+		const auto deadline = std::chrono::steady_clock::now() +
+			std::chrono::milliseconds(timeout_ms);
+
+		for (;;) {
+			if (try_pop(out))
+				return true;
+
+			hdr_->consumer_waiting.store(1, std::memory_order_seq_cst);
+			const auto seq = hdr_->data_seq.load(std::memory_order_seq_cst);
+			bool ok = true;
+			if (!committed(hdr_->read.load(std::memory_order_relaxed)))
+				ok = futex_wait(&hdr_->data_seq, seq, remaining(deadline, timeout_ms));
+			hdr_->consumer_waiting.store(0, std::memory_order_seq_cst);
+
+			if (!ok || (timeout_ms >= 0 && std::chrono::steady_clock::now() >= deadline))
+				return try_pop(out);
+		}
+	}
+
+	/**
+	 *  @breif  Largest message the ring accepts.
+	 *  @return Size in bytes.
+	 */
+	[[nodiscard]]
+	std::size_t max_message() const noexcept
+	{ return static_cast<std::size_t>(hdr_->capacity / 2 - record_header); }
+
+	/**
+	 *  @breif  Backing file descriptor, e.g. to pass a memfd along.
+	 *  @return The file descriptor.
+	 */
+	[[nodiscard]]
+	int native_handle() const noexcept
+	{ return fd_; }
+
+private:
+	static constexpr std::uint64_t ring_magic = 0x324e495248534d46ULL;
+	static constexpr std::uint32_t pad_flag = 1;
+
+	// Each record starts with its length, flags and a stamp that holds
+	// its position once committed. Records are aligned to the header
+	// size, so a pad record always fits at the end.
+	static constexpr std::uint64_t record_header = 16;
+
+	struct header {
+		std::atomic<std::uint64_t> magic;
+		std::uint64_t capacity;
+		alignas(64) std::atomic<std::uint64_t> head;
+		alignas(64) std::atomic<std::uint64_t> read;
+		alignas(64) std::atomic<std::uint32_t> data_seq;
+		std::atomic<std::uint32_t> consumer_waiting;
+		alignas(64) std::atomic<std::uint32_t> space_seq;
+		std::atomic<std::uint32_t> producers_waiting;
+	};
+
+	static constexpr std::size_t data_offset = 4096;
+	static_assert(sizeof(header) <= data_offset, "shm_ring header too large");
+	static_assert(std::atomic<std::uint64_t>::is_always_lock_free,
+		      "shm_ring needs lock-free 64-bit atomics");
+
+	void init(int fd, std::size_t capacity)
+	{
+		fd_ = fd;
+		try {
+			if (capacity > 0) {
+				std::size_t cap = 4096;
+				while (cap < capacity)
+					cap <<= 1;
+				map_size_ = data_offset + cap;
+				if (::ftruncate(fd, 0) == -1 ||
+				    ::ftruncate(fd, static_cast<off_t>(map_size_)) == -1)
+					throw fs_error::get("ftruncate()");
+			} else {
+				map_size_ = static_cast<std::size_t>(file_size(fd));
+				if (map_size_ < data_offset)
+					throw fs_error::get(EINVAL, "shm_ring: not a ring");
+			}
+
+			auto p = ::mmap(nullptr, map_size_, PROT_READ | PROT_WRITE,
+					MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED)
+				throw fs_error::get("mmap()");
+			hdr_ = static_cast<header*>(p);
+			data_ = static_cast<char*>(p) + data_offset;
+		} catch (...) {
+			::close(fd);
+			throw;
+		}
+
+		if (capacity > 0) {
+			// The file was just truncated, so everything else is zero.
+			hdr_->capacity = map_size_ - data_offset;
+			hdr_->magic.store(ring_magic, std::memory_order_release);
+		} else if (hdr_->magic.load(std::memory_order_acquire) != ring_magic ||
+			   hdr_->capacity != map_size_ - data_offset) {
+			::munmap(hdr_, map_size_);
+			::close(fd);
+			throw fs_error::get(EINVAL, "shm_ring: not a ring");
+		}
+	}
+
+	std::uint64_t record_size(std::size_t nbytes) const
+	{
+		if (nbytes > max_message())
+			throw fs_error::get(EMSGSIZE, "shm_ring: message too large");
+
+		return (record_header + static_cast<std::uint64_t>(nbytes) + record_header - 1) &
+			~(record_header - 1);
+	}
+
+	bool has_space(std::size_t nbytes) const
+	{
+		const auto cap = hdr_->capacity;
+		const auto rec = record_size(nbytes);
+		const auto h = hdr_->head.load(std::memory_order_seq_cst);
+		const auto to_end = cap - (h & (cap - 1));
+		const auto need = rec <= to_end ? rec : to_end + rec;
+		return h + need - hdr_->read.load(std::memory_order_seq_cst) <= cap;
+	}
+
+	void put_header(std::uint64_t pos, std::uint32_t len, std::uint32_t flags)
+	{
+		std::memcpy(data_ + pos, &len, 4);
+		std::memcpy(data_ + pos + 4, &flags, 4);
+	}
+
+	// The stamp is the record's absolute position plus one. An older
+	// stamp left in the slot is always smaller; stale payload would
+	// have to hold this exact 64-bit value at this exact spot.
+	std::uint64_t* stamp(std::uint64_t pos) const noexcept
+	{ return reinterpret_cast<std::uint64_t*>(data_ + pos + 8); }
+
+	void commit(std::uint64_t pos, std::uint64_t at) noexcept
+	{ __atomic_store_n(stamp(pos), at + 1, __ATOMIC_SEQ_CST); }
+
+	bool committed(std::uint64_t at) const noexcept
+	{ return __atomic_load_n(stamp(at & (hdr_->capacity - 1)), __ATOMIC_SEQ_CST) == at + 1; }
+
+	static int remaining(std::chrono::steady_clock::time_point deadline, int timeout_ms)
+	{
+		if (timeout_ms < 0)
+			return -1;
+
+		const auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+			deadline - std::chrono::steady_clock::now()).count();
+		return left > 0 ? static_cast<int>(left) : 0;
+	}
+
+	int fd_ = -1;
+	std::size_t map_size_ = 0;
+	header* hdr_ = nullptr;
+	char* data_ = nullptr;
+};
+
+#endif
+
+/**
+ *  @breif  Change the size of an opened file.
+ *  @return None.
+ */
+void resize_file(int fd, std::uintmax_t size)
+{
+	if (::ftruncate(fd, static_cast<off_t>(size)) == -1)
+		throw fs_error::get("ftruncate()");
+}
+
+/**
+ *  @breif  Send one message with up to fd_batch_max descriptors attached.
+ *  @return None.
+ *  @type   Private function (intended)
+ */
+void send_message(int sock, const void* data, std::size_t len,
+		  const int* fds, std::size_t nfds)
+{
+	struct iovec iov = { const_cast<void*>(data), len };
+	alignas(struct cmsghdr) char buf[CMSG_SPACE(sizeof(int) * 253)];
+
+	struct msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+
+	if (nfds > 0) {
+		std::memset(buf, 0, sizeof(buf));
+		msg.msg_control = buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+
+		auto cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		std::memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+
+	while (::sendmsg(sock, &msg, MSG_NOSIGNAL) == -1) {
+		if (errno != EINTR)
+			throw fs_error::get("sendmsg()");
+	}
+}
+
+/**
+ *  @breif  Receive one message and the descriptors attached to it.
+ *  @return The size of the data in bytes, 0 if the peer closed the
+ *  connection.
+ *  @type   Private function (intended)
+ */
+std::size_t recv_message(int sock, void* data, std::size_t len, std::vector<int>& fds)
+{
+	struct iovec iov = { data, len };
+	alignas(struct cmsghdr) char buf[CMSG_SPACE(sizeof(int) * 253)];
+
+	struct msghdr msg;
+	std::memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = buf;
+	msg.msg_controllen = sizeof(buf);
+
+	ssize_t sz;
+	while ((sz = ::recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) == -1) {
+		if (errno != EINTR)
+			throw fs_error::get("recvmsg()");
+	}
+
+	const auto first = fds.size();
+	for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr;
+	     cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+			continue;
+
+		const auto n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (std::size_t i = 0; i < n; ++i) {
+			int fd;
+			std::memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+			fds.push_back(fd);
+		}
+	}
+
+	if (msg.msg_flags & (MSG_CTRUNC | MSG_TRUNC)) {
+		for (auto i = first; i < fds.size(); ++i)
+			::close(fds[i]);
+		fds.resize(first);
+		throw fs_error::get(EMSGSIZE, "recvmsg(): message truncated");
+	}
+
+	return static_cast<std::size_t>(sz);
+}
+
+/**
+ *  @breif  Most descriptors the kernel accepts in one message (SCM_MAX_FD).
+ */
+constexpr std::size_t fd_batch_max = 253;
+
+/**
+ *  @breif  Send any number of descriptors over a Unix domain socket.
+ *  @return None.
+ *
+ *  The descriptors go out in as few messages as possible, each one
+ *  telling the receiver how many are still to come.
+ */
+void send_fds(int sock, const std::vector<int>& fds)
+{
+	std::size_t done = 0;
+
+	do {
+		const auto n = std::min(fd_batch_max, fds.size() - done);
+		const auto left = static_cast<std::uint32_t>(fds.size() - done - n);
+		send_message(sock, &left, sizeof(left), fds.data() + done, n);
+		done += n;
+	} while (done < fds.size());
+}
+
+/**
+ *  @breif  Receive descriptors sent with send_fds().
+ *  @return The new descriptors (close-on-exec), empty if the peer
+ *  closed the connection.
+ */
+[[nodiscard]]
+std::vector<int> recv_fds(int sock)
+{
+	std::vector<int> fds;
+	std::uint32_t left;
+
+	do {
+		if (recv_message(sock, &left, sizeof(left), fds) != sizeof(left)) {
+			for (auto fd : fds)
+				::close(fd);
+			if (fds.empty())
+				return fds;
+			throw fs_error::get(EBADMSG, "recv_fds(): incomplete batch");
+		}
+	} while (left > 0);
+
+	return fds;
+}
+
+/**
+ *  @breif  Send a file descriptor over a Unix domain socket.
+ *  @return None.
+ */
+inline void send_fd(int sock, int fd)
+{ send_fds(sock, std::vector<int>(1, fd)); }
+
+/**
+ *  @breif  Receive a file descriptor sent with send_fd().
+ *  @return The new descriptor (close-on-exec), or -1 if the peer
+ *  closed the connection.
+ */
+[[nodiscard]]
+int recv_fd(int sock)
+{
+	auto fds = recv_fds(sock);
+	if (fds.empty())
+		return -1;
+
+	for (std::size_t i = 1; i < fds.size(); ++i)
+		::close(fds[i]);
+	return fds[0];
+}
+
+#ifdef __linux__
+
+/**
+ *  @breif  Create an anonymous, memory backed file.
+ *  @return If successful, memfd_create() returns the file descriptor.
+ *
+ *  The result works with file_size(), resize_file(), mapped_file and
+ *  read_object()/write_object(), except that files created with
+ *  fs_mfd::hugetlb can not be written with write(): size them with
+ *  resize_file() and fill them through a writable mapped_file.
+ */
+[[nodiscard]]
+int memfd(const std::string& name,
+	  unsigned int flags = fs_mfd::close_exec | fs_mfd::allow_sealing)
+{
+	auto fd = ::memfd_create(name.c_str(), flags);
+	if (fd == -1)
+		throw fs_error::get("memfd_create()");
+
+	return fd;
+}
+
+/**
+ *  @breif  Add seals (fs_seal::*) to a memfd.
+ *  @return None.
+ */
+void add_seals(int fd, int seals)
+{
+	if (::fcntl(fd, F_ADD_SEALS, seals) == -1)
+		throw fs_error::get("fcntl()");
+}
+
+/**
+ *  @breif  Get the seals of a memfd.
+ *  @return The set of fs_seal::* bits.
+ */
+[[nodiscard]]
+int get_seals(int fd)
+{
+	auto seals = ::fcntl(fd, F_GET_SEALS);
+	if (seals == -1)
+		throw fs_error::get("fcntl()");
+
+	return seals;
+}
+
+/**
+ *  @breif  Check that a descriptor (e.g. received from another
+ *  process) carries all of the given seals.
+ *  @return If successful, it returns true, otherwise false.
+ *
+ *  With fs_seal::immutable present the contents can not change any
+ *  more, so a mapping of it can be used without copying or locking.
+ */
+[[nodiscard]]
+bool has_seals(int fd, int seals)
+{
+	auto cur = ::fcntl(fd, F_GET_SEALS);
+	if (cur == -1) {
+		if (errno == EINVAL)
+			return false;
+		throw fs_error::get("fcntl()");
+	}
+
+	return (cur & seals) == seals;
+}
+
+#endif
+
+/**
+ *  @breif  Access control for fd_broker.
+ *
+ *  Only processes running as uid may connect; the socket itself is
+ *  made 0600 and owned by uid. Requested paths must be absolute and
+ *  are resolved inside root as if it were "/" (".." and symlinks
+ *  cannot leave it), which needs openat2(); without it only root "/"
+ *  is served.
+ */
+struct broker_options {
+	std::string root = "/";
+	uid_t uid = ::geteuid();
+};
+
+/**
+ *  @breif  Service that keeps files open and hands their descriptors
+ *  out to other processes by path.
+ *
+ *  Workers connect to the broker's Unix socket (SOCK_SEQPACKET) with
+ *  fd_broker_client. Each path is opened once and cached, later
+ *  requests only cost a dup in the kernel, so a fleet of workers no
+ *  longer re-resolves the same files at startup. Requests and replies
+ *  are batched up to fd_batch_max paths per message. Client sockets
+ *  are nonblocking: a client that does not read its replies is
+ *  dropped instead of stalling the others.
+ *
+ *  Being dups, the descriptors of all clients share one open file
+ *  description: one file offset and one set of status flags. Only
+ *  positional I/O (pread_all(), pwrite_all(), mapped_file) is safe on
+ *  them; read(), write(), lseek() and fcntl(F_SETFL) race with every
+ *  other worker. A cached file is reopened once its last link is gone,
+ *  so a file replaced by rename() is picked up on the next request.
+ *  A stale socket left at sock_path by a dead broker is replaced, a
+ *  live one or any other kind of file is not.
+ */
+class fd_broker {
+public:
+	explicit fd_broker(const std::string& sock_path,
+			   int flags = fs_omode::readonly,
+			   const broker_options& opts = broker_options())
+		: sock_path_(sock_path), flags_(flags | fs_omode::close_exec),
+		  uid_(opts.uid), confined_(opts.root != "/")
+	{
+		struct sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (sock_path.size() >= sizeof(addr.sun_path))
+			throw fs_error::get(ENAMETOOLONG, "fd_broker");
+		std::memcpy(addr.sun_path, sock_path.c_str(), sock_path.size());
+
+		root_fd_ = ::open(opts.root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (root_fd_ == -1)
+			throw fs_error::get("fd_broker: root");
+
+		listen_fd_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (listen_fd_ == -1) {
+			const auto err = fs_error::get("socket()");
+			::close(root_fd_);
+			throw err;
+		}
+
+		// Nobody can connect before listen(), so tightening the mode
+		// in between leaves no window.
+		if (!bind_socket(addr)) {
+			const auto err = fs_error::get("fd_broker: bind()");
+			::close(listen_fd_);
+			::close(root_fd_);
+			throw err;
+		}
+		if (::chmod(sock_path.c_str(), fs_perms::owner_read | fs_perms::owner_write) == -1 ||
+		    (uid_ != ::geteuid() &&
+		     ::chown(sock_path.c_str(), uid_, static_cast<gid_t>(-1)) == -1) ||
+		    ::listen(listen_fd_, SOMAXCONN) == -1 ||
+		    ::pipe2(stop_pipe_, O_CLOEXEC) == -1) {
+			const auto err = fs_error::get("fd_broker");
+			::close(listen_fd_);
+			::close(root_fd_);
+			::unlink(sock_path.c_str());
+			throw err;
+		}
+
+		thread_ = std::thread([this] { run(); });
+	}
+
+	fd_broker(const fd_broker&) = delete;
+	fd_broker& operator=(const fd_broker&) = delete;
+
+	~fd_broker()
+	{
+		char c = 0;
+		while (::write(stop_pipe_[1], &c, 1) == -1 && errno == EINTR)
+			;
+		thread_.join();
+
+		for (const auto& ent : cache_)
+			::close(ent.second.fd);
+		::close(stop_pipe_[0]);
+		::close(stop_pipe_[1]);
+		::close(listen_fd_);
+		::close(root_fd_);
+		::unlink(sock_path_.c_str());
+	}
+
+	/**
+	 *  @breif  Open files ahead of the first request.
+	 *  @return None.
+	 */
+	void preload(const std::vector<std::string>& paths)
+	{
+		for (const auto& path : paths) {
+			int err;
+			bool kept;
+			const auto fd = lookup(path, err, kept);
+			if (fd != -1 && !kept)
+				::close(fd);
+		}
+	}
+
+	/**
+	 *  @breif  Number of descriptors held by the broker.
+	 *  @return The count.
+	 */
+	[[nodiscard]]
+	std::size_t cached() const
+	{
+		std::lock_guard<std::mutex> lk(mtx_);
+		return cache_.size();
+	}
+
+private:
+	// Bind, replacing only a socket nobody listens on any more.
+	bool bind_socket(const struct sockaddr_un& addr)
+	{
+		auto sa = reinterpret_cast<const struct sockaddr*>(&addr);
+		if (::bind(listen_fd_, sa, sizeof(addr)) == 0)
+			return true;
+		if (errno != EADDRINUSE)
+			return false;
+
+		struct stat st;
+		if (::lstat(addr.sun_path, &st) == -1 || !S_ISSOCK(st.st_mode)) {
+			errno = EADDRINUSE;
+			return false;
+		}
+		auto probe = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (probe == -1)
+			return false;
+		const bool live = ::connect(probe, sa, sizeof(addr)) == 0 || errno != ECONNREFUSED;
+		::close(probe);
+		if (live) {
+			errno = EADDRINUSE;
+			return false;
+		}
+
+		return ::unlink(addr.sun_path) == 0 && ::bind(listen_fd_, sa, sizeof(addr)) == 0;
+	}
+
+	// kept is false for a descriptor the caller has to close itself.
+	int lookup(const std::string& path, int& err, bool& kept)
+	{
+		std::lock_guard<std::mutex> lk(mtx_);
+
+		err = 0;
+		kept = true;
+		if (path.empty() || path[0] != '/') {
+			err = EINVAL;
+			return -1;
+		}
+
+		auto it = cache_.find(path);
+		if (it != cache_.end()) {
+			// Replaced or removed: the name now means another file.
+			struct stat st;
+			if (::fstat(it->second.fd, &st) == 0 && st.st_nlink > 0)
+				return it->second.fd;
+			::close(it->second.fd);
+			cache_.erase(it);
+		}
+
+		auto fd = open_beneath(path);
+		if (fd == -1) {
+			err = errno;
+			return -1;
+		}
+
+		// Past the fd budget the file is still served, only not kept.
+		auto res = fd_budget::global().reserve(1);
+		if (!res) {
+			kept = false;
+			return fd;
+		}
+		cache_.emplace(path, entry { fd, std::move(res) });
+		return fd;
+	}
+
+	int open_beneath(const std::string& path) const
+	{
+#if defined(__linux__) && defined(SYS_openat2)
+		struct open_how how;
+		std::memset(&how, 0, sizeof(how));
+		how.flags = static_cast<std::uint64_t>(flags_);
+		how.resolve = RESOLVE_IN_ROOT | RESOLVE_NO_MAGICLINKS;
+
+		const auto fd = static_cast<int>(::syscall(SYS_openat2, root_fd_, path.c_str(),
+							   &how, sizeof(how)));
+		if (fd != -1 || errno != ENOSYS)
+			return fd;
+#endif
+		if (confined_) {
+			errno = ENOSYS;
+			return -1;
+		}
+		return ::open(path.c_str(), flags_);
+	}
+
+	bool allowed(int client) const
+	{
+#ifdef SO_PEERCRED
+		struct ucred cred;
+		socklen_t len = sizeof(cred);
+		if (::getsockopt(client, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+			return false;
+		return cred.uid == uid_;
+#else
+		uid_t uid;
+		gid_t gid;
+		return ::getpeereid(client, &uid, &gid) == 0 && uid == uid_;
+#endif
+	}
+
+	void run()
+	{
+		std::vector<struct pollfd> pfds = {
+			{ stop_pipe_[0], POLLIN, 0 },
+			{ listen_fd_, POLLIN, 0 },
+		};
+
+		for (;;) {
+			if (::poll(pfds.data(), pfds.size(), -1) == -1) {
+				if (errno == EINTR)
+					continue;
+				break;
+			}
+			if (pfds[0].revents)
+				break;
+
+			if (pfds[1].revents & POLLIN) {
+				auto client = ::accept4(listen_fd_, nullptr, nullptr,
+							SOCK_CLOEXEC | SOCK_NONBLOCK);
+				if (client != -1 && allowed(client))
+					pfds.push_back({ client, POLLIN, 0 });
+				else if (client != -1)
+					::close(client);
+			}
+
+			for (std::size_t i = 2; i < pfds.size(); ) {
+				if (pfds[i].revents == 0 || serve(pfds[i].fd)) {
+					pfds[i++].revents = 0;
+					continue;
+				}
+				::close(pfds[i].fd);
+				pfds.erase(pfds.begin() + static_cast<std::ptrdiff_t>(i));
+			}
+		}
+
+		for (std::size_t i = 2; i < pfds.size(); ++i)
+			::close(pfds[i].fd);
+	}
+
+	// Returns false when the client went away or misbehaved.
+	bool serve(int client)
+	{
+		std::vector<char> req(fd_request_max);
+		std::vector<int> none;
+		std::size_t len;
+
+		try {
+			len = recv_message(client, req.data(), req.size(), none);
+		} catch (const std::system_error& e) {
+			return e.code().value() == EAGAIN;
+		}
+		for (auto fd : none)
+			::close(fd);
+		if (len == 0)
+			return false;
+
+		std::vector<std::int32_t> status;
+		std::vector<int> fds, transient;
+		bool ok = true;
+		for (std::size_t pos = 0; pos < len; ) {
+			std::uint32_t n;
+			if (len - pos < sizeof(n)) {
+				ok = false;
+				break;
+			}
+			std::memcpy(&n, &req[pos], sizeof(n));
+			pos += sizeof(n);
+			if (len - pos < n || status.size() == fd_batch_max) {
+				ok = false;
+				break;
+			}
+
+			int err;
+			bool kept;
+			auto fd = lookup(std::string(&req[pos], n), err, kept);
+			pos += n;
+			status.push_back(err);
+			if (fd != -1)
+				fds.push_back(fd);
+			if (fd != -1 && !kept)
+				transient.push_back(fd);
+		}
+
+		try {
+			if (ok)
+				send_message(client, status.data(),
+					     status.size() * sizeof(std::int32_t),
+					     fds.data(), fds.size());
+		} catch (const std::system_error&) {
+			ok = false;
+		}
+		for (auto fd : transient)
+			::close(fd);
+
+		return ok;
+	}
+
+	static constexpr std::size_t fd_request_max = 64 << 10;
+	friend class fd_broker_client;
+
+	std::string sock_path_;
+	int flags_;
+	uid_t uid_;
+	bool confined_;
+	int root_fd_ = -1;
+	int listen_fd_ = -1;
+	int stop_pipe_[2] = { -1, -1 };
+
+	struct entry {
+		int fd;
+		fd_budget::reservation res;
+	};
+
+	mutable std::mutex mtx_;
+	std::unordered_map<std::string, entry> cache_;
+
+	std::thread thread_;
+};
+
+/**
+ *  @breif  Connection to an fd_broker.
+ */
+class fd_broker_client {
+public:
+	explicit fd_broker_client(const std::string& sock_path)
+	{
+		struct sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		if (sock_path.size() >= sizeof(addr.sun_path))
+			throw fs_error::get(ENAMETOOLONG, "fd_broker_client");
+		std::memcpy(addr.sun_path, sock_path.c_str(), sock_path.size());
+
+		sock_ = ::socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+		if (sock_ == -1)
+			throw fs_error::get("socket()");
+
+		if (::connect(sock_, reinterpret_cast<struct sockaddr*>(&addr),
+			      sizeof(addr)) == -1) {
+			const auto err = fs_error::get("connect()");
+			::close(sock_);
+			throw err;
+		}
+	}
+
+	fd_broker_client(const fd_broker_client&) = delete;
+	fd_broker_client& operator=(const fd_broker_client&) = delete;
+
+	~fd_broker_client()
+	{ ::close(sock_); }
+
+	/**
+	 *  @breif  Fetch descriptors for many paths at once.
+	 *  @return One descriptor per path, -1 where the broker could not
+	 *  open it (the errno goes to errors, if given).
+	 */
+	std::vector<int> open_files(const std::vector<std::string>& paths,
+				    std::vector<int>* errors = nullptr)
+	{
+		std::vector<int> out;
+		std::vector<char> req;
+		std::size_t first = 0;
+
+		out.reserve(paths.size());
+		if (errors != nullptr)
+			errors->clear();
+
+		try {
+			for (std::size_t i = 0; i <= paths.size(); ++i) {
+				const auto n = i - first;
+				const bool full = i == paths.size() || n == fd_batch_max ||
+					req.size() + 4 + paths[i].size() > fd_broker::fd_request_max;
+				if (full && n > 0) {
+					exchange(req, n, out, errors);
+					req.clear();
+					first = i;
+				}
+				if (i == paths.size())
+					break;
+
+				const auto len = static_cast<std::uint32_t>(paths[i].size());
+				const auto p = reinterpret_cast<const char*>(&len);
+				req.insert(req.end(), p, p + sizeof(len));
+				req.insert(req.end(), paths[i].begin(), paths[i].end());
+			}
+		} catch (...) {
+			for (auto fd : out)
+				if (fd != -1)
+					::close(fd);
+			throw;
+		}
+
+		return out;
+	}
+
+	/**
+	 *  @breif  Fetch the descriptor for a single path.
+	 *  @return The file descriptor (close-on-exec).
+	 */
+	[[nodiscard]]
+	int open_file(const std::string& path)
+	{
+		std::vector<int> errors;
+		auto fds = open_files(std::vector<std::string>(1, path), &errors);
+		if (fds[0] == -1)
+			throw fs_error::get(errors[0], "fd_broker: open()");
+
+		return fds[0];
+	}
+
+private:
+	void exchange(const std::vector<char>& req, std::size_t n,
+		      std::vector<int>& out, std::vector<int>* errors)
+	{
+		send_message(sock_, req.data(), req.size(), nullptr, 0);
+
+		std::vector<std::int32_t> status(n);
+		std::vector<int> fds;
+		const auto len = recv_message(sock_, status.data(),
+					      n * sizeof(std::int32_t), fds);
+
+		std::size_t ok = 0;
+		for (auto st : status)
+			ok += st == 0;
+		if (len != n * sizeof(std::int32_t) || ok != fds.size()) {
+			for (auto fd : fds)
+				::close(fd);
+			throw fs_error::get(EBADMSG, "fd_broker: bad reply");
+		}
+
+		std::size_t next = 0;
+		for (auto st : status) {
+			out.push_back(st == 0 ? fds[next++] : -1);
+			if (errors != nullptr)
+				errors->push_back(st);
+		}
+	}
+
+	int sock_ = -1;
+};
+
+/**
+ *  @breif  On-disk header of a Merkle sidecar ("<file>.merkle").
+ *
+ *  The header is followed by every level of the tree as an array of
+ *  64-bit hashes, leaves first and the root last.
+ */
+struct merkle_header {
+	char magic[8];
+	std::uint32_t version;
+	std::uint32_t block_size;
+	std::uint64_t file_size;
+	std::uint64_t leaves;
+	std::uint64_t nodes;
+	std::uint64_t root;
+	char padding[16];
+};
+
+static_assert(sizeof(merkle_header) == 64, "merkle_header must be 64 bytes");
+
+constexpr char merkle_magic[8] = { 'F', 'S', 'M', 'M', 'R', 'K', 'L', '\0' };
+constexpr std::uint32_t merkle_version = 1;
+
+/**
+ *  @breif  Hash of a Merkle tree leaf, bound to its block index.
+ *  @return The 64-bit hash value.
+ *  @type   Private function (intended)
+ */
+inline std::uint64_t merkle_leaf(const void* data, std::size_t len, std::uint64_t index)
+{ return checksum64(data, len, index); }
+
+/**
+ *  @breif  Hash of an inner Merkle tree node from one or two children.
+ *  @return The 64-bit hash value.
+ *  @type   Private function (intended)
+ */
+std::uint64_t merkle_node(const std::uint64_t* child, std::size_t n, unsigned level)
+{
+	return checksum64(child, n * sizeof(std::uint64_t), ~std::uint64_t(level));
+}
+
+/**
+ *  @breif  Build all inner levels on top of the leaf hashes.
+ *  @return None.
+ *  @type   Private function (intended)
+ */
+void merkle_levels(std::vector<std::uint64_t>& tree, std::uint64_t leaves)
+{
+	std::size_t first = 0, n = static_cast<std::size_t>(leaves);
+
+	for (unsigned level = 1; n > 1; ++level) {
+		for (std::size_t i = 0; i < n; i += 2)
+			tree.push_back(merkle_node(&tree[first + i],
+						   std::min<std::size_t>(2, n - i), level));
+		first += n;
+		n = (n + 1) / 2;
+	}
+}
+
+/**
+ *  @breif  Hash a file in fixed size blocks and write a Merkle sidecar.
+ *  @return The root hash.
+ *
+ *  Blocks are hashed in parallel. The tree uses XXH64, which catches
+ *  corruption but is not meant to resist deliberate tampering. The
+ *  sidecar is staged in a temporary file of its own and renamed into
+ *  place, so concurrent builds of one file do not clobber each other.
+ */
+std::uint64_t build_merkle(const std::string& path, std::uint32_t block_size = 1 << 20,
+			   unsigned threads = 0)
+{
+	if (block_size == 0)
+		throw fs_error::get(EINVAL, "build_merkle(): block_size");
+
+	auto fd = open_file(path, fs_omode::readonly | fs_omode::close_exec);
+	std::vector<std::uint64_t> tree;
+	merkle_header hdr;
+
+	try {
+		std::memset(&hdr, 0, sizeof(hdr));
+		std::memcpy(hdr.magic, merkle_magic, sizeof(hdr.magic));
+		hdr.version = merkle_version;
+		hdr.block_size = block_size;
+		hdr.file_size = static_cast<std::uint64_t>(file_size(fd));
+		hdr.leaves = (hdr.file_size + block_size - 1) / block_size;
+		tree.resize(static_cast<std::size_t>(hdr.leaves));
+
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		threads = static_cast<unsigned>(std::min<std::uint64_t>(threads,
+			std::max<std::uint64_t>(1, hdr.leaves)));
+
+		std::atomic<std::uint64_t> next { 0 };
+		std::mutex err_mtx;
+		std::exception_ptr err;
+
+		// Threads grab batches of blocks, about 4 MiB per read.
+		const std::uint64_t batch = std::max<std::uint64_t>(1, (4 << 20) / block_size);
+		auto work = [&]
+		{
+			std::vector<char, default_init_allocator<char>> buf(
+				static_cast<std::size_t>(batch * block_size));
+			try {
+				for (;;) {
+					const auto first = next.fetch_add(batch);
+					if (first >= hdr.leaves)
+						break;
+					const auto n = std::min(batch, hdr.leaves - first);
+					const auto off = first * block_size;
+					const auto len = static_cast<std::size_t>(
+						std::min<std::uint64_t>(n * block_size, hdr.file_size - off));
+					if (pread_all(fd, buf.data(), len, static_cast<off_t>(off)) != len)
+						throw fs_error::get(EIO, "build_merkle(): file shrank");
+
+					for (std::uint64_t i = 0; i < n; ++i) {
+						const auto b = static_cast<std::size_t>(i * block_size);
+						tree[first + i] = merkle_leaf(&buf[b],
+							std::min<std::size_t>(block_size, len - b), first + i);
+					}
+				}
+			} catch (...) {
+				std::lock_guard<std::mutex> lk(err_mtx);
+				if (!err)
+					err = std::current_exception();
+				next = hdr.leaves;
+			}
+		};
+
+		std::vector<std::thread> pool;
+		for (unsigned t = 1; t < threads; ++t)
+			pool.push_back(scoped_thread(work));
+		work();
+		for (auto& t : pool)
+			t.join();
+		if (err)
+			std::rethrow_exception(err);
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	close_file(fd);
+
+	merkle_levels(tree, hdr.leaves);
+	hdr.nodes = tree.size();
+	hdr.root = tree.empty() ? merkle_node(nullptr, 0, 0) : tree.back();
+
+	const auto side = path + ".merkle";
+	std::string tmp;
+	auto sfd = create_sibling(side, tmp, fs_perms::owner_read | fs_perms::owner_write |
+				  fs_perms::group_read | fs_perms::others_read);
+	struct iovec iov[2] = {
+		{ &hdr, sizeof(hdr) },
+		{ tree.data(), tree.size() * sizeof(std::uint64_t) },
+	};
+	try {
+		writev_all(sfd, iov, 2);
+		close_file(sfd);
+		sfd = -1;
+		rename_path(tmp, side);
+	} catch (...) {
+		if (sfd != -1)
+			::close(sfd);
+		::unlink(tmp.c_str());
+		throw;
+	}
+
+	return hdr.root;
+}
+
+/**
+ *  @breif  Read and check the header of a Merkle sidecar.
+ *  @return The header.
+ *  @type   Private function (intended)
+ */
+merkle_header read_merkle_header(int sfd)
+{
+	merkle_header hdr;
+
+	if (pread_all(sfd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+	    std::memcmp(hdr.magic, merkle_magic, sizeof(hdr.magic)) != 0 ||
+	    hdr.version != merkle_version || hdr.block_size == 0)
+		throw fs_error::get(EINVAL, "merkle: bad sidecar");
+
+	return hdr;
+}
+
+/**
+ *  @breif  Root hash recorded in the Merkle sidecar of a file.
+ *  @return The root hash.
+ */
+[[nodiscard]]
+std::uint64_t merkle_root(const std::string& path)
+{
+	auto sfd = open_file(path + ".merkle", fs_omode::readonly | fs_omode::close_exec);
+	try {
+		const auto hdr = read_merkle_header(sfd);
+		::close(sfd);
+		return hdr.root;
+	} catch (...) {
+		::close(sfd);
+		throw;
+	}
+}
+
+/**
+ *  @breif  Verify a byte range of a file against its Merkle sidecar.
+ *  @return True if the range is intact, false otherwise.
+ *
+ *  Only the blocks overlapping the range are read and hashed. The
+ *  sibling hashes on their way up are read from the sidecar and the
+ *  recomputed root is compared with the recorded one.
+ */
+[[nodiscard]]
+bool verify_range(const std::string& path, std::uint64_t off, std::uint64_t len)
+{
+	auto fd = open_file(path, fs_omode::readonly | fs_omode::close_exec);
+	int sfd = -1;
+
+	try {
+		sfd = open_file(path + ".merkle", fs_omode::readonly | fs_omode::close_exec);
+		const auto hdr = read_merkle_header(sfd);
+		const auto bs = hdr.block_size;
+
+		bool ok = static_cast<std::uint64_t>(file_size(fd)) == hdr.file_size;
+		if (ok && len > 0 && off + len > hdr.file_size)
+			throw fs_error::get(EINVAL, "verify_range(): out of range");
+
+		if (ok && len > 0) {
+			auto lo = off / bs, hi = (off + len - 1) / bs;
+
+			std::vector<std::uint64_t> cur;
+			std::vector<char, default_init_allocator<char>> buf(bs);
+			for (auto i = lo; i <= hi; ++i) {
+				const auto n = static_cast<std::size_t>(
+					std::min<std::uint64_t>(bs, hdr.file_size - i * bs));
+				if (pread_all(fd, buf.data(), n, static_cast<off_t>(i * bs)) != n)
+					throw fs_error::get(EIO, "verify_range(): file shrank");
+				cur.push_back(merkle_leaf(buf.data(), n, i));
+			}
+
+			// Walk up, pulling missing siblings from the sidecar.
+			std::uint64_t level_off = 0, n = hdr.leaves;
+			std::vector<std::uint64_t> sib;
+			for (unsigned level = 1; n > 1; ++level) {
+				const auto a = lo & ~std::uint64_t(1);
+				const auto b = std::min(hi | 1, n - 1);
+				sib.resize(static_cast<std::size_t>(b - a + 1));
+				if (pread_all(sfd, sib.data(), sib.size() * 8,
+					      static_cast<off_t>(sizeof(hdr) + (level_off + a) * 8))
+				    != sib.size() * 8)
+					throw fs_error::get(EINVAL, "merkle: short sidecar");
+				std::copy(cur.begin(), cur.end(), sib.begin() + (lo - a));
+
+				cur.clear();
+				for (std::size_t i = 0; i < sib.size(); i += 2)
+					cur.push_back(merkle_node(&sib[i],
+						std::min<std::size_t>(2, sib.size() - i), level));
+
+				level_off += n;
+				n = (n + 1) / 2;
+				lo = a / 2;
+				hi = b / 2;
+			}
+			ok = cur.size() == 1 && cur[0] == hdr.root;
+		}
+
+		::close(sfd);
+		::close(fd);
+		return ok;
+	} catch (...) {
+		if (sfd != -1)
+			::close(sfd);
+		::close(fd);
+		throw;
+	}
+}
+
+/**
+ *  @breif  Positional reader that checks every block it returns
+ *  against a Merkle sidecar.
+ *
+ *  The sidecar is loaded and checked against its root once, each
+ *  read_object() then only hashes the blocks it touches.
+ */
+class merkle_reader {
+public:
+	explicit merkle_reader(const std::string& path)
+	{
+		fd_ = open_file(path, fs_omode::readonly | fs_omode::close_exec);
+		int sfd = -1;
+
+		try {
+			sfd = open_file(path + ".merkle", fs_omode::readonly | fs_omode::close_exec);
+			hdr_ = read_merkle_header(sfd);
+
+			tree_.resize(static_cast<std::size_t>(hdr_.leaves));
+			const auto bytes = tree_.size() * sizeof(std::uint64_t);
+			if (pread_all(sfd, tree_.data(), bytes, sizeof(hdr_)) != bytes)
+				throw fs_error::get(EINVAL, "merkle: short sidecar");
+			::close(sfd);
+			sfd = -1;
+
+			auto check = tree_;
+			merkle_levels(check, hdr_.leaves);
+			const auto root = check.empty() ? merkle_node(nullptr, 0, 0) : check.back();
+			if (root != hdr_.root)
+				throw fs_error::get(EILSEQ, "merkle: sidecar does not match its root");
+			if (static_cast<std::uint64_t>(file_size(fd_)) != hdr_.file_size)
+				throw fs_error::get(EILSEQ, "merkle: file size changed");
+		} catch (...) {
+			if (sfd != -1)
+				::close(sfd);
+			::close(fd_);
+			throw;
+		}
+	}
+
+	merkle_reader(const merkle_reader&) = delete;
+	merkle_reader& operator=(const merkle_reader&) = delete;
+
+	~merkle_reader()
+	{ ::close(fd_); }
+
+	/**
+	 *  @breif  Read data at an offset, verifying the covering blocks.
+	 *  @return The size of the data it read in bytes.
+	 */
+	template <typename T>
+	std::size_t read_object(T* ptr, std::size_t nbytes, std::uint64_t off)
+	{
+		if (off >= hdr_.file_size || nbytes == 0)
+			return 0;
+		nbytes = static_cast<std::size_t>(
+			std::min<std::uint64_t>(nbytes, hdr_.file_size - off));
+
+		const auto bs = hdr_.block_size;
+		auto out = reinterpret_cast<char*>(ptr);
+		std::size_t done = 0;
+
+		buf_.resize(bs);
+		for (auto i = off / bs; done < nbytes; ++i) {
+			const auto base = i * bs;
+			const auto n = static_cast<std::size_t>(
+				std::min<std::uint64_t>(bs, hdr_.file_size - base));
+			if (pread_all(fd_, buf_.data(), n, static_cast<off_t>(base)) != n ||
+			    merkle_leaf(buf_.data(), n, i) != tree_[static_cast<std::size_t>(i)])
+				throw fs_error::get(EILSEQ, "merkle_reader: block " +
+						    std::to_string(i) + " is corrupt");
+
+			const auto skip = static_cast<std::size_t>(off + done - base);
+			const auto take = std::min(n - skip, nbytes - done);
+			std::memcpy(out + done, buf_.data() + skip, take);
+			done += take;
+		}
+
+		return done;
+	}
+
+	/**
+	 *  @breif  Verified root hash.
+	 *  @return The root hash.
+	 */
+	[[nodiscard]]
+	std::uint64_t root() const noexcept
+	{ return hdr_.root; }
+
+private:
+	int fd_ = -1;
+	merkle_header hdr_;
+	std::vector<std::uint64_t> tree_;
+	std::vector<char, default_init_allocator<char>> buf_;
+};
+
+/**
+ *  @breif  Shared user-space cache of file blocks.
+ *
+ *  Blocks are keyed by (device, inode, generation, block number) and
+ *  spread over lock-striped shards. Each shard runs CLOCK with a small
+ *  use counter per block: new blocks start cold and hot blocks survive
+ *  a few sweeps of the hand, so a one-off scan can not flush the
+ *  working set. The cache never holds more than memory_budget bytes
+ *  of block data. Files are read through cached_file. What is known
+ *  about a file is dropped once it is neither open nor cached.
+ */
+class block_cache {
+public:
+	explicit block_cache(std::size_t memory_budget, std::size_t block_size = 64 << 10,
+			     std::size_t shards = 0)
+		: block_size_(block_size)
+	{
+		if (block_size == 0)
+			throw fs_error::get(EINVAL, "block_cache: block_size");
+		if (shards == 0)
+			shards = 2 * std::max(1u, std::thread::hardware_concurrency());
+
+		const auto blocks = std::max<std::size_t>(1, memory_budget / block_size);
+		shards = std::min(shards, blocks);
+		shards_ = std::vector<shard>(shards);
+		for (std::size_t i = 0; i < shards; ++i)
+			shards_[i].slots.resize(blocks / shards + (i < blocks % shards));
+	}
+
+	block_cache(const block_cache&) = delete;
+	block_cache& operator=(const block_cache&) = delete;
+
+	/**
+	 *  @breif  Size of a cached block.
+	 *  @return Size in bytes.
+	 */
+	[[nodiscard]]
+	std::size_t block_size() const noexcept
+	{ return block_size_; }
+
+	/**
+	 *  @breif  Number of block lookups served from memory.
+	 */
+	[[nodiscard]]
+	std::uint64_t hits() const noexcept
+	{ return hits_.load(std::memory_order_relaxed); }
+
+	/**
+	 *  @breif  Number of block lookups that went to the file.
+	 */
+	[[nodiscard]]
+	std::uint64_t misses() const noexcept
+	{ return misses_.load(std::memory_order_relaxed); }
+
+	/**
+	 *  @breif  Number of files the cache keeps track of, the ones open
+	 *  through a cached_file or with blocks in the cache.
+	 */
+	[[nodiscard]]
+	std::size_t files() const
+	{
+		std::lock_guard<std::mutex> lk(files_mtx_);
+		return files_.size();
+	}
+
+	/**
+	 *  @breif  Drop every cached block.
+	 *  @return None.
+	 */
+	void clear()
+	{
+		for (auto& sh : shards_) {
+			std::lock_guard<std::mutex> lk(sh.mtx);
+			sh.index.clear();
+			for (auto& s : sh.slots) {
+				if (s.used)
+					unref_block(s.k);
+				s.used = false;
+			}
+		}
+	}
+
+private:
+	friend class cached_file;
+
+	struct key {
+		dev_t dev;
+		ino_t ino;
+		std::uint64_t gen;
+		std::uint64_t block;
+
+		bool operator==(const key& o) const noexcept
+		{
+			return dev == o.dev && ino == o.ino &&
+				gen == o.gen && block == o.block;
+		}
+	};
+
+	struct key_hash {
+		std::size_t operator()(const key& k) const noexcept
+		{
+			std::uint64_t v[4] = {
+				static_cast<std::uint64_t>(k.dev),
+				static_cast<std::uint64_t>(k.ino), k.gen, k.block,
+			};
+			return static_cast<std::size_t>(checksum64(v, sizeof(v)));
+		}
+	};
+
+	struct slot {
+		key k;
+		std::unique_ptr<char[]> data;
+		std::size_t len = 0;
+		unsigned uses = 0;
+		bool used = false;
+	};
+
+	struct shard {
+		std::mutex mtx;
+		std::unordered_map<key, std::size_t, key_hash> index;
+		std::vector<slot> slots;
+		std::size_t hand = 0;
+	};
+
+	struct version {
+		std::uint64_t gen;
+		off_t size;
+		struct timespec mtime;
+		std::size_t refs;
+		std::size_t blocks;
+	};
+
+	// Bump the generation of an inode whose size or mtime changed
+	// since it was last opened, orphaning all of its cached blocks.
+	// Each call takes a reference, dropped again by release().
+	std::uint64_t generation(const struct stat& st)
+	{
+		std::lock_guard<std::mutex> lk(files_mtx_);
+
+		auto& v = files_[std::make_pair(st.st_dev, st.st_ino)];
+		++v.refs;
+		if (v.gen == 0 || v.size != st.st_size ||
+		    v.mtime.tv_sec != st.st_mtim.tv_sec ||
+		    v.mtime.tv_nsec != st.st_mtim.tv_nsec) {
+			v.gen = ++last_gen_;
+			v.size = st.st_size;
+			v.mtime = st.st_mtim;
+		}
+
+		return v.gen;
+	}
+
+	void release(dev_t dev, ino_t ino)
+	{
+		std::lock_guard<std::mutex> lk(files_mtx_);
+
+		auto it = files_.find(std::make_pair(dev, ino));
+		if (it != files_.end() && --it->second.refs == 0 && it->second.blocks == 0)
+			files_.erase(it);
+	}
+
+	// Count the blocks held per inode, so that an inode that is not
+	// open any more is forgotten with its last block. Called with the
+	// shard lock held.
+	void ref_block(const key& k)
+	{
+		std::lock_guard<std::mutex> lk(files_mtx_);
+
+		auto it = files_.find(std::make_pair(k.dev, k.ino));
+		if (it != files_.end())
+			++it->second.blocks;
+	}
+
+	void unref_block(const key& k)
+	{
+		std::lock_guard<std::mutex> lk(files_mtx_);
+
+		auto it = files_.find(std::make_pair(k.dev, k.ino));
+		if (it != files_.end() && --it->second.blocks == 0 && it->second.refs == 0)
+			files_.erase(it);
+	}
+
+	// Copy up to n bytes of a block starting at skip, reading it from
+	// fd on a miss. Returns the number of bytes copied.
+	std::size_t read_block(int fd, const key& k, char* out, std::size_t skip, std::size_t n)
+	{
+		auto& sh = shards_[key_hash()(k) % shards_.size()];
+
+		{
+			std::lock_guard<std::mutex> lk(sh.mtx);
+			auto it = sh.index.find(k);
+			if (it != sh.index.end()) {
+				auto& s = sh.slots[it->second];
+				s.uses = std::min(s.uses + 1, 3u);
+				hits_.fetch_add(1, std::memory_order_relaxed);
+				return copy_out(s, out, skip, n);
+			}
+		}
+
+		misses_.fetch_add(1, std::memory_order_relaxed);
+		std::unique_ptr<char[]> buf(new char[block_size_]);
+		const auto len = pread_all(fd, buf.get(), block_size_,
+					   static_cast<off_t>(k.block * block_size_));
+
+		std::lock_guard<std::mutex> lk(sh.mtx);
+		auto it = sh.index.find(k);
+		if (it != sh.index.end())
+			return copy_out(sh.slots[it->second], out, skip, n);
+
+		auto& s = sh.slots[evict(sh)];
+		s.k = k;
+		s.data = std::move(buf);
+		s.len = len;
+		s.uses = 0;
+		s.used = true;
+		sh.index.emplace(k, static_cast<std::size_t>(&s - sh.slots.data()));
+		ref_block(k);
+
+		return copy_out(s, out, skip, n);
+	}
+
+	static std::size_t copy_out(const slot& s, char* out, std::size_t skip, std::size_t n)
+	{
+		if (skip >= s.len)
+			return 0;
+
+		n = std::min(n, s.len - skip);
+		std::memcpy(out, s.data.get() + skip, n);
+		return n;
+	}
+
+	std::size_t evict(shard& sh)
+	{
+		for (;;) {
+			auto& s = sh.slots[sh.hand];
+			const auto i = sh.hand;
+			sh.hand = (sh.hand + 1) % sh.slots.size();
+
+			if (!s.used)
+				return i;
+			if (s.uses > 0) {
+				--s.uses;
+				continue;
+			}
+
+			sh.index.erase(s.k);
+			unref_block(s.k);
+			s.used = false;
+			return i;
+		}
+	}
+
+	std::size_t block_size_;
+	std::vector<shard> shards_;
+	std::atomic<std::uint64_t> hits_ { 0 };
+	std::atomic<std::uint64_t> misses_ { 0 };
+
+	mutable std::mutex files_mtx_;
+	std::map<std::pair<dev_t, ino_t>, version> files_;
+	std::uint64_t last_gen_ = 0;
+};
+
+/**
+ *  @breif  File opened for positional reads through a block_cache.
+ *
+ *  Opening a file whose size or mtime changed since it was last seen
+ *  invalidates its cached blocks. Changes made while the file is open
+ *  are not noticed; reopen it to pick them up. The descriptor is kept
+ *  open under a reservation from fd_budget::global(); when the budget
+ *  is used up the file is reopened for each read instead.
+ */
+class cached_file {
+public:
+	cached_file(block_cache& cache, const std::string& path)
+		: cache_(cache), path_(path)
+	{
+		fd_ = open_file(path, fs_omode::readonly | fs_omode::close_exec);
+
+		struct stat st;
+		if (::fstat(fd_, &st) == -1) {
+			const auto err = fs_error::get("fstat()");
+			::close(fd_);
+			throw err;
+		}
+
+		dev_ = st.st_dev;
+		ino_ = st.st_ino;
+		size_ = static_cast<std::uint64_t>(st.st_size);
+		gen_ = cache_.generation(st);
+
+		res_ = fd_budget::global().reserve(1);
+		if (!res_) {
+			::close(fd_);
+			fd_ = -1;
+		}
+	}
+
+	cached_file(const cached_file&) = delete;
+	cached_file& operator=(const cached_file&) = delete;
+
+	~cached_file()
+	{
+		if (fd_ != -1)
+			::close(fd_);
+		cache_.release(dev_, ino_);
+	}
+
+	/**
+	 *  @breif  Read data at an offset through the cache.
+	 *  @return The size of the data it read in bytes.
+	 */
+	template <typename T>
+	std::size_t read_object(T* ptr, std::size_t nbytes, std::uint64_t off)
+	{
+		const auto bs = cache_.block_size();
+		auto out = reinterpret_cast<char*>(ptr);
+		std::size_t done = 0;
+
+		if (off >= size_)
+			return 0;
+		nbytes = static_cast<std::size_t>(std::min<std::uint64_t>(nbytes, size_ - off));
+
+		const auto fd = fd_ != -1 ? fd_ : reopen();
+		try {
+			while (done < nbytes) {
+				const auto pos = off + done;
+				const block_cache::key k = { dev_, ino_, gen_, pos / bs };
+				const auto n = cache_.read_block(fd, k, out + done,
+								 static_cast<std::size_t>(pos % bs),
+								 nbytes - done);
+				if (n == 0)
+					break;
+				done += n;
+			}
+		} catch (...) {
+			if (fd != fd_)
+				::close(fd);
+			throw;
+		}
+		if (fd != fd_)
+			::close(fd);
+
+		return done;
+	}
+
+	/**
+	 *  @breif  File size when it was opened.
+	 *  @return Size in bytes.
+	 */
+	[[nodiscard]]
+	std::uint64_t size() const noexcept
+	{ return size_; }
+
+private:
+	int reopen() const
+	{
+		auto fd = open_file(path_, fs_omode::readonly | fs_omode::close_exec);
+
+		struct stat st;
+		if (::fstat(fd, &st) == -1) {
+			const auto err = fs_error::get("fstat()");
+			::close(fd);
+			throw err;
+		}
+		if (st.st_dev != dev_ || st.st_ino != ino_) {
+			::close(fd);
+			throw fs_error::get(ESTALE, "cached_file: " + path_ + " was replaced");
+		}
+
+		return fd;
+	}
+
+	block_cache& cache_;
+	std::string path_;
+	fd_budget::reservation res_;
+	int fd_ = -1;
+	dev_t dev_;
+	ino_t ino_;
+	std::uint64_t gen_;
+	std::uint64_t size_;
+};
+
+/**
+ *  @breif  Write-back cache for random updates to an opened file.
+ *
+ *  Dirty data is kept as disjoint extents in an interval map.
+ *  Overlapping and adjacent writes are merged into one extent, so
+ *  sequential small writes grow a single buffer. flush() writes the
+ *  extents out in offset order, which happens by itself once more
+ *  than flush_threshold bytes are dirty. Extents less than max_gap
+ *  bytes apart go out in one pwritev(), with the gaps between them
+ *  read back from the file and written unchanged; a change made to
+ *  a gap by someone else in the meantime is lost. Write-only
+ *  descriptors get one pwrite() per extent. Reads see the cached
+ *  data. The descriptor stays owned by the caller; the cache is not
+ *  thread safe.
+ */
+class write_cache {
+public:
+	explicit write_cache(int fd, std::size_t flush_threshold = 4 << 20,
+			     std::size_t max_gap = 4096)
+		: fd_(fd), threshold_(flush_threshold), max_gap_(max_gap)
+	{
+		const auto fl = ::fcntl(fd, F_GETFL);
+		if (fl != -1 && (fl & O_ACCMODE) == O_WRONLY)
+			max_gap_ = 0;
+	}
+
+	write_cache(const write_cache&) = delete;
+	write_cache& operator=(const write_cache&) = delete;
+
+	/**
+	 *  @breif  Flushes what is left; errors are lost at this point,
+	 *  call flush() first to see them.
+	 */
+	~write_cache()
+	{
+		try {
+			flush();
+		} catch (...) {
+		}
+	}
+
+	/**
+	 *  @breif  Buffer data to be written at an offset.
+	 *  @return None.
+	 */
+	template <typename T>
+	void write_object(const T* ptr, std::size_t nbytes, std::uint64_t off)
+	{
+		if (nbytes == 0)
+			return;
+
+		const auto src = reinterpret_cast<const char*>(ptr);
+		const auto end = off + nbytes;
+
+		// First extent that overlaps or touches [off, end).
+		auto it = extents_.upper_bound(off);
+		if (it != extents_.begin()) {
+			auto prev = std::prev(it);
+			if (prev->first + prev->second.size() >= off)
+				it = prev;
+		}
+
+		if (it == extents_.end() || it->first > end) {
+			extents_.emplace(off, std::vector<char>(src, src + nbytes));
+			dirty_ += nbytes;
+		} else {
+			const auto start = std::min(off, it->first);
+			auto last = it;
+			std::uint64_t stop = end;
+			std::size_t merged = 0;
+			for (; last != extents_.end() && last->first <= end; ++last) {
+				stop = std::max<std::uint64_t>(stop, last->first + last->second.size());
+				merged += last->second.size();
+			}
+
+			// Reuse the first buffer when it already starts right.
+			std::vector<char> buf;
+			auto cur = it;
+			if (it->first == start)
+				buf = std::move((cur++)->second);
+			buf.resize(static_cast<std::size_t>(stop - start));
+
+			for (; cur != last; ++cur)
+				std::memcpy(&buf[static_cast<std::size_t>(cur->first - start)],
+					    cur->second.data(), cur->second.size());
+			std::memcpy(&buf[static_cast<std::size_t>(off - start)], src, nbytes);
+
+			extents_.erase(it, last);
+			dirty_ = dirty_ - merged + buf.size();
+			extents_.emplace(start, std::move(buf));
+		}
+
+		size_ = std::max(size_, end);
+		if (dirty_ > threshold_)
+			flush();
+	}
+
+	/**
+	 *  @breif  Read data at an offset, including unflushed writes.
+	 *  @return The size of the data it read in bytes.
+	 */
+	template <typename T>
+	std::size_t read_object(T* ptr, std::size_t nbytes, std::uint64_t off)
+	{
+		const auto logical = std::max<std::uint64_t>(
+			size_, static_cast<std::uint64_t>(file_size(fd_)));
+		if (off >= logical)
+			return 0;
+		nbytes = static_cast<std::size_t>(std::min<std::uint64_t>(nbytes, logical - off));
+
+		auto out = reinterpret_cast<char*>(ptr);
+		const auto got = pread_all(fd_, out, nbytes, static_cast<off_t>(off));
+		if (got < nbytes)
+			std::memset(out + got, 0, nbytes - got);
+
+		const auto end = off + nbytes;
+		auto it = extents_.upper_bound(off);
+		if (it != extents_.begin())
+			--it;
+		for (; it != extents_.end() && it->first < end; ++it) {
+			const auto a = std::max<std::uint64_t>(off, it->first);
+			const auto b = std::min<std::uint64_t>(end, it->first + it->second.size());
+			if (a < b)
+				std::memcpy(out + (a - off), it->second.data() + (a - it->first),
+					    static_cast<std::size_t>(b - a));
+		}
+
+		return nbytes;
+	}
+
+	/**
+	 *  @breif  Write all dirty extents to the file, in offset order.
+	 *  @return None.
+	 */
+	void flush()
+	{
+		std::vector<struct iovec> iov;
+		std::vector<std::vector<char>> gaps;
+
+		while (!extents_.empty()) {
+			const auto first = extents_.begin();
+			auto last = first;
+			auto pos = first->first;
+			std::size_t bytes = 0;
+
+			iov.clear();
+			gaps.clear();
+			for (; last != extents_.end() && iov.size() + 2 <= IOV_MAX; ++last) {
+				if (last->first > pos) {
+					if (last->first - pos >= max_gap_)
+						break;
+					std::vector<char> gap(static_cast<std::size_t>(last->first - pos));
+					const auto got = pread_all(fd_, gap.data(), gap.size(),
+								   static_cast<off_t>(pos));
+					std::memset(gap.data() + got, 0, gap.size() - got);
+					iov.push_back({ gap.data(), gap.size() });
+					gaps.push_back(std::move(gap));
+				}
+				iov.push_back({ last->second.data(), last->second.size() });
+				pos = last->first + last->second.size();
+				bytes += last->second.size();
+			}
+
+			pwritev_all(fd_, iov.data(), static_cast<int>(iov.size()),
+				    static_cast<off_t>(first->first));
+			dirty_ -= bytes;
+			extents_.erase(first, last);
+		}
+	}
+
+	/**
+	 *  @breif  Amount of buffered data.
+	 *  @return Size in bytes.
+	 */
+	[[nodiscard]]
+	std::size_t dirty() const noexcept
+	{ return dirty_; }
+
+private:
+	int fd_;
+	std::size_t threshold_;
+	std::size_t max_gap_;
+	std::size_t dirty_ = 0;
+	std::uint64_t size_ = 0;
+	std::map<std::uint64_t, std::vector<char>> extents_;
+};
+
+/**
+ *  @breif  Access patterns recognized by smart_reader.
+ */
+enum class access_pattern {
+	unknown,
+	sequential,
+	strided,
+	random,
+};
+
+/**
+ *  @breif  Prefetch counters of a smart_reader.
+ */
+struct prefetch_stats {
+	std::uint64_t reads = 0;
+	std::uint64_t prefetches = 0;
+	std::uint64_t prefetched_bytes = 0;
+	std::uint64_t useful_bytes = 0;
+
+	/**
+	 *  @breif  Share of prefetched bytes that were read afterwards.
+	 *  @return A value between 0 and 1.
+	 */
+	[[nodiscard]]
+	double accuracy() const noexcept
+	{
+		return prefetched_bytes == 0 ? 0.0 :
+			static_cast<double>(useful_bytes) / static_cast<double>(prefetched_bytes);
+	}
+};
+
+/**
+ *  @breif  Positional reader that does its own readahead.
+ *
+ *  Every read is classified against the previous ones. Sequential
+ *  streams get a growing readahead window, strided streams (fixed
+ *  step, fixed size, forward or backward) get the next few strides
+ *  requested, never below offset 0, and random access turns kernel
+ *  readahead off so it does not waste bandwidth.
+ *  Prefetching is done with POSIX_FADV_WILLNEED, which starts the I/O
+ *  without waiting for it. The descriptor stays owned by the caller.
+ */
+class smart_reader {
+public:
+	explicit smart_reader(int fd, std::size_t max_window = 8 << 20,
+			      unsigned stride_depth = 4)
+		: fd_(fd), max_window_(max_window), depth_(stride_depth)
+	{}
+
+	/**
+	 *  @breif  Read data at an offset and prefetch what is likely next.
+	 *  @return The size of the data it read in bytes.
+	 */
+	template <typename T>
+	std::size_t read_object(T* ptr, std::size_t nbytes, std::uint64_t off)
+	{
+		classify(off, nbytes);
+		account(off, nbytes);
+		prefetch(off, nbytes);
+		++stats_.reads;
+
+		return pread_all(fd_, ptr, nbytes, static_cast<off_t>(off));
+	}
+
+	/**
+	 *  @breif  The pattern the reader currently assumes.
+	 *  @return The access pattern.
+	 */
+	[[nodiscard]]
+	access_pattern pattern() const noexcept
+	{ return pattern_; }
+
+	/**
+	 *  @breif  Prefetch counters.
+	 *  @return The statistics.
+	 */
+	[[nodiscard]]
+	const prefetch_stats& stats() const noexcept
+	{ return stats_; }
+
+private:
+	void classify(std::uint64_t off, std::size_t len)
+	{
+		auto seen = access_pattern::random;
+		const auto step = static_cast<std::int64_t>(off - last_off_);
+
+		if (reads_ > 0 && off == last_off_ + last_len_)
+			seen = access_pattern::sequential;
+		else if (reads_ > 1 && step != 0 && step == last_step_ && len == last_len_)
+			seen = access_pattern::strided;
+
+		// Switch only after two reads agree.
+		if (seen == candidate_) {
+			if (seen != pattern_) {
+				pattern_ = seen;
+				window_ = 128 << 10;
+				ra_end_ = seen == access_pattern::sequential ? off + len : off;
+				advise(seen == access_pattern::sequential ?
+				       POSIX_FADV_SEQUENTIAL : POSIX_FADV_RANDOM);
+			}
+		}
+		candidate_ = seen;
+
+		last_step_ = step;
+		last_off_ = off;
+		last_len_ = len;
+		++reads_;
+	}
+
+	void prefetch(std::uint64_t off, std::size_t len)
+	{
+		const auto end = off + len;
+
+		if (pattern_ == access_pattern::sequential) {
+			// Refill once the reader is into the second half of the window.
+			if (ra_end_ < end)
+				ra_end_ = end;
+			if (ra_end_ - end <= window_ / 2) {
+				issue(ra_end_, window_);
+				ra_end_ += window_;
+				window_ = std::min(window_ * 2, max_window_);
+			}
+		} else if (pattern_ == access_pattern::strided && last_step_ > 0) {
+			const auto step = static_cast<std::uint64_t>(last_step_);
+			if (ra_end_ <= off || ra_end_ > off + step * depth_)
+				ra_end_ = off;
+			while (ra_end_ < off + step * depth_) {
+				ra_end_ += step;
+				issue(ra_end_, len);
+			}
+		} else if (pattern_ == access_pattern::strided) {
+			// Backward: ra_end_ is the lowest stride prefetched, and the
+			// strides stop short of the start of the file.
+			const auto step = static_cast<std::uint64_t>(-last_step_);
+			const auto reach = off >= step * depth_ ? off - step * depth_ : off % step;
+			if (ra_end_ >= off || ra_end_ < reach)
+				ra_end_ = off;
+			while (ra_end_ >= reach + step) {
+				ra_end_ -= step;
+				issue(ra_end_, len);
+			}
+		}
+	}
+
+	void issue(std::uint64_t off, std::size_t len)
+	{
+		::posix_fadvise(fd_, static_cast<off_t>(off), static_cast<off_t>(len),
+				POSIX_FADV_WILLNEED);
+
+		++stats_.prefetches;
+		stats_.prefetched_bytes += len;
+		auto& end = issued_[off];
+		end = std::max(end, off + len);
+
+		// Only keep a bounded history of what was prefetched.
+		while (issued_.size() > 256)
+			issued_.erase(issued_.begin());
+	}
+
+	// Count the part of a read that was prefetched earlier, once.
+	void account(std::uint64_t off, std::size_t len)
+	{
+		const auto end = off + len;
+		auto it = issued_.upper_bound(off);
+		if (it != issued_.begin())
+			--it;
+
+		while (it != issued_.end() && it->first < end) {
+			const auto a = std::max(off, it->first);
+			const auto b = std::min(end, it->second);
+			if (a >= b) {
+				++it;
+				continue;
+			}
+
+			stats_.useful_bytes += b - a;
+			const auto s = it->first, e = it->second;
+			it = issued_.erase(it);
+			if (s < a)
+				issued_.emplace(s, a);
+			if (b < e)
+				it = issued_.emplace(b, e).first;
+		}
+	}
+
+	void advise(int advice)
+	{ ::posix_fadvise(fd_, 0, 0, advice); }
+
+	int fd_;
+	std::size_t max_window_;
+	unsigned depth_;
+
+	access_pattern pattern_ = access_pattern::unknown;
+	access_pattern candidate_ = access_pattern::unknown;
+	std::uint64_t reads_ = 0;
+	std::uint64_t last_off_ = 0;
+	std::size_t last_len_ = 0;
+	std::int64_t last_step_ = 0;
+
+	// End of the sequential window, or the last stride prefetched.
+	std::size_t window_ = 128 << 10;
+	std::uint64_t ra_end_ = 0;
+	std::map<std::uint64_t, std::uint64_t> issued_;
+	prefetch_stats stats_;
+};
+
+#ifdef __linux__
+
+/**
+ *  @breif  Minimal io_uring instance driven through raw syscalls.
+ *
+ *  Just enough to queue SQEs, submit them and reap completions,
+ *  without depending on liburing.
+ */
+class uring {
+public:
+	explicit uring(unsigned entries)
+	{
+		struct io_uring_params p;
+		std::memset(&p, 0, sizeof(p));
+
+		fd_ = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &p));
+		if (fd_ == -1)
+			throw fs_error::get("io_uring_setup()");
+
+		sq_size_ = p.sq_off.array + p.sq_entries * sizeof(std::uint32_t);
+		cq_size_ = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+		if (p.features & IORING_FEAT_SINGLE_MMAP)
+			sq_size_ = cq_size_ = std::max(sq_size_, cq_size_);
+
+		sq_ = ::mmap(nullptr, sq_size_, PROT_READ | PROT_WRITE,
+			     MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQ_RING);
+		if (sq_ == MAP_FAILED) {
+			const auto err = fs_error::get("mmap()");
+			::close(fd_);
+			throw err;
+		}
+
+		cq_ = sq_;
+		if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+			cq_ = ::mmap(nullptr, cq_size_, PROT_READ | PROT_WRITE,
+				     MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_CQ_RING);
+			if (cq_ == MAP_FAILED) {
+				const auto err = fs_error::get("mmap()");
+				::munmap(sq_, sq_size_);
+				::close(fd_);
+				throw err;
+			}
+		}
+
+		sqes_size_ = p.sq_entries * sizeof(struct io_uring_sqe);
+		auto sqes = ::mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, fd_, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED) {
+			const auto err = fs_error::get("mmap()");
+			unmap_rings();
+			::close(fd_);
+			throw err;
+		}
+		sqes_ = static_cast<struct io_uring_sqe*>(sqes);
+
+		auto sq = static_cast<char*>(sq_);
+		auto cq = static_cast<char*>(cq_);
+		sq_head_ = reinterpret_cast<unsigned*>(sq + p.sq_off.head);
+		sq_tail_ = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+		sq_mask_ = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+		sq_array_ = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+		sq_entries_ = p.sq_entries;
+		cq_head_ = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+		cq_tail_ = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+		cq_mask_ = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+		cqes_ = reinterpret_cast<struct io_uring_cqe*>(cq + p.cq_off.cqes);
+	}
+
+	uring(const uring&) = delete;
+	uring& operator=(const uring&) = delete;
+
+	~uring()
+	{
+		::munmap(sqes_, sqes_size_);
+		unmap_rings();
+		::close(fd_);
+	}
+
+	/**
+	 *  @breif  Check whether the kernel implements an IORING_OP_*.
+	 *  @return If successful, it returns true, otherwise false.
+	 */
+	[[nodiscard]]
+	bool supports(unsigned op) const
+	{
+		const auto len = sizeof(struct io_uring_probe) +
+			256 * sizeof(struct io_uring_probe_op);
+		std::unique_ptr<char[]> buf(new char[len]());
+		auto probe = reinterpret_cast<struct io_uring_probe*>(buf.get());
+
+		if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_PROBE,
+			      probe, 256) == -1)
+			return false;
+
+		return op <= probe->last_op &&
+			(probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+	}
+
+	/**
+	 *  @breif  Register an empty table of n direct descriptors.
+	 *  @return None.
+	 */
+	void register_sparse_files(unsigned n)
+	{
+		std::vector<int> fds(n, -1);
+		if (::syscall(__NR_io_uring_register, fd_, IORING_REGISTER_FILES,
+			      fds.data(), n) == -1)
+			throw fs_error::get("io_uring_register()");
+	}
+
+	/**
+	 *  @breif  Number of SQEs that can still be queued.
+	 *  @return The count.
+	 */
+	[[nodiscard]]
+	unsigned sq_space() const noexcept
+	{
+		const auto head = __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+		return sq_entries_ - (tail_ - head);
+	}
+
+	/**
+	 *  @breif  Queue a new, zeroed SQE. Check sq_space() first.
+	 *  @return The SQE to fill in.
+	 */
+	struct io_uring_sqe* get_sqe() noexcept
+	{
+		const auto idx = tail_ & sq_mask_;
+		auto sqe = &sqes_[idx];
+		std::memset(sqe, 0, sizeof(*sqe));
+		sq_array_[idx] = idx;
+		++tail_;
+		return sqe;
+	}
+
+	/**
+	 *  @breif  Submit queued SQEs and wait for wait_nr completions.
+	 *  @return None.
+	 */
+	void submit(unsigned wait_nr = 0)
+	{
+		__atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+		const auto to_submit = tail_ - submitted_;
+
+		for (;;) {
+			auto ret = ::syscall(__NR_io_uring_enter, fd_, to_submit, wait_nr,
+					     wait_nr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+			if (ret == -1) {
+				if (errno == EINTR)
+					continue;
+				throw fs_error::get("io_uring_enter()");
+			}
+			break;
+		}
+		submitted_ = tail_;
+	}
+
+	/**
+	 *  @breif  Take the next completion, if there is one.
+	 *  @return If successful, it returns true, otherwise false.
+	 */
+	bool pop(struct io_uring_cqe& out) noexcept
+	{
+		const auto head = *cq_head_;
+		if (head == __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE))
+			return false;
+
+		out = cqes_[head & cq_mask_];
+		__atomic_store_n(cq_head_, head + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+	/**
+	 *  @breif  Submit what is queued, then wait for n completions and
+	 *  drop them. For error paths: buffers a request points to must
+	 *  stay alive until its completion has arrived.
+	 *  @return None.
+	 */
+	void drain(unsigned n) noexcept
+	{
+		__atomic_store_n(sq_tail_, tail_, __ATOMIC_RELEASE);
+		auto to_submit = tail_ - submitted_;
+		submitted_ = tail_;
+
+		struct io_uring_cqe cqe;
+		while (n > 0) {
+			if (pop(cqe)) {
+				--n;
+				continue;
+			}
+			if (::syscall(__NR_io_uring_enter, fd_, to_submit, 1,
+				      IORING_ENTER_GETEVENTS, nullptr, 0) == -1 && errno != EINTR)
+				return;
+			to_submit = 0;
+		}
+	}
+
+private:
+	void unmap_rings() noexcept
+	{
+		if (cq_ != sq_)
+			::munmap(cq_, cq_size_);
+		::munmap(sq_, sq_size_);
+	}
+
+	int fd_ = -1;
+	void* sq_ = nullptr;
+	void* cq_ = nullptr;
+	std::size_t sq_size_ = 0;
+	std::size_t cq_size_ = 0;
+	std::size_t sqes_size_ = 0;
+	struct io_uring_sqe* sqes_ = nullptr;
+
+	unsigned* sq_head_ = nullptr;
+	unsigned* sq_tail_ = nullptr;
+	unsigned* sq_array_ = nullptr;
+	unsigned sq_mask_ = 0;
+	unsigned sq_entries_ = 0;
+	unsigned tail_ = 0;
+	unsigned submitted_ = 0;
+
+	unsigned* cq_head_ = nullptr;
+	unsigned* cq_tail_ = nullptr;
+	unsigned cq_mask_ = 0;
+	struct io_uring_cqe* cqes_ = nullptr;
+};
+
+#endif
+
+/**
+ *  @breif  One item of a bulk_create() manifest.
+ *
+ *  Directories take their mode from the entry, missing parents of any
+ *  entry are created as with "mkdir -p".
+ */
+struct bulk_entry {
+	std::string path;
+	mode_t mode = fs_perms::owner_read | fs_perms::owner_write |
+		fs_perms::group_read | fs_perms::others_read;
+	std::string contents;
+	bool directory = false;
+};
+
+/**
+ *  @breif  Collect the directories a manifest needs, parents included.
+ *  @return Directories to create, grouped by depth.
+ *  @type   Private function (intended)
+ */
+std::vector<std::vector<std::pair<std::string, mode_t>>>
+bulk_directories(const std::vector<bulk_entry>& entries)
+{
+	std::map<std::string, mode_t> dirs;
+
+	for (const auto& ent : entries) {
+		for (auto pos = ent.path.find('/', 1); pos != std::string::npos;
+		     pos = ent.path.find('/', pos + 1))
+			dirs.emplace(ent.path.substr(0, pos), fs_perms::all);
+		if (ent.directory)
+			dirs[ent.path] = ent.mode;
+	}
+
+	std::vector<std::vector<std::pair<std::string, mode_t>>> levels;
+	for (const auto& d : dirs) {
+		const auto depth = static_cast<std::size_t>(
+			std::count(d.first.begin(), d.first.end(), '/'));
+		if (levels.size() <= depth)
+			levels.resize(depth + 1);
+		levels[depth].push_back(d);
+	}
+
+	return levels;
+}
+
+/**
+ *  @breif  Write one file of a bulk_create() manifest synchronously.
+ *  @return None.
+ *  @type   Private function (intended)
+ */
+void bulk_write(const bulk_entry& ent)
+{
+	auto fd = open_file(ent.path, fs_omode::writeonly | fs_omode::create |
+			    fs_omode::truncate | fs_omode::close_exec, ent.mode);
+	try {
+		write_all(fd, ent.contents.data(), ent.contents.size());
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+	close_file(fd);
+}
+
+/**
+ *  @breif  Thread pool version of bulk_create().
+ *  @return None.
+ *  @type   Private function (intended)
+ */
+void bulk_create_threads(const std::vector<bulk_entry>& entries, unsigned threads)
+{
+	io_probe probe;
+
+	for (const auto& level : bulk_directories(entries)) {
+		for (const auto& d : level) {
+			probe.call();
+			if (::mkdir(d.first.c_str(), d.second) == -1 && errno != EEXIST)
+				throw fs_error::get("mkdir(): " + d.first);
+		}
+	}
+
+	std::atomic<std::size_t> next { 0 };
+	std::mutex err_mtx;
+	std::exception_ptr err;
+
+	auto work = [&]
+	{
+		try {
+			for (auto i = next++; i < entries.size(); i = next++) {
+				if (!entries[i].directory)
+					bulk_write(entries[i]);
+			}
+		} catch (...) {
+			std::lock_guard<std::mutex> lk(err_mtx);
+			if (!err)
+				err = std::current_exception();
+			next = entries.size();
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned t = 1; t < threads; ++t)
+		pool.push_back(scoped_thread(work));
+	work();
+	for (auto& t : pool)
+		t.join();
+	if (err)
+		std::rethrow_exception(err);
+}
+
+/**
+ *  @breif  Create many small files (and their directories) at once.
+ *  @return None.
+ *
+ *  Directories are created level by level with batched IORING_OP_MKDIRAT.
+ *  Each file is then a linked OPENAT -> WRITE -> CLOSE chain on a
+ *  direct descriptor, with up to depth chains in flight. Kernels (or
+ *  sandboxes) without those io_uring operations fall back to a
+ *  thread pool doing the same with plain syscalls.
+ */
+void bulk_create(const std::vector<bulk_entry>& entries, unsigned depth = 256)
+{
+	const auto threads = std::max(1u, std::thread::hardware_concurrency());
+
+#ifdef __linux__
+	std::unique_ptr<uring> ring;
+	try {
+		ring.reset(new uring(std::max(8u, depth * 4)));
+		if (!ring->supports(IORING_OP_MKDIRAT) || !ring->supports(IORING_OP_OPENAT) ||
+		    !ring->supports(IORING_OP_WRITE) || !ring->supports(IORING_OP_CLOSE))
+			ring.reset();
+		else
+			ring->register_sparse_files(depth);
+	} catch (const std::system_error&) {
+		ring.reset();
+	}
+	if (!ring)
+		return bulk_create_threads(entries, threads);
+
+	// Each completion is charged as the syscall it stands for.
+	io_probe probe;
+	struct io_uring_cqe cqe;
+	std::string failed;
+	int error = 0;
+	auto fail = [&](int res, const std::string& path)
+	{
+		if (error == 0 && res < 0) {
+			error = -res;
+			failed = path;
+		}
+	};
+
+	for (const auto& level : bulk_directories(entries)) {
+		for (std::size_t i = 0; i < level.size(); ) {
+			unsigned n = 0;
+			for (; i < level.size() && ring->sq_space() > 0; ++i, ++n) {
+				auto sqe = ring->get_sqe();
+				sqe->opcode = IORING_OP_MKDIRAT;
+				sqe->fd = AT_FDCWD;
+				sqe->addr = reinterpret_cast<std::uintptr_t>(level[i].first.c_str());
+				sqe->len = level[i].second;
+				sqe->user_data = i;
+			}
+			ring->submit(n);
+			for (; n > 0; --n) {
+				while (!ring->pop(cqe))
+					ring->submit(1);
+				probe.call();
+				if (cqe.res != -EEXIST)
+					fail(cqe.res, level[cqe.user_data].first);
+			}
+		}
+		if (error)
+			throw fs_error::get(error, "mkdirat(): " + failed);
+	}
+
+	// One chain per file, identified by its direct descriptor slot.
+	struct chain {
+		std::size_t entry;
+		unsigned pending;
+	};
+	std::vector<chain> chains(depth);
+	std::vector<unsigned> free_slots;
+	for (unsigned s = depth; s > 0; --s)
+		free_slots.push_back(s - 1);
+
+	std::size_t next = 0;
+	unsigned inflight = 0;
+	for (;;) {
+		while (next < entries.size() && !free_slots.empty() && ring->sq_space() >= 3) {
+			const auto& ent = entries[next];
+			if (ent.directory) {
+				++next;
+				continue;
+			}
+			if (ent.contents.size() > (1u << 30)) {
+				try {
+					bulk_write(ent);
+				} catch (const std::system_error& e) {
+					fail(-e.code().value(), ent.path);
+				}
+				++next;
+				continue;
+			}
+
+			const auto slot = free_slots.back();
+			free_slots.pop_back();
+			chains[slot] = { next, 3 };
+
+			auto sqe = ring->get_sqe();
+			sqe->opcode = IORING_OP_OPENAT;
+			sqe->fd = AT_FDCWD;
+			sqe->addr = reinterpret_cast<std::uintptr_t>(ent.path.c_str());
+			sqe->len = ent.mode;
+			// Direct descriptors never enter the fd table, the kernel
+			// refuses O_CLOEXEC for them.
+			sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC;
+			sqe->file_index = slot + 1;
+			sqe->flags = IOSQE_IO_LINK;
+			sqe->user_data = slot;
+
+			sqe = ring->get_sqe();
+			sqe->opcode = IORING_OP_WRITE;
+			sqe->fd = static_cast<int>(slot);
+			sqe->addr = reinterpret_cast<std::uintptr_t>(ent.contents.data());
+			sqe->len = static_cast<std::uint32_t>(ent.contents.size());
+			sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+			sqe->user_data = (std::uint64_t(1) << 32) | slot;
+
+			sqe = ring->get_sqe();
+			sqe->opcode = IORING_OP_CLOSE;
+			sqe->file_index = slot + 1;
+			sqe->user_data = (std::uint64_t(2) << 32) | slot;
+
+			++next;
+			++inflight;
+		}
+
+		if (inflight == 0)
+			break;
+
+		ring->submit(1);
+		while (ring->pop(cqe)) {
+			const auto slot = static_cast<unsigned>(cqe.user_data & 0xffffffff);
+			const auto op = cqe.user_data >> 32;
+			auto& ch = chains[slot];
+			const auto& ent = entries[ch.entry];
+
+			if (op == 0)
+				probe.open();
+			else if (op == 1)
+				probe.write(cqe.res);
+			else
+				probe.call();
+
+			// A failed open cancels the rest of the chain.
+			if (op == 1 && cqe.res >= 0 &&
+			    static_cast<std::size_t>(cqe.res) != ent.contents.size())
+				fail(-EIO, ent.path);
+			else if (cqe.res != -ECANCELED && !(op == 2 && cqe.res == -EBADF))
+				fail(cqe.res, ent.path);
+
+			if (--ch.pending == 0) {
+				free_slots.push_back(slot);
+				--inflight;
+			}
+		}
+	}
+
+	if (error)
+		throw fs_error::get(error, "bulk_create(): " + failed);
+#else
+	bulk_create_threads(entries, threads);
+#endif
+}
+
+/**
+ *  @breif  Copy len bytes between two opened files, fastest way first.
+ *  @return None.
+ *
+ *  Tries a reflink (FICLONE), then copy_file_range(), then sendfile()
+ *  and finally plain read()/write(), stepping down whenever the
+ *  kernel or filesystem refuses the faster one.
+ */
+void copy_data(int rfd, int wfd, std::uintmax_t len)
+{
+	io_probe probe;
+
+#ifdef __linux__
+	// A reflink moves no data, but counts like a copy of all of it.
+	if (::ioctl(wfd, FICLONE, rfd) == 0) {
+		probe.copy(static_cast<ssize_t>(len));
+		return;
+	}
+	probe.call();
+
+	bool range = true, send = true;
+#endif
+	std::unique_ptr<char[]> buf;
+	off_t off = 0;
+
+	while (static_cast<std::uintmax_t>(off) < len) {
+		const auto want = static_cast<std::size_t>(
+			std::min<std::uintmax_t>(len - static_cast<std::uintmax_t>(off), 1 << 30));
+		ssize_t sz = -1;
+
+#ifdef __linux__
+		if (range) {
+			auto in = off, out = off;
+			sz = ::copy_file_range(rfd, &in, wfd, &out, want, 0);
+			probe.copy(sz);
+			if (sz == -1 && (errno == EXDEV || errno == EINVAL ||
+					 errno == ENOSYS || errno == EOPNOTSUPP)) {
+				range = false;
+				continue;
+			}
+		} else if (send) {
+			if (::lseek(wfd, off, SEEK_SET) == -1)
+				throw fs_error::get("lseek()");
+			auto in = off;
+			sz = ::sendfile(wfd, rfd, &in, want);
+			probe.copy(sz);
+			if (sz == -1 && (errno == EINVAL || errno == ENOSYS)) {
+				send = false;
+				continue;
+			}
+		} else
+#endif
+		{
+			if (!buf)
+				buf.reset(new char[1 << 20]);
+			sz = pread_all(rfd, buf.get(), std::min<std::size_t>(want, 1 << 20), off);
+			pwrite_all(wfd, buf.get(), static_cast<std::size_t>(sz), off);
+		}
+
+		if (sz == -1) {
+			if (errno == EINTR)
+				continue;
+			throw fs_error::get("copy_data()");
+		}
+		if (sz == 0)
+			throw fs_error::get(EIO, "copy_data(): source shrank");
+		off += sz;
+	}
+}
+
+/**
+ *  @breif  Copy the data regions of a file, leaving holes for its holes
+ *  and zero blocks.
+ *  @return None.
+ *  @type   Private function (intended)
+ */
+void copy_sparse(int rfd, int wfd, const struct stat& st)
+{
+	std::unique_ptr<char[]> buf(new char[1 << 20]);
+	off_t pos = 0;
+
+	while (pos < st.st_size) {
+		auto data = ::lseek(rfd, pos, SEEK_DATA);
+		if (data == -1) {
+			if (errno == ENXIO)
+				break;
+			data = pos;
+		}
+		auto hole = ::lseek(rfd, data, SEEK_HOLE);
+		if (hole == -1)
+			hole = st.st_size;
+
+		for (pos = data; pos < hole; ) {
+			const auto want = static_cast<std::size_t>(
+				std::min<off_t>(hole - pos, 1 << 20));
+			const auto got = pread_all(rfd, buf.get(), want, pos);
+			if (got == 0)
+				break;
+			pwrite_sparse(wfd, buf.get(), got, pos,
+				      static_cast<std::size_t>(st.st_blksize));
+			pos += static_cast<off_t>(got);
+		}
+		pos = std::max(pos, hole);
+	}
+
+	if (::ftruncate(wfd, st.st_size) == -1)
+		throw fs_error::get("ftruncate()");
+}
+
+/**
+ *  @breif  Copy a file on the filesystem, keeping its permissions.
+ *  @return None.
+ *
+ *  With sparse set, only the data regions of the source
+ *  (SEEK_DATA/SEEK_HOLE) are read and zero blocks inside them are
+ *  skipped too, so the copy allocates neither.
+ */
+void copy_file(const std::string& target, const std::string& dest_path,
+	       bool sparse = false)
+{
+	auto rfd = open_file(target, fs_omode::readonly | fs_omode::close_exec);
+
+	struct stat st;
+
+	if (::fstat(rfd, &st) == -1) {
+		const auto err = fs_error::get("fstat()");
+		::close(rfd);
+		throw err;
+	}
+
+	auto wfd = ::open(dest_path.c_str(), fs_omode::writeonly | fs_omode::create |
+			  fs_omode::truncate | fs_omode::close_exec, st.st_mode & fs_perms::mask);
+	if (wfd == -1) {
+		const auto err = fs_error::get("open()");
+		::close(rfd);
+		throw err;
+	}
+
+	try {
+		if (sparse)
+			copy_sparse(rfd, wfd, st);
+		else
+			copy_data(rfd, wfd, static_cast<std::uintmax_t>(st.st_size));
+	} catch (...) {
+		::close(rfd);
+		::close(wfd);
+		throw;
+	}
+	::close(rfd);
+	close_file(wfd);
+}
+
+/**
+ *  @breif  Copy ownership, permissions, timestamps and extended
+ *  attributes from one opened file to another.
+ *  @return None.
+ *
+ *  Ownership and xattrs are best effort, they need privileges or
+ *  filesystem support the destination may not have.
+ */
+void copy_metadata(int rfd, int wfd, const struct stat& st)
+{
+	if (::fchown(wfd, st.st_uid, st.st_gid) == -1 && errno != EPERM)
+		throw fs_error::get("fchown()");
+	if (::fchmod(wfd, st.st_mode & fs_perms::mask) == -1)
+		throw fs_error::get("fchmod()");
+
+#ifdef __linux__
+	auto len = ::flistxattr(rfd, nullptr, 0);
+	if (len > 0) {
+		std::vector<char> names(static_cast<std::size_t>(len));
+		len = ::flistxattr(rfd, names.data(), names.size());
+		std::vector<char> value;
+		for (ssize_t i = 0; i < len; i += static_cast<ssize_t>(std::strlen(&names[i])) + 1) {
+			auto vlen = ::fgetxattr(rfd, &names[i], nullptr, 0);
+			if (vlen < 0)
+				continue;
+			value.resize(static_cast<std::size_t>(vlen));
+			vlen = ::fgetxattr(rfd, &names[i], value.data(), value.size());
+			if (vlen >= 0)
+				::fsetxattr(wfd, &names[i], value.data(),
+					    static_cast<std::size_t>(vlen), 0);
+		}
+	}
+#endif
+
+	const struct timespec times[2] = { st.st_atim, st.st_mtim };
+	if (::futimens(wfd, times) == -1)
+		throw fs_error::get("futimens()");
+}
+
+/**
+ *  @breif  Remove a file, a symlink or a whole directory tree.
+ *  @return None.
+ */
+void remove_all(const std::string& path)
+{
+	struct stat st;
+
+	if (::lstat(path.c_str(), &st) == -1) {
+		if (errno == ENOENT)
+			return;
+		throw fs_error::get("lstat()");
+	}
+
+	if (!S_ISDIR(st.st_mode)) {
+		remove_file(path);
+		return;
+	}
+
+	auto dp = ::opendir(path.c_str());
+	if (dp == nullptr)
+		throw fs_error::get("opendir()");
+
+	std::vector<std::string> names;
+	while (auto ent = ::readdir(dp)) {
+		if (std::strcmp(ent->d_name, ".") != 0 && std::strcmp(ent->d_name, "..") != 0)
+			names.push_back(ent->d_name);
+	}
+	::closedir(dp);
+
+	for (const auto& name : names)
+		remove_all(path + "/" + name);
+	remove_empty_directory(path);
+}
+
+/**
+ *  @breif  Flush a directory entry change to the disk.
+ *  @return None.
+ *  @type   Private function (intended)
+ */
+void sync_parent(const std::string& path)
+{
+	const auto pos = path.rfind('/');
+	const auto dir = pos == std::string::npos ? std::string(".") :
+		pos == 0 ? std::string("/") : path.substr(0, pos);
+
+	auto fd = open_file(dir, fs_omode::readonly | fs_omode::directory |
+			    fs_omode::close_exec);
+	const auto ret = ::fsync(fd);
+	::close(fd);
+	if (ret == -1)
+		throw fs_error::get("fsync()");
+}
+
+/**
+ *  @breif  Copy a file, symlink, special file or directory tree with
+ *  its metadata, each file synced before it becomes visible.
+ *  @return None.
+ *  @type   Private function (intended)
+ */
+void copy_tree(const std::string& src, const std::string& dst)
+{
+	struct stat st;
+
+	if (::lstat(src.c_str(), &st) == -1)
+		throw fs_error::get("lstat()");
+
+	if (S_ISLNK(st.st_mode)) {
+		std::vector<char> target(static_cast<std::size_t>(st.st_size) + 1);
+		const auto len = ::readlink(src.c_str(), target.data(), target.size());
+		if (len == -1)
+			throw fs_error::get("readlink()");
+		create_symlink(std::string(target.data(), static_cast<std::size_t>(len)), dst);
+		::lchown(dst.c_str(), st.st_uid, st.st_gid);
+		return;
+	}
+
+	if (S_ISDIR(st.st_mode)) {
+		if (::mkdir(dst.c_str(), (st.st_mode & fs_perms::mask) | fs_perms::owner_all) == -1)
+			throw fs_error::get("mkdir()");
+
+		auto dp = ::opendir(src.c_str());
+		if (dp == nullptr)
+			throw fs_error::get("opendir()");
+		std::vector<std::string> names;
+		while (auto ent = ::readdir(dp)) {
+			if (std::strcmp(ent->d_name, ".") != 0 && std::strcmp(ent->d_name, "..") != 0)
+				names.push_back(ent->d_name);
+		}
+		::closedir(dp);
+
+		for (const auto& name : names)
+			copy_tree(src + "/" + name, dst + "/" + name);
+
+		// Metadata last, the copies above changed the mtime.
+		auto rfd = open_file(src, fs_omode::readonly | fs_omode::directory |
+				     fs_omode::close_exec);
+		auto wfd = ::open(dst.c_str(), fs_omode::readonly | fs_omode::directory |
+				  fs_omode::close_exec);
+		if (wfd == -1) {
+			const auto err = fs_error::get("open()");
+			::close(rfd);
+			throw err;
+		}
+		try {
+			copy_metadata(rfd, wfd, st);
+			if (::fsync(wfd) == -1)
+				throw fs_error::get("fsync()");
+		} catch (...) {
+			::close(rfd);
+			::close(wfd);
+			throw;
+		}
+		::close(rfd);
+		::close(wfd);
+		return;
+	}
+
+	if (!S_ISREG(st.st_mode)) {
+		if (::mknod(dst.c_str(), st.st_mode, st.st_rdev) == -1)
+			throw fs_error::get("mknod()");
+		::lchown(dst.c_str(), st.st_uid, st.st_gid);
+		return;
+	}
+
+	auto rfd = open_file(src, fs_omode::readonly | fs_omode::close_exec);
+	auto wfd = ::open(dst.c_str(), fs_omode::writeonly | fs_omode::create |
+			  fs_omode::excl | fs_omode::close_exec, fs_perms::owner_write);
+	if (wfd == -1) {
+		const auto err = fs_error::get("open()");
+		::close(rfd);
+		throw err;
+	}
+
+	try {
+		copy_data(rfd, wfd, static_cast<std::uintmax_t>(st.st_size));
+		copy_metadata(rfd, wfd, st);
+		if (::fsync(wfd) == -1)
+			throw fs_error::get("fsync()");
+	} catch (...) {
+		::close(rfd);
+		::close(wfd);
+		::unlink(dst.c_str());
+		throw;
+	}
+	::close(rfd);
+	close_file(wfd);
+}
+
+/**
+ *  @breif  Move a file or a directory tree, also across filesystems.
+ *  @return None.
+ *
+ *  A rename is tried first. On EXDEV the source is copied next to the
+ *  destination under a temporary name (data, permissions, ownership,
+ *  timestamps and xattrs), synced, renamed into place and only then
+ *  removed. As with rename(), only a directory replaces a directory,
+ *  and only when it is empty. Hard links inside a moved tree are
+ *  copied as separate files.
+ */
+void move_path(const std::string& old_path, const std::string& new_path)
+{
+	if (::rename(old_path.c_str(), new_path.c_str()) == 0)
+		return;
+	if (errno != EXDEV)
+		throw fs_error::get("rename()");
+
+	// Same rules as rename(): only a directory replaces a directory.
+	struct stat src, dst;
+	if (::lstat(old_path.c_str(), &src) == -1)
+		throw fs_error::get("lstat()");
+	if (::lstat(new_path.c_str(), &dst) == 0) {
+		if (S_ISDIR(dst.st_mode) && !S_ISDIR(src.st_mode))
+			throw fs_error::get(EISDIR, "rename()");
+		if (!S_ISDIR(dst.st_mode) && S_ISDIR(src.st_mode))
+			throw fs_error::get(ENOTDIR, "rename()");
+	}
+
+	// Stage the copy inside a private directory next to the target,
+	// whatever else lies around there is never touched.
+	std::string stage = new_path + ".fs_mini.XXXXXX";
+	if (::mkdtemp(&stage[0]) == nullptr)
+		throw fs_error::get("mkdtemp()");
+	const auto tmp = stage + "/item";
+
+	try {
+		copy_tree(old_path, tmp);
+
+		// Replacing a directory needs it gone (and empty) first.
+		if (S_ISDIR(src.st_mode) && is_directory_exists(new_path))
+			remove_empty_directory(new_path);
+		rename_path(tmp, new_path);
+	} catch (...) {
+		remove_all(stage);
+		throw;
+	}
+	remove_empty_directory(stage);
+	sync_parent(new_path);
+	remove_all(old_path);
+}
+
+/**
+ *  @breif  Move many paths at once.
+ *  @return None.
+ *
+ *  Moves are grouped by their (source, destination) parent directory
+ *  pair and use renameat() relative to directory descriptors opened
+ *  once per group, so the parents are not looked up again per entry.
+ *  Groups that share a directory (by name) run on the same thread, so
+ *  threads do not contend on a directory lock; renames between
+ *  directories of one filesystem still serialize in the kernel.
+ *  Cross-device items fall back to move_path(). The descriptors come
+ *  out of fd_budget::global(): with less to spare fewer threads run,
+ *  with none the moves go by path on one thread.
+ */
+void move_paths(const std::vector<std::pair<std::string, std::string>>& moves,
+		unsigned threads = 0)
+{
+	const auto split = [](const std::string& path)
+	{
+		const auto pos = path.rfind('/');
+		if (pos == std::string::npos)
+			return std::make_pair(std::string("."), path);
+		return std::make_pair(pos == 0 ? std::string("/") : path.substr(0, pos),
+				      path.substr(pos + 1));
+	};
+
+	std::map<std::pair<std::string, std::string>, std::vector<std::size_t>> groups;
+	for (std::size_t i = 0; i < moves.size(); ++i)
+		groups[std::make_pair(split(moves[i].first).first,
+				      split(moves[i].second).first)].push_back(i);
+
+	// Union the groups that touch a common directory into one unit
+	// of work.
+	std::map<std::string, std::size_t> dir_ids;
+	std::vector<std::size_t> parent;
+	const auto id = [&](const std::string& dir)
+	{
+		auto it = dir_ids.emplace(dir, parent.size());
+		if (it.second)
+			parent.push_back(parent.size());
+		return it.first->second;
+	};
+	const auto find = [&](std::size_t x)
+	{
+		while (parent[x] != x)
+			x = parent[x] = parent[parent[x]];
+		return x;
+	};
+	for (const auto& g : groups)
+		parent[find(id(g.first.first))] = find(id(g.first.second));
+
+	using group = std::pair<const std::pair<std::string, std::string>,
+				std::vector<std::size_t>>;
+	std::map<std::size_t, std::vector<const group*>> units;
+	for (const auto& g : groups)
+		units[find(id(g.first.first))].push_back(&g);
+
+	std::vector<std::vector<const group*>> work;
+	for (auto& u : units)
+		work.push_back(std::move(u.second));
+
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = static_cast<unsigned>(std::min<std::size_t>(threads, work.size()));
+
+	// Each thread holds two directory descriptors. Past the fd budget
+	// fewer threads run, and with none to spare moves go by path.
+	const auto res = fd_budget::global().reserve(2 * static_cast<std::size_t>(threads), 2);
+	threads = res ? std::min(threads, static_cast<unsigned>(res.count() / 2)) : 1;
+
+	auto move_group = [&](const group& g)
+	{
+		if (!res) {
+			for (auto idx : g.second) {
+				const auto& m = moves[idx];
+				if (::rename(m.first.c_str(), m.second.c_str()) == 0)
+					continue;
+				if (errno != EXDEV)
+					throw fs_error::get("rename(): " + m.first);
+				move_path(m.first, m.second);
+			}
+			return;
+		}
+
+		const int flags = fs_omode::readonly | fs_omode::directory |
+			fs_omode::close_exec;
+		auto sfd = open_file(g.first.first, flags);
+		auto dfd = ::open(g.first.second.c_str(), flags);
+		if (dfd == -1) {
+			const auto e = fs_error::get("open()");
+			::close(sfd);
+			throw e;
+		}
+
+		try {
+			for (auto idx : g.second) {
+				const auto& m = moves[idx];
+				if (::renameat(sfd, split(m.first).second.c_str(),
+					       dfd, split(m.second).second.c_str()) == 0)
+					continue;
+				if (errno != EXDEV)
+					throw fs_error::get("renameat(): " + m.first);
+				move_path(m.first, m.second);
+			}
+		} catch (...) {
+			::close(sfd);
+			::close(dfd);
+			throw;
+		}
+		::close(sfd);
+		::close(dfd);
+	};
+
+	std::atomic<std::size_t> next { 0 };
+	std::mutex err_mtx;
+	std::exception_ptr err;
+
+	auto run = [&]
+	{
+		try {
+			for (auto i = next++; i < work.size(); i = next++) {
+				for (const auto g : work[i])
+					move_group(*g);
+			}
+		} catch (...) {
+			std::lock_guard<std::mutex> lk(err_mtx);
+			if (!err)
+				err = std::current_exception();
+			next = work.size();
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned t = 1; t < threads; ++t)
+		pool.push_back(scoped_thread(run));
+	run();
+	for (auto& t : pool)
+		t.join();
+	if (err)
+		std::rethrow_exception(err);
+}
+
+/**
+ *  @breif  Read the target of a symlink.
+ *  @return The target, as stored in the link.
+ */
+[[nodiscard]]
+std::string read_symlink(const std::string& path)
+{
+	std::string buf(256, '\0');
+
+	for (;;) {
+		const auto len = ::readlink(path.c_str(), &buf[0], buf.size());
+		if (len == -1)
+			throw fs_error::get("readlink()");
+		if (static_cast<std::size_t>(len) < buf.size()) {
+			buf.resize(static_cast<std::size_t>(len));
+			return buf;
+		}
+		buf.resize(buf.size() * 2);
+	}
+}
+
+/**
+ *  @breif  Collapse ".", ".." and repeated separators without touching
+ *  the filesystem.
+ *  @return The normalized path.
+ *  @type   Private function (intended)
+ */
+[[nodiscard]]
+std::string lexically_normal(const std::string& path)
+{
+	const bool absolute = !path.empty() && path[0] == '/';
+	std::vector<std::string> parts;
+	std::size_t pos = 0;
+
+	while (pos <= path.size()) {
+		auto next = path.find('/', pos);
+		if (next == std::string::npos)
+			next = path.size();
+		const auto part = path.substr(pos, next - pos);
+		pos = next + 1;
+
+		if (part.empty() || part == ".")
+			continue;
+		if (part == ".." && !parts.empty() && parts.back() != "..")
+			parts.pop_back();
+		else if (part != ".." || !absolute)
+			parts.push_back(part);
+	}
+
+	std::string out = absolute ? "/" : "";
+	for (std::size_t i = 0; i < parts.size(); ++i)
+		out += (i ? "/" : "") + parts[i];
+	return out.empty() ? "." : out;
+}
+
+/**
+ *  @breif  Resolve a path to an absolute one without symlinks, "." or
+ *  "..". Every component must exist.
+ *  @return The canonical path.
+ *
+ *  On Linux the whole walk is one openat2() call with an O_PATH
+ *  descriptor, whose name is then read back from /proc. Magic links
+ *  (/proc/<pid>/fd/...) are refused. Falls back to realpath() where
+ *  openat2() or /proc is not available.
+ */
+[[nodiscard]]
+std::string canonical(const std::string& path)
+{
+#if defined(__linux__) && defined(SYS_openat2)
+	struct open_how how = {};
+	how.flags = O_PATH | O_CLOEXEC;
+	how.resolve = RESOLVE_NO_MAGICLINKS;
+
+	const auto fd = static_cast<int>(::syscall(SYS_openat2, AT_FDCWD, path.c_str(),
+						   &how, sizeof(how)));
+	if (fd != -1) {
+		std::string out;
+		try {
+			out = read_symlink("/proc/self/fd/" + std::to_string(fd));
+		} catch (const std::system_error&) {
+		}
+		::close(fd);
+		if (!out.empty() && out[0] == '/')
+			return out;
+	} else if (errno != ENOSYS && errno != EPERM) {
+		throw fs_error::get("openat2()");
+	}
+#endif
+
+	std::unique_ptr<char, decltype(&std::free)> res(::realpath(path.c_str(), nullptr),
+							&std::free);
+	if (!res)
+		throw fs_error::get("realpath()");
+	return res.get();
+}
+
+/**
+ *  @breif  Like canonical(), but the trailing components that do not
+ *  exist yet are kept and normalized lexically.
+ *  @return The resolved path.
+ *
+ *  The longest existing prefix is resolved by the kernel as written,
+ *  so a ".." after a symlink goes up from the link's target. Only the
+ *  part that does not exist is normalized lexically.
+ */
+[[nodiscard]]
+std::string weakly_canonical(const std::string& path)
+{
+	auto head = path.empty() ? std::string(".") : path;
+	std::string tail;
+
+	for (;;) {
+		try {
+			const auto base = canonical(head);
+			if (tail.empty())
+				return base;
+			return lexically_normal(base + "/" + tail);
+		} catch (const std::system_error& e) {
+			if ((e.code().value() != ENOENT && e.code().value() != ENOTDIR) ||
+			    head == "." || head == "/")
+				throw;
+		}
+
+		while (head.size() > 1 && head.back() == '/')
+			head.pop_back();
+		const auto pos = head.rfind('/');
+		if (pos == std::string::npos) {
+			// Nothing of it exists, resolve from the working directory.
+			tail = tail.empty() ? head : head + "/" + tail;
+			head = ".";
+		} else {
+			const auto leaf = head.substr(pos + 1);
+			tail = tail.empty() ? leaf : leaf + "/" + tail;
+			head = pos == 0 ? "/" : head.substr(0, pos);
+		}
+	}
+}
+
+/**
+ *  @breif  canonical() with a cache of resolved directories.
+ *
+ *  Paths are walked one component at a time the way the kernel does
+ *  it: a ".." goes up from wherever the components before it led,
+ *  symlinks included. Every directory reached on the way is cached
+ *  under the name it was reached by, so paths under the same
+ *  directories (a plugin tree behind a chain of symlinks, say) only
+ *  cost a lookup per directory and an lstat() of the last component.
+ *  Symlinks are followed through the cache again. The cache holds up
+ *  to max_entries directories and is thread safe. It is never
+ *  invalidated on its own; call clear() after changing links it may
+ *  have seen.
+ */
+class path_resolver {
+public:
+	explicit path_resolver(std::size_t max_entries = 4096)
+		: max_entries_(max_entries)
+	{}
+
+	/**
+	 *  @breif  Resolve a path like canonical().
+	 *  @return The canonical path.
+	 */
+	[[nodiscard]]
+	std::string canonical(const std::string& path)
+	{
+		if (path.empty())
+			throw fs_error::get(ENOENT, "path_resolver");
+
+		int links = 0;
+		return walk(path[0] == '/' ? std::string("/") : cwd(), path, links);
+	}
+
+	/**
+	 *  @breif  Drop every cached directory.
+	 *  @return None.
+	 */
+	void clear()
+	{
+		std::lock_guard<std::mutex> lk(mtx_);
+		dirs_.clear();
+	}
+
+	/**
+	 *  @breif  Number of directory lookups served from the cache.
+	 */
+	[[nodiscard]]
+	std::uint64_t hits() const noexcept
+	{ return hits_.load(std::memory_order_relaxed); }
+
+	/**
+	 *  @breif  Number of directory lookups that went to the filesystem.
+	 */
+	[[nodiscard]]
+	std::uint64_t misses() const noexcept
+	{ return misses_.load(std::memory_order_relaxed); }
+
+private:
+	static std::string cwd()
+	{
+		std::string buf(256, '\0');
+
+		while (::getcwd(&buf[0], buf.size()) == nullptr) {
+			if (errno != ERANGE)
+				throw fs_error::get("getcwd()");
+			buf.resize(buf.size() * 2);
+		}
+		buf.resize(std::strlen(buf.c_str()));
+		return buf;
+	}
+
+	// Walk path from the canonical directory base. Every component
+	// but a last one without a trailing slash must be a directory.
+	std::string walk(std::string base, const std::string& path, int& links)
+	{
+		if (!path.empty() && path[0] == '/')
+			base = "/";
+
+		for (std::size_t pos = 0; pos < path.size(); ) {
+			auto next = path.find('/', pos);
+			if (next == std::string::npos)
+				next = path.size();
+			const auto name = path.substr(pos, next - pos);
+			const bool last = next == path.size();
+			pos = next + 1;
+
+			if (name.empty() || name == ".")
+				continue;
+			if (name == "..") {
+				// base has no symlinks left, so its parent is lexical.
+				const auto up = base.rfind('/');
+				base = up == 0 ? "/" : base.substr(0, up);
+				continue;
+			}
+
+			const auto full = base == "/" ? "/" + name : base + "/" + name;
+			if (!last && lookup(full, base))
+				continue;
+
+			struct stat st;
+			if (::lstat(full.c_str(), &st) == -1)
+				throw fs_error::get("lstat()");
+
+			if (S_ISLNK(st.st_mode)) {
+				if (++links > 40)
+					throw fs_error::get(ELOOP, "path_resolver: " + path);
+				auto res = walk(base, read_symlink(full), links);
+				if (!last) {
+					if (::stat(res.c_str(), &st) == -1)
+						throw fs_error::get("stat()");
+					if (!S_ISDIR(st.st_mode))
+						throw fs_error::get(ENOTDIR, "path_resolver: " + path);
+					store(full, res);
+				}
+				base = std::move(res);
+				continue;
+			}
+
+			if (!last) {
+				if (!S_ISDIR(st.st_mode))
+					throw fs_error::get(ENOTDIR, "path_resolver: " + path);
+				store(full, full);
+			}
+			base = full;
+		}
+
+		return base;
+	}
+
+	bool lookup(const std::string& name, std::string& dir)
+	{
+		std::lock_guard<std::mutex> lk(mtx_);
+		auto it = dirs_.find(name);
+		if (it == dirs_.end()) {
+			misses_.fetch_add(1, std::memory_order_relaxed);
+			return false;
+		}
+
+		hits_.fetch_add(1, std::memory_order_relaxed);
+		dir = it->second;
+		return true;
+	}
+
+	void store(const std::string& name, const std::string& dir)
+	{
+		std::lock_guard<std::mutex> lk(mtx_);
+		if (dirs_.size() >= max_entries_)
+			dirs_.clear();
+		dirs_.emplace(name, dir);
+	}
+
+	std::size_t max_entries_;
+	std::mutex mtx_;
+	std::unordered_map<std::string, std::string> dirs_;
+	std::atomic<std::uint64_t> hits_ { 0 };
+	std::atomic<std::uint64_t> misses_ { 0 };
+};
+
+#ifdef __linux__
+/**
+ *  @breif  Punch holes over the all-zero blocks of an existing file.
+ *  @return The disk space given back, in bytes.
+ *
+ *  The file is scanned in parallel chunks, skipping regions that are
+ *  already holes. Runs of whole filesystem blocks that are all zero are
+ *  deallocated with FALLOC_FL_PUNCH_HOLE; the file size and contents
+ *  stay the same. Nothing else should write to the file meanwhile.
+ */
+std::uintmax_t sparsify(const std::string& path, unsigned threads = 0)
+{
+	auto fd = open_file(path, fs_omode::read_write | fs_omode::close_exec);
+
+	struct stat st;
+
+	if (::fstat(fd, &st) == -1) {
+		const auto err = fs_error::get("fstat()");
+		::close(fd);
+		throw err;
+	}
+
+	const auto bs = static_cast<std::size_t>(st.st_blksize);
+	const auto chunk = static_cast<off_t>(std::max<std::size_t>(bs, (8 << 20) / bs * bs));
+	const auto nchunks = static_cast<std::size_t>((st.st_size + chunk - 1) / chunk);
+
+	if (threads == 0)
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	threads = static_cast<unsigned>(std::min<std::size_t>(threads, nchunks));
+
+	std::atomic<std::size_t> next { 0 };
+	std::mutex err_mtx;
+	std::exception_ptr err;
+
+	auto run = [&]
+	{
+		try {
+			std::unique_ptr<char[]> buf(new char[static_cast<std::size_t>(chunk)]);
+
+			for (auto i = next++; i < nchunks; i = next++) {
+				const auto start = static_cast<off_t>(i) * chunk;
+				const auto data = ::lseek(fd, start, SEEK_DATA);
+				if (data == -1 || data >= start + chunk)
+					continue;
+
+				const auto got = pread_all(fd, buf.get(), static_cast<std::size_t>(chunk), start);
+				const auto full = got / bs * bs;
+
+				std::size_t zero_at = 0, zeros = 0;
+				for (std::size_t pos = 0; pos <= full; pos += bs) {
+					if (pos < full && is_zero(buf.get() + pos, bs)) {
+						if (zeros == 0)
+							zero_at = pos;
+						zeros += bs;
+						continue;
+					}
+					if (zeros > 0 && ::fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+								     start + static_cast<off_t>(zero_at),
+								     static_cast<off_t>(zeros)) == -1)
+						throw fs_error::get("fallocate()");
+					zeros = 0;
+				}
+			}
+		} catch (...) {
+			std::lock_guard<std::mutex> lk(err_mtx);
+			if (!err)
+				err = std::current_exception();
+			next = nchunks;
+		}
+	};
+
+	std::vector<std::thread> pool;
+	for (unsigned t = 1; t < threads; ++t)
+		pool.push_back(scoped_thread(run));
+	run();
+	for (auto& t : pool)
+		t.join();
+
+	struct stat after;
+	const auto ret = ::fstat(fd, &after);
+	::close(fd);
+	if (err)
+		std::rethrow_exception(err);
+	if (ret == -1)
+		throw fs_error::get("fstat()");
+
+	return after.st_blocks < st.st_blocks ?
+		static_cast<std::uintmax_t>(st.st_blocks - after.st_blocks) * 512 : 0;
+}
+#endif
+
+#ifdef __linux__
+/**
+ *  @breif  One range of a file as reported by extent_map().
+ */
+struct extent {
+	std::uint64_t logical = 0;
+	std::uint64_t physical = 0;
+	std::uint64_t length = 0;
+	bool hole = false;
+	bool shared = false;
+	bool unwritten = false;
+	bool delalloc = false;
+	bool encoded = false;
+};
+
+/**
+ *  @breif  Map the logical ranges of an opened file to disk.
+ *  @return The extents in file order, holes included as entries with
+ *  hole set and no physical address.
+ *
+ *  Dirty data is flushed first so delayed allocations show up with
+ *  their real placement. Throws EOPNOTSUPP on filesystems without
+ *  FIEMAP.
+ */
+[[nodiscard]]
+std::vector<extent> extent_map(int fd)
+{
+	constexpr std::size_t batch = 256;
+	const auto size = static_cast<std::uint64_t>(file_size(fd));
+
+	std::vector<char> buf(sizeof(struct fiemap) + batch * sizeof(struct fiemap_extent));
+	auto fm = reinterpret_cast<struct fiemap*>(buf.data());
+	std::vector<extent> out;
+	std::uint64_t pos = 0;
+	bool last = false;
+
+	while (!last && pos < size) {
+		std::memset(buf.data(), 0, buf.size());
+		fm->fm_start = pos;
+		fm->fm_length = FIEMAP_MAX_OFFSET - pos;
+		fm->fm_flags = FIEMAP_FLAG_SYNC;
+		fm->fm_extent_count = batch;
+
+		if (::ioctl(fd, FS_IOC_FIEMAP, fm) == -1)
+			throw fs_error::get(errno == ENOTTY ? EOPNOTSUPP : errno, "ioctl(FS_IOC_FIEMAP)");
+		if (fm->fm_mapped_extents == 0)
+			break;
+
+		for (std::uint32_t i = 0; i < fm->fm_mapped_extents; ++i) {
+			const auto& fe = fm->fm_extents[i];
+
+			if (fe.fe_logical > pos) {
+				extent h;
+				h.logical = pos;
+				h.length = fe.fe_logical - pos;
+				h.hole = true;
+				out.push_back(h);
+			}
+
+			extent e;
+			e.logical = fe.fe_logical;
+			e.physical = fe.fe_physical;
+			e.length = fe.fe_length;
+			e.shared = fe.fe_flags & FIEMAP_EXTENT_SHARED;
+			e.unwritten = fe.fe_flags & FIEMAP_EXTENT_UNWRITTEN;
+			e.delalloc = fe.fe_flags & FIEMAP_EXTENT_DELALLOC;
+			e.encoded = fe.fe_flags & (FIEMAP_EXTENT_ENCODED | FIEMAP_EXTENT_DATA_ENCRYPTED);
+			out.push_back(e);
+
+			pos = std::max<std::uint64_t>(pos, fe.fe_logical + fe.fe_length);
+			last = fe.fe_flags & FIEMAP_EXTENT_LAST;
+		}
+	}
+
+	if (pos < size) {
+		extent h;
+		h.logical = pos;
+		h.length = size - pos;
+		h.hole = true;
+		out.push_back(h);
+	}
+
+	return out;
+}
+
+/**
+ *  @breif  Fragmentation summary of a file or a directory tree.
+ *
+ *  A fragment is a run of physically contiguous data extents; the
+ *  ideal count is one per ideal_fragment bytes (at least one per non
+ *  empty file). score is 0 for a perfectly laid out file and goes
+ *  towards 1 as fragments outnumber the ideal.
+ */
+struct fragmentation_report {
+	std::uint64_t files = 0;
+	std::uint64_t bytes = 0;
+	std::uint64_t extents = 0;
+	std::uint64_t fragments = 0;
+	std::uint64_t ideal = 0;
+
+	[[nodiscard]]
+	double score() const noexcept
+	{
+		return fragments <= ideal ? 0.0 :
+			static_cast<double>(fragments - ideal) / static_cast<double>(fragments);
+	}
+};
+
+/**
+ *  @breif  Measure how fragmented an opened file is.
+ *  @return The report for this single file.
+ */
+[[nodiscard]]
+fragmentation_report fragmentation(int fd, std::uint64_t ideal_fragment = 128 << 20)
+{
+	fragmentation_report r;
+	std::uint64_t next = 0;
+
+	r.files = 1;
+	for (const auto& e : extent_map(fd)) {
+		if (e.hole)
+			continue;
+		++r.extents;
+		r.bytes += e.length;
+		if (r.fragments == 0 || e.physical != next)
+			++r.fragments;
+		next = e.physical + e.length;
+	}
+	if (r.bytes > 0)
+		r.ideal = std::max<std::uint64_t>(1, (r.bytes + ideal_fragment - 1) / ideal_fragment);
+
+	return r;
+}
+
+/**
+ *  @breif  Measure a file, or every regular file under a directory.
+ *  @return The summed report. Files on filesystems without FIEMAP are
+ *  skipped.
+ */
+[[nodiscard]]
+fragmentation_report fragmentation(const std::string& path,
+				   std::uint64_t ideal_fragment = 128 << 20)
+{
+	fragmentation_report total;
+	struct stat st;
+
+	if (::lstat(path.c_str(), &st) == -1)
+		throw fs_error::get("lstat()");
+
+	if (S_ISDIR(st.st_mode)) {
+		auto dp = ::opendir(path.c_str());
+		if (dp == nullptr)
+			throw fs_error::get("opendir()");
+		std::vector<std::string> names;
+		while (auto ent = ::readdir(dp)) {
+			if (std::strcmp(ent->d_name, ".") != 0 && std::strcmp(ent->d_name, "..") != 0)
+				names.push_back(ent->d_name);
+		}
+		::closedir(dp);
+
+		for (const auto& name : names) {
+			const auto r = fragmentation(path + "/" + name, ideal_fragment);
+			total.files += r.files;
+			total.bytes += r.bytes;
+			total.extents += r.extents;
+			total.fragments += r.fragments;
+			total.ideal += r.ideal;
+		}
+		return total;
+	}
+
+	if (!S_ISREG(st.st_mode))
+		return total;
+
+	auto fd = open_file(path, fs_omode::readonly | fs_omode::close_exec);
+	try {
+		total = fragmentation(fd, ideal_fragment);
+	} catch (const std::system_error& e) {
+		if (e.code().value() != EOPNOTSUPP) {
+			::close(fd);
+			throw;
+		}
+	}
+	::close(fd);
+
+	return total;
+}
+
+/**
+ *  @breif  Rewrite a fragmented file into freshly preallocated space.
+ *  @return True if the file was replaced, false if the copy was not
+ *  laid out better than the original.
+ *
+ *  The copy is made next to the file, preallocated in one piece so the
+ *  allocator can pick contiguous space, filled with plain reads and
+ *  writes (a reflink would keep the old extents), synced and swapped
+ *  in with RENAME_EXCHANGE, so readers see either the old or the new
+ *  file. Holes are kept. The swap is skipped if the file changed size
+ *  or mtime during the copy.
+ */
+bool defragment(const std::string& path)
+{
+	auto rfd = open_file(path, fs_omode::readonly | fs_omode::close_exec);
+
+	struct stat st;
+	if (::fstat(rfd, &st) == -1) {
+		const auto err = fs_error::get("fstat()");
+		::close(rfd);
+		throw err;
+	}
+
+	std::string tmp = path + ".defrag.XXXXXX";
+	auto wfd = ::mkostemp(&tmp[0], O_CLOEXEC);
+	if (wfd == -1) {
+		const auto err = fs_error::get("mkostemp()");
+		::close(rfd);
+		throw err;
+	}
+
+	bool swapped = false;
+	try {
+		if (st.st_size > 0 && ::fallocate(wfd, 0, 0, st.st_size) == -1)
+			throw fs_error::get("fallocate()");
+
+		std::unique_ptr<char[]> buf(new char[4 << 20]);
+		for (const auto& e : extent_map(rfd)) {
+			if (e.hole) {
+				::fallocate(wfd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+					    static_cast<off_t>(e.logical), static_cast<off_t>(e.length));
+				continue;
+			}
+			for (std::uint64_t done = 0; done < e.length; ) {
+				const auto off = static_cast<off_t>(e.logical + done);
+				const auto want = static_cast<std::size_t>(
+					std::min<std::uint64_t>(e.length - done, 4 << 20));
+				const auto got = pread_all(rfd, buf.get(), want, off);
+				if (got == 0)
+					break;
+				pwrite_all(wfd, buf.get(), got, off);
+				done += got;
+			}
+		}
+
+		// The last extent may run past EOF to the block boundary.
+		if (::ftruncate(wfd, st.st_size) == -1)
+			throw fs_error::get("ftruncate()");
+		copy_metadata(rfd, wfd, st);
+		if (::fsync(wfd) == -1)
+			throw fs_error::get("fsync()");
+
+		struct stat now;
+		if (::fstat(rfd, &now) == -1)
+			throw fs_error::get("fstat()");
+		const bool changed = now.st_size != st.st_size ||
+			now.st_mtim.tv_sec != st.st_mtim.tv_sec ||
+			now.st_mtim.tv_nsec != st.st_mtim.tv_nsec;
+
+		if (!changed && fragmentation(wfd).fragments < fragmentation(rfd).fragments) {
+			if (::renameat2(AT_FDCWD, tmp.c_str(), AT_FDCWD, path.c_str(),
+					RENAME_EXCHANGE) == -1)
+				throw fs_error::get("renameat2()");
+			swapped = true;
+			sync_parent(path);
+		}
+	} catch (...) {
+		::close(rfd);
+		::close(wfd);
+		::unlink(tmp.c_str());
+		throw;
+	}
+
+	// After the exchange tmp names the old, fragmented file.
+	::close(rfd);
+	::close(wfd);
+	::unlink(tmp.c_str());
+
+	return swapped;
+}
+#endif
+
+#ifdef __linux__
+/**
+ *  @breif  Size and I/O geometry of a block device.
+ */
+struct block_geometry {
+	std::uint64_t size = 0;
+	unsigned logical_sector = 512;
+	unsigned physical_sector = 512;
+	unsigned io_min = 0;
+	unsigned io_opt = 0;
+};
+
+/**
+ *  @breif  Query the geometry of an opened block device.
+ *  @return The geometry.
+ */
+[[nodiscard]]
+block_geometry block_device_info(int fd)
+{
+	block_geometry g;
+	int lss = 0;
+	unsigned int pbs = 0, min = 0, opt = 0;
+
+	if (::ioctl(fd, BLKGETSIZE64, &g.size) == -1)
+		throw fs_error::get("ioctl(BLKGETSIZE64)");
+	if (::ioctl(fd, BLKSSZGET, &lss) == -1)
+		throw fs_error::get("ioctl(BLKSSZGET)");
+	if (::ioctl(fd, BLKPBSZGET, &pbs) == -1)
+		throw fs_error::get("ioctl(BLKPBSZGET)");
+	::ioctl(fd, BLKIOMIN, &min);
+	::ioctl(fd, BLKIOOPT, &opt);
+
+	g.logical_sector = static_cast<unsigned>(lss);
+	g.physical_sector = pbs;
+	g.io_min = min;
+	g.io_opt = opt;
+
+	return g;
+}
+
+/**
+ *  @breif  Tell the device a byte range is no longer used (TRIM).
+ *  @return None.
+ *
+ *  The range must be aligned to the logical sector size. What reads
+ *  return afterwards depends on the device.
+ */
+void discard_range(int fd, std::uint64_t off, std::uint64_t len)
+{
+	std::uint64_t range[2] = { off, len };
+
+	if (::ioctl(fd, BLKDISCARD, range) == -1)
+		throw fs_error::get("ioctl(BLKDISCARD)");
+}
+
+/**
+ *  @breif  Zero a byte range of a block device, offloaded to the
+ *  device where it can do that (WRITE ZEROES).
+ *  @return None.
+ */
+void zero_range(int fd, std::uint64_t off, std::uint64_t len)
+{
+	std::uint64_t range[2] = { off, len };
+
+	if (::ioctl(fd, BLKZEROOUT, range) == -1)
+		throw fs_error::get("ioctl(BLKZEROOUT)");
+}
+
+/**
+ *  @breif  Buffer aligned for O_DIRECT transfers.
+ *  @type   Private function (intended)
+ */
+struct aligned_buffer {
+	explicit aligned_buffer(std::size_t n, std::size_t align)
+	{
+		if (::posix_memalign(&ptr, align, n) != 0)
+			throw fs_error::get(ENOMEM, "posix_memalign()");
+	}
+
+	aligned_buffer(const aligned_buffer&) = delete;
+	aligned_buffer& operator=(const aligned_buffer&) = delete;
+
+	~aligned_buffer()
+	{ std::free(ptr); }
+
+	char* data() const noexcept
+	{ return static_cast<char*>(ptr); }
+
+	void* ptr = nullptr;
+};
+
+/**
+ *  @breif  Alignment O_DIRECT needs on an opened file or device.
+ *  @return The alignment in bytes, at least the page size.
+ *  @type   Private function (intended)
+ */
+[[nodiscard]]
+std::size_t direct_alignment(int fd)
+{
+	struct stat st;
+
+	if (::fstat(fd, &st) == -1)
+		throw fs_error::get("fstat()");
+
+	std::size_t align = S_ISBLK(st.st_mode) ?
+		block_device_info(fd).logical_sector : static_cast<std::size_t>(st.st_blksize);
+	return std::max<std::size_t>(align, static_cast<std::size_t>(::sysconf(_SC_PAGESIZE)));
+}
+
+/**
+ *  @breif  Stream a file or block device through O_DIRECT with several
+ *  reads in flight.
+ *  @return The number of bytes delivered.
+ *
+ *  Reads of chunk bytes are kept depth deep in an io_uring (one at a
+ *  time with pread() where io_uring is not available) and handed to
+ *  sink(data, size, offset) in offset order, bypassing the page cache.
+ *  off must be a multiple of the sector size and of the page size;
+ *  len 0 reads to the end.
+ */
+std::uint64_t read_direct(const std::string& path,
+			  const std::function<void(const char*, std::size_t, std::uint64_t)>& sink,
+			  std::uint64_t off = 0, std::uint64_t len = 0,
+			  std::size_t chunk = 1 << 20, unsigned depth = 8)
+{
+	io_probe probe;
+	auto fd = open_file(path, fs_omode::readonly | fs_omode::direct | fs_omode::close_exec);
+
+	try {
+		const auto align = direct_alignment(fd);
+		const auto size = static_cast<std::uint64_t>(file_size(fd));
+		if (off % align != 0)
+			throw fs_error::get(EINVAL, "read_direct: unaligned offset");
+
+		chunk = std::max(align, chunk / align * align);
+		const auto end = len == 0 || off + len > size ? size : off + len;
+		depth = std::max(1u, depth);
+
+		struct slot {
+			std::unique_ptr<aligned_buffer> buf;
+			std::uint64_t off = 0;
+			std::size_t want = 0;
+			long res = -1;
+		};
+		// Declared before the ring, so the buffers outlive it.
+		std::vector<slot> slots;
+
+		// Older kernels have io_uring but not every opcode.
+		std::unique_ptr<uring> ring;
+		try {
+			ring.reset(new uring(depth));
+			if (!ring->supports(IORING_OP_READ))
+				ring.reset();
+		} catch (const std::system_error&) {
+		}
+		if (!ring)
+			depth = 1;
+
+		slots.resize(depth);
+		for (auto& s : slots)
+			s.buf.reset(new aligned_buffer(chunk, align));
+
+		std::uint64_t next = off, done = 0;
+		std::size_t head = 0, inflight = 0;
+		unsigned pending = 0;
+
+		// Slots are reused in a ring, so completions map back to
+		// submission order and the sink sees the stream in order.
+		auto issue = [&](std::size_t i)
+		{
+			auto& s = slots[i];
+			s.off = next;
+			s.want = static_cast<std::size_t>(std::min<std::uint64_t>(chunk, end - next));
+			s.res = -1;
+			next += s.want;
+			++inflight;
+
+			const auto aligned = (s.want + align - 1) / align * align;
+			if (!ring) {
+				s.res = ::pread(fd, s.buf->data(), aligned, static_cast<off_t>(s.off));
+				probe.read(s.res);
+				if (s.res == -1)
+					throw fs_error::get("pread()");
+				return;
+			}
+			auto sqe = ring->get_sqe();
+			sqe->opcode = IORING_OP_READ;
+			sqe->fd = fd;
+			sqe->addr = reinterpret_cast<std::uintptr_t>(s.buf->data());
+			sqe->len = static_cast<std::uint32_t>(aligned);
+			sqe->off = s.off;
+			sqe->user_data = i;
+			++pending;
+		};
+
+		try {
+			for (std::size_t i = 0; i < depth && next < end; ++i)
+				issue(i);
+
+			while (inflight > 0) {
+				if (ring && slots[head].res == -1) {
+					ring->submit(1);
+					struct io_uring_cqe cqe;
+					while (ring->pop(cqe)) {
+						--pending;
+						probe.read(cqe.res);
+						if (cqe.res < 0)
+							throw fs_error::get(-cqe.res, "read_direct()");
+						slots[cqe.user_data].res = cqe.res;
+					}
+					continue;
+				}
+
+				auto& s = slots[head];
+				const auto got = std::min(static_cast<std::size_t>(s.res), s.want);
+				if (got < s.want)
+					throw fs_error::get(EIO, "read_direct: short read");
+				sink(s.buf->data(), got, s.off);
+				done += got;
+				--inflight;
+
+				if (next < end)
+					issue(head);
+				head = (head + 1) % depth;
+			}
+		} catch (...) {
+			// The kernel may still be reading into the buffers.
+			if (ring)
+				ring->drain(pending);
+			throw;
+		}
+
+		::close(fd);
+		return done;
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+}
+
+/**
+ *  @breif  Write a stream to a file or block device through O_DIRECT
+ *  with several writes in flight.
+ *  @return The number of bytes written.
+ *
+ *  source(buf, capacity) fills a buffer and returns how much it put
+ *  in; a short fill ends the stream. Full buffers go out depth deep
+ *  through io_uring; a tail that is not a whole sector is written
+ *  without O_DIRECT. The data is flushed with fdatasync() at the end.
+ */
+std::uint64_t write_direct(const std::string& path,
+			   const std::function<std::size_t(char*, std::size_t)>& source,
+			   std::uint64_t off = 0, std::size_t chunk = 1 << 20, unsigned depth = 8)
+{
+	io_probe probe;
+	auto fd = open_file(path, fs_omode::writeonly | fs_omode::create | fs_omode::direct |
+			    fs_omode::close_exec,
+			    fs_perms::owner_read | fs_perms::owner_write |
+			    fs_perms::group_read | fs_perms::others_read);
+
+	try {
+		const auto align = direct_alignment(fd);
+		if (off % align != 0)
+			throw fs_error::get(EINVAL, "write_direct: unaligned offset");
+
+		chunk = std::max(align, chunk / align * align);
+		depth = std::max(1u, depth);
+
+		// Declared before the ring, so the buffers outlive it.
+		std::vector<std::unique_ptr<aligned_buffer>> bufs;
+
+		// Older kernels have io_uring but not every opcode.
+		std::unique_ptr<uring> ring;
+		try {
+			ring.reset(new uring(depth));
+			if (!ring->supports(IORING_OP_WRITE))
+				ring.reset();
+		} catch (const std::system_error&) {
+		}
+		if (!ring)
+			depth = 1;
+
+		std::vector<std::size_t> free_slots;
+		for (unsigned i = 0; i < depth; ++i) {
+			bufs.emplace_back(new aligned_buffer(chunk, align));
+			free_slots.push_back(i);
+		}
+		std::vector<std::size_t> lens(depth);
+
+		std::uint64_t pos = off, done = 0;
+		std::size_t inflight = 0, tail = 0, tail_slot = 0, tail_at = 0;
+		bool eof = false;
+
+		try {
+			while (!eof || inflight > 0) {
+				while (!eof && !free_slots.empty()) {
+					const auto i = free_slots.back();
+					auto n = source(bufs[i]->data(), chunk);
+					if (n < chunk)
+						eof = true;
+
+					// The unaligned tail goes out last, through the page cache.
+					tail = n % align;
+					tail_slot = i;
+					tail_at = n -= tail;
+					if (n == 0)
+						break;
+
+					free_slots.pop_back();
+					lens[i] = n;
+					if (!ring) {
+						pwrite_all(fd, bufs[i]->data(), n, static_cast<off_t>(pos));
+						free_slots.push_back(i);
+						done += n;
+					} else {
+						auto sqe = ring->get_sqe();
+						sqe->opcode = IORING_OP_WRITE;
+						sqe->fd = fd;
+						sqe->addr = reinterpret_cast<std::uintptr_t>(bufs[i]->data());
+						sqe->len = static_cast<std::uint32_t>(n);
+						sqe->off = pos;
+						sqe->user_data = i;
+						++inflight;
+					}
+					pos += n;
+				}
+
+				if (inflight == 0)
+					continue;
+
+				ring->submit(1);
+				struct io_uring_cqe cqe;
+				while (ring->pop(cqe)) {
+					--inflight;
+					probe.write(cqe.res);
+					if (cqe.res < 0)
+						throw fs_error::get(-cqe.res, "write_direct()");
+					if (static_cast<std::size_t>(cqe.res) != lens[cqe.user_data])
+						throw fs_error::get(EIO, "write_direct: short write");
+					done += static_cast<std::uint64_t>(cqe.res);
+					free_slots.push_back(static_cast<std::size_t>(cqe.user_data));
+				}
+			}
+		} catch (...) {
+			// The kernel may still be reading from the buffers.
+			if (ring)
+				ring->drain(static_cast<unsigned>(inflight));
+			throw;
+		}
+
+		if (tail > 0) {
+			const auto flags = ::fcntl(fd, F_GETFL);
+			if (flags == -1 || ::fcntl(fd, F_SETFL, flags & ~fs_omode::direct) == -1)
+				throw fs_error::get("fcntl()");
+			pwrite_all(fd, bufs[tail_slot]->data() + tail_at, tail,
+				   static_cast<off_t>(pos));
+			done += tail;
+		}
+
+		if (::fdatasync(fd) == -1)
+			throw fs_error::get("fdatasync()");
+		::close(fd);
+		return done;
+	} catch (...) {
+		::close(fd);
+		throw;
+	}
+}
+#endif
+
+#ifdef __linux__
+/**
+ *  @breif  Read at an offset only as far as the page cache goes.
+ *  @return The size of the data it read in bytes, stopping early at
+ *  the first byte that would need a disk read or at EOF.
+ *
+ *  Built on preadv2(RWF_NOWAIT). Kernels or filesystems without it
+ *  count as a miss right away. would_block is set when the read
+ *  stopped for a miss rather than EOF.
+ */
+std::size_t pread_nowait(int fd, void* ptr, std::size_t nbytes, off_t offset,
+			 bool& would_block)
+{
+	auto p = static_cast<char*>(ptr);
+	std::size_t done = 0;
+	io_probe probe;
+
+	would_block = false;
+	while (done < nbytes) {
+		struct iovec iov = { p + done, nbytes - done };
+		auto sz = ::preadv2(fd, &iov, 1, offset + static_cast<off_t>(done), RWF_NOWAIT);
+		probe.read(sz);
+		if (sz == -1) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EOPNOTSUPP || errno == ENOSYS) {
+				would_block = true;
+				break;
+			}
+			throw fs_error::get("preadv2()");
+		}
+		if (sz == 0)
+			break;
+		done += static_cast<std::size_t>(sz);
+	}
+
+	return done;
+}
+
+/**
+ *  @breif  Reads for event loops: served inline when the data is in
+ *  the page cache, handed to a pool of blocking threads when not.
+ *
+ *  Each read first tries preadv2(RWF_NOWAIT) on the calling thread.
+ *  When all of it comes from the cache (or EOF is hit) the callback
+ *  runs right there and read() returns true. Otherwise the rest of
+ *  the read is queued for the pool, read() returns false and the
+ *  callback runs later on a pool thread, under the io_scope of the
+ *  caller. The callback gets the total bytes read and an errno value
+ *  (0 on success). Buffers and descriptors must stay valid until then.
+ */
+class nowait_reader {
+public:
+	using callback = std::function<void(std::size_t, int)>;
+
+	explicit nowait_reader(unsigned threads = 4)
+	{
+		for (unsigned i = 0; i < std::max(1u, threads); ++i)
+			pool_.emplace_back([this] { work(); });
+	}
+
+	nowait_reader(const nowait_reader&) = delete;
+	nowait_reader& operator=(const nowait_reader&) = delete;
+
+	/**
+	 *  @breif  Drains the queued reads, then stops the pool.
+	 */
+	~nowait_reader()
+	{
+		{
+			std::lock_guard<std::mutex> lk(mtx_);
+			stop_ = true;
+		}
+		cv_.notify_all();
+		for (auto& t : pool_)
+			t.join();
+	}
+
+	/**
+	 *  @breif  Read data at an offset, inline if it is cached.
+	 *  @return True if the callback already ran, false if it was
+	 *  deferred to the pool.
+	 */
+	template <typename T>
+	bool read_object(int fd, T* ptr, std::size_t nbytes, std::uint64_t off, callback done)
+	{
+		bool would_block;
+		std::size_t got;
+
+		try {
+			got = pread_nowait(fd, ptr, nbytes, static_cast<off_t>(off), would_block);
+		} catch (const std::system_error& e) {
+			misses_.fetch_add(1, std::memory_order_relaxed);
+			done(0, e.code().value());
+			return true;
+		}
+
+		if (!would_block) {
+			hits_.fetch_add(1, std::memory_order_relaxed);
+			done(got, 0);
+			return true;
+		}
+
+		misses_.fetch_add(1, std::memory_order_relaxed);
+		task t;
+		t.fd = fd;
+		t.ptr = reinterpret_cast<char*>(ptr);
+		t.nbytes = nbytes;
+		t.got = got;
+		t.off = off;
+		t.done = std::move(done);
+		t.account = io_scope::current();
+		{
+			std::lock_guard<std::mutex> lk(mtx_);
+			queue_.push_back(std::move(t));
+		}
+		cv_.notify_one();
+
+		return false;
+	}
+
+	/**
+	 *  @breif  Number of reads served fully from the page cache.
+	 */
+	[[nodiscard]]
+	std::uint64_t hits() const noexcept
+	{ return hits_.load(std::memory_order_relaxed); }
+
+	/**
+	 *  @breif  Number of reads that had to go to the pool.
+	 */
+	[[nodiscard]]
+	std::uint64_t misses() const noexcept
+	{ return misses_.load(std::memory_order_relaxed); }
+
+	/**
+	 *  @breif  Reads queued or running in the pool.
+	 */
+	[[nodiscard]]
+	std::size_t pending() const
+	{
+		std::lock_guard<std::mutex> lk(mtx_);
+		return queue_.size() + running_;
+	}
+
+private:
+	struct task {
+		int fd;
+		char* ptr;
+		std::size_t nbytes;
+		std::size_t got;
+		std::uint64_t off;
+		callback done;
+		io_account* account;
+	};
+
+	void work()
+	{
+		for (;;) {
+			task t;
+			{
+				std::unique_lock<std::mutex> lk(mtx_);
+				cv_.wait(lk, [this] { return stop_ || !queue_.empty(); });
+				if (queue_.empty())
+					return;
+				t = std::move(queue_.front());
+				queue_.pop_front();
+				++running_;
+			}
+
+			io_scope scope(t.account);
+			int err = 0;
+			try {
+				t.got += pread_all(t.fd, t.ptr + t.got, t.nbytes - t.got,
+						   static_cast<off_t>(t.off + t.got));
+			} catch (const std::system_error& e) {
+				err = e.code().value();
+			}
+			try {
+				t.done(t.got, err);
+			} catch (...) {
+			}
+
+			std::lock_guard<std::mutex> lk(mtx_);
+			--running_;
+		}
+	}
+
+	mutable std::mutex mtx_;
+	std::condition_variable cv_;
+	std::deque<task> queue_;
+	std::size_t running_ = 0;
+	bool stop_ = false;
+	std::vector<std::thread> pool_;
+
+	std::atomic<std::uint64_t> hits_ { 0 };
+	std::atomic<std::uint64_t> misses_ { 0 };
+};
+#endif
+
+/**
+ *  @breif  Append-only file shared by many writer threads without a
+ *  lock on the write path.
+ *
+ *  Each append reserves its byte range with one atomic fetch_add on
+ *  the tail and writes it with pwrite(), so writers proceed in
+ *  parallel. An append returns as soon as its own write is done; the
+ *  finished range is recorded, out of order, and written() moves up
+ *  over the record whenever the ranges below it are complete. So
+ *  written() is the end of the contiguous prefix that is fully
+ *  written, and durable() the part of that prefix a sync() has
+ *  flushed, the offset readers may trust after a crash.
+ *  Space is preallocated a window ahead of the tail with fallocate()
+ *  so appends do not allocate blocks one by one; the unused rest is
+ *  given back on destruction. If a write fails, written() stops there
+ *  and every later append throws.
+ */
+class concurrent_appender {
+public:
+	explicit concurrent_appender(const std::string& path,
+				     std::uint64_t preallocate = 64 << 20,
+				     mode_t mode = fs_perms::owner_read | fs_perms::owner_write |
+				     fs_perms::group_read | fs_perms::others_read)
+		: ahead_(preallocate)
+	{
+		fd_ = open_file(path, fs_omode::writeonly | fs_omode::create |
+				fs_omode::close_exec, mode);
+
+		std::uint64_t size;
+		try {
+			size = static_cast<std::uint64_t>(file_size(fd_));
+		} catch (...) {
+			::close(fd_);
+			throw;
+		}
+
+		tail_ = written_ = durable_ = prealloc_ = size;
+		extend(size);
+	}
+
+	concurrent_appender(const concurrent_appender&) = delete;
+	concurrent_appender& operator=(const concurrent_appender&) = delete;
+
+	/**
+	 *  @breif  Trims the preallocation past the data and closes the
+	 *  file. Call sync() first for durability.
+	 */
+	~concurrent_appender()
+	{
+		if (!failed_.load())
+			::ftruncate(fd_, static_cast<off_t>(written_.load()));
+		::close(fd_);
+	}
+
+	/**
+	 *  @breif  Append data. Safe to call from any number of threads.
+	 *  @return The offset the data was written at.
+	 */
+	template <typename T>
+	std::uint64_t append(const T* ptr, std::size_t nbytes)
+	{
+		if (failed_.load(std::memory_order_relaxed))
+			throw fs_error::get(EIO, "concurrent_appender: earlier append failed");
+
+		const auto off = tail_.fetch_add(nbytes, std::memory_order_relaxed);
+		const auto end = off + nbytes;
+
+		if (end + ahead_.load(std::memory_order_relaxed) / 2 >
+		    prealloc_.load(std::memory_order_relaxed))
+			extend(end);
+
+		try {
+			pwrite_all(fd_, ptr, nbytes, static_cast<off_t>(off));
+		} catch (...) {
+			failed_.store(true);
+			throw;
+		}
+
+		if (nbytes > 0)
+			finish(off, end);
+
+		return off;
+	}
+
+	/**
+	 *  @breif  Flush everything written so far to the disk.
+	 *  @return The new durable() offset.
+	 */
+	std::uint64_t sync()
+	{
+		const auto mark = written_.load(std::memory_order_acquire);
+
+		if (::fdatasync(fd_) == -1)
+			throw fs_error::get("fdatasync()");
+
+		auto cur = durable_.load();
+		while (cur < mark && !durable_.compare_exchange_weak(cur, mark))
+			;
+
+		return std::max(cur, mark);
+	}
+
+	/**
+	 *  @breif  End of the contiguous, completely written prefix.
+	 */
+	[[nodiscard]]
+	std::uint64_t written() const noexcept
+	{ return written_.load(std::memory_order_acquire); }
+
+	/**
+	 *  @breif  End of the prefix that is written and synced.
+	 */
+	[[nodiscard]]
+	std::uint64_t durable() const noexcept
+	{ return durable_.load(std::memory_order_acquire); }
+
+	/**
+	 *  @breif  End of all reserved ranges, finished or not.
+	 */
+	[[nodiscard]]
+	std::uint64_t reserved() const noexcept
+	{ return tail_.load(std::memory_order_relaxed); }
+
+	/**
+	 *  @breif  Underlying file descriptor, for readers.
+	 */
+	[[nodiscard]]
+	int native_handle() const noexcept
+	{ return fd_; }
+
+private:
+	// Record a finished range and move written_ over whatever became
+	// contiguous. Nobody waits for the ranges below; a range that never
+	// finishes (a failed write) keeps written_ below it for good.
+	void finish(std::uint64_t off, std::uint64_t end)
+	{
+		std::lock_guard<std::mutex> lk(done_mtx_);
+		done_.emplace(off, end);
+
+		auto cur = written_.load(std::memory_order_relaxed);
+		auto it = done_.begin();
+		for (; it != done_.end() && it->first == cur; ++it)
+			cur = it->second;
+		done_.erase(done_.begin(), it);
+		written_.store(cur, std::memory_order_release);
+	}
+
+	// One thread at a time grows the preallocation, the others go on;
+	// it is only an optimization.
+	void extend(std::uint64_t end) noexcept
+	{
+		const auto ahead = ahead_.load(std::memory_order_relaxed);
+		if (ahead == 0 || extending_.exchange(true, std::memory_order_acquire))
+			return;
+
+		const auto from = prealloc_.load(std::memory_order_relaxed);
+		const auto to = std::max(from, end) + ahead;
+#ifdef __linux__
+		if (::fallocate(fd_, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(from),
+				static_cast<off_t>(to - from)) == 0)
+			prealloc_.store(to, std::memory_order_relaxed);
+		else
+			ahead_ = 0;
+#else
+		ahead_ = 0;
+#endif
+		extending_.store(false, std::memory_order_release);
+	}
+
+	int fd_ = -1;
+	std::atomic<std::uint64_t> ahead_;
+	std::atomic<std::uint64_t> tail_ { 0 };
+	std::atomic<std::uint64_t> written_ { 0 };
+	std::atomic<std::uint64_t> durable_ { 0 };
+	std::atomic<std::uint64_t> prealloc_ { 0 };
+	std::atomic<bool> extending_ { false };
+	std::atomic<bool> failed_ { false };
+
+	// Finished ranges above written_, by start offset.
+	std::mutex done_mtx_;
+	std::map<std::uint64_t, std::uint64_t> done_;
+};
+
+/**
+ *  @breif  File handle one process can share between all its threads.
+ *
+ *  Only positional calls are offered (pread, pwrite, preadv), so there
+ *  is no file offset for threads to race on and no lock. The logical
+ *  size is tracked in memory: it starts at the size on open, grows
+ *  once a write past it has completed, and reads are clamped to it.
+ *  Writes to overlapping ranges from different threads are not
+ *  ordered against each other.
+ */
+class shared_file {
+public:
+	explicit shared_file(const std::string& path,
+			     int flags = fs_omode::read_write | fs_omode::create,
+			     mode_t mode = fs_perms::owner_read | fs_perms::owner_write |
+			     fs_perms::group_read | fs_perms::others_read)
+	{
+		// An O_APPEND descriptor would make pwrite() ignore the offset.
+		fd_ = open_file(path, (flags & ~fs_omode::append) | fs_omode::close_exec, mode);
+		try {
+			size_ = static_cast<std::uint64_t>(file_size(fd_));
+		} catch (...) {
+			::close(fd_);
+			throw;
+		}
+	}
+
+	shared_file(const shared_file&) = delete;
+	shared_file& operator=(const shared_file&) = delete;
+
+	~shared_file()
+	{ ::close(fd_); }
+
+	/**
+	 *  @breif  Read data at an offset.
+	 *  @return The size of the data it read in bytes, short only at the
+	 *  logical end of the file.
+	 */
+	template <typename T>
+	std::size_t read_object(T* ptr, std::size_t nbytes, std::uint64_t off) const
+	{
+		const auto size = size_.load(std::memory_order_acquire);
+		if (off >= size)
+			return 0;
+
+		nbytes = static_cast<std::size_t>(std::min<std::uint64_t>(nbytes, size - off));
+		return pread_all(fd_, ptr, nbytes, static_cast<off_t>(off));
+	}
+
+	/**
+	 *  @breif  Scatter read at an offset into several buffers.
+	 *  @return The size of the data it read in bytes.
+	 */
+	std::size_t read_vector(const struct iovec* iov, int iovcnt, std::uint64_t off) const
+	{
+		const auto size = size_.load(std::memory_order_acquire);
+		if (off >= size)
+			return 0;
+
+		// Work on a copy clamped to the logical size, the caller's
+		// array stays untouched.
+		std::vector<struct iovec> v;
+		auto left = size - off;
+		for (int i = 0; i < iovcnt && left > 0; ++i) {
+			const auto len = std::min<std::uint64_t>(iov[i].iov_len, left);
+			v.push_back({ iov[i].iov_base, static_cast<std::size_t>(len) });
+			left -= len;
+		}
+
+		io_probe probe;
+		std::size_t done = 0, i = 0;
+		while (i < v.size()) {
+			auto sz = ::preadv(fd_, &v[i], static_cast<int>(std::min<std::size_t>(v.size() - i, IOV_MAX)),
+					   static_cast<off_t>(off + done));
+			probe.read(sz);
+			if (sz == -1) {
+				if (errno == EINTR)
+					continue;
+				throw fs_error::get("preadv()");
+			}
+			if (sz == 0)
+				break;
+
+			done += static_cast<std::size_t>(sz);
+			auto n = static_cast<std::size_t>(sz);
+			while (i < v.size() && n >= v[i].iov_len)
+				n -= v[i++].iov_len;
+			if (n > 0) {
+				v[i].iov_base = static_cast<char*>(v[i].iov_base) + n;
+				v[i].iov_len -= n;
+			}
+		}
+
+		return done;
+	}
+
+	/**
+	 *  @breif  Write data at an offset, growing the logical size if it
+	 *  ends past it.
+	 *  @return None.
+	 */
+	template <typename T>
+	void write_object(const T* ptr, std::size_t nbytes, std::uint64_t off)
+	{
+		pwrite_all(fd_, ptr, nbytes, static_cast<off_t>(off));
+		grow(off + nbytes);
+	}
+
+	/**
+	 *  @breif  Set the file size.
+	 *  @return None.
+	 */
+	void resize(std::uint64_t size)
+	{
+		resize_file(fd_, size);
+		size_.store(size, std::memory_order_release);
+	}
+
+	/**
+	 *  @breif  Flush written data to the disk.
+	 *  @return None.
+	 */
+	void sync() const
+	{
+		if (::fdatasync(fd_) == -1)
+			throw fs_error::get("fdatasync()");
+	}
+
+	/**
+	 *  @breif  Logical size of the file.
+	 *  @return Size in bytes.
+	 */
+	[[nodiscard]]
+	std::uint64_t size() const noexcept
+	{ return size_.load(std::memory_order_acquire); }
+
+	/**
+	 *  @breif  Underlying file descriptor. Only use positional calls
+	 *  on it.
+	 */
+	[[nodiscard]]
+	int native_handle() const noexcept
+	{ return fd_; }
+
+private:
+	void grow(std::uint64_t end) noexcept
+	{
+		auto cur = size_.load(std::memory_order_relaxed);
+		while (cur < end && !size_.compare_exchange_weak(cur, end, std::memory_order_release))
+			;
+	}
+
+	int fd_ = -1;
+	std::atomic<std::uint64_t> size_ { 0 };
+};
+
+/**
+ *  @breif  Directory that spreads its entries over hashed subdirectories.
+ *
+ *  A key lives at root/<h1>/<h2>/.../key, the levels taken from a hash
+ *  of the key, so no single directory grows past roughly
+ *  entries / fanout^depth names. Shard directories are created on first
+ *  use and remembered, so only the first create in a shard pays for
+ *  the mkdir. When a flat legacy directory is given, lookups fall back
+ *  to it, which keeps keys reachable while migrate() moves them over;
+ *  migrate() may run while the directory is in use. A key created or
+ *  removed through here leaves no copy behind in the legacy directory.
+ *  Keys must not contain '/'.
+ */
+class sharded_dir {
+public:
+	explicit sharded_dir(const std::string& root, unsigned fanout = 256, unsigned depth = 2,
+			     const std::string& legacy_dir = "")
+		: root_(root), legacy_(legacy_dir), fanout_(fanout), depth_(depth)
+	{
+		if (fanout < 2 || depth == 0)
+			throw fs_error::get(EINVAL, "sharded_dir: fanout or depth");
+
+		for (auto n = fanout - 1; n > 0; n >>= 4)
+			++width_;
+		if (::mkdir(root.c_str(), fs_perms::owner_all | fs_perms::group_read |
+			    fs_perms::group_exec | fs_perms::others_read |
+			    fs_perms::others_exec) == -1 && errno != EEXIST)
+			throw fs_error::get("mkdir()");
+	}
+
+	sharded_dir(const sharded_dir&) = delete;
+	sharded_dir& operator=(const sharded_dir&) = delete;
+
+	/**
+	 *  @breif  Where a key lives in the sharded layout.
+	 *  @return The path, whether it exists or not.
+	 */
+	[[nodiscard]]
+	std::string path(const std::string& key) const
+	{
+		return shard(key) + "/" + key;
+	}
+
+	/**
+	 *  @breif  Open a key. With fs_omode::create the shard is created
+	 *  as needed and the key always goes to the sharded layout; a
+	 *  legacy copy of it is moved over first.
+	 *  @return The file descriptor.
+	 */
+	[[nodiscard]]
+	int open(const std::string& key, int flags, mode_t mode = fs_perms::owner_read |
+		 fs_perms::owner_write | fs_perms::group_read | fs_perms::others_read)
+	{
+		const auto dir = shard(key);
+
+		if (flags & fs_omode::create) {
+			ensure(dir);
+			if (!legacy_.empty()) {
+				// In place, a key named like a shard is that directory.
+				const auto src = legacy_ + "/" + key;
+				struct stat st;
+				if (!is_shard_name(key) ||
+				    (::lstat(src.c_str(), &st) == 0 && !S_ISDIR(st.st_mode)))
+					adopt(src, dir + "/" + key);
+			}
+			auto fd = ::open((dir + "/" + key).c_str(), flags, mode);
+			if (fd == -1 && errno == ENOENT) {
+				// The shard went away behind our back.
+				forget(dir);
+				ensure(dir);
+				fd = ::open((dir + "/" + key).c_str(), flags, mode);
+			}
+			if (fd == -1)
+				throw fs_error::get("open()");
+			return fd;
+		}
+
+		auto fd = ::open((dir + "/" + key).c_str(), flags);
+		if (fd == -1 && errno == ENOENT && !legacy_.empty()) {
+			fd = ::open((legacy_ + "/" + key).c_str(), flags);
+			// It may have been migrated in between.
+			if (fd == -1 && errno == ENOENT)
+				fd = ::open((dir + "/" + key).c_str(), flags);
+		}
+		if (fd == -1)
+			throw fs_error::get("open()");
+
+		return fd;
+	}
+
+	/**
+	 *  @breif  Check whether a key exists, in either layout.
+	 *  @return If it exists, it returns true, otherwise false.
+	 */
+	[[nodiscard]]
+	bool exists(const std::string& key) const
+	{
+		const auto p = path(key);
+		struct stat st;
+
+		if (::lstat(p.c_str(), &st) == 0)
+			return true;
+		if (legacy_.empty())
+			return false;
+
+		return ::lstat((legacy_ + "/" + key).c_str(), &st) == 0 ||
+			::lstat(p.c_str(), &st) == 0;
+	}
+
+	/**
+	 *  @breif  Create the shard of a key if needed.
+	 *  @return The path of the key.
+	 */
+	std::string prepare(const std::string& key)
+	{
+		const auto dir = shard(key);
+		ensure(dir);
+		return dir + "/" + key;
+	}
+
+	/**
+	 *  @breif  Remove a key from both layouts, so a stale legacy copy
+	 *  cannot come back.
+	 *  @return True if something was removed.
+	 */
+	bool remove(const std::string& key)
+	{
+		bool removed = false;
+
+		if (::unlink(path(key).c_str()) == 0)
+			removed = true;
+		else if (errno != ENOENT)
+			throw fs_error::get("unlink()");
+		if (legacy_.empty())
+			return removed;
+
+		// EISDIR: in place, a key named like a shard is that directory.
+		if (::unlink((legacy_ + "/" + key).c_str()) == 0)
+			removed = true;
+		else if (errno != ENOENT && errno != EISDIR)
+			throw fs_error::get("unlink()");
+		return removed;
+	}
+
+	/**
+	 *  @breif  Move the entries of a flat directory into the sharded
+	 *  layout with renames.
+	 *  @return The number of entries moved.
+	 *
+	 *  Defaults to the legacy directory. When it is the root itself,
+	 *  the shard directories at its top are left alone. Entries that
+	 *  already exist in the sharded layout are not overwritten; the
+	 *  sharded copy is the newer one and the flat one is deleted. The
+	 *  directory is streamed, so it can be huge.
+	 */
+	std::uint64_t migrate(const std::string& flat_dir = "")
+	{
+		const auto& from = flat_dir.empty() ? legacy_ : flat_dir;
+		if (from.empty())
+			throw fs_error::get(EINVAL, "sharded_dir: nothing to migrate");
+
+		const bool in_place = canonical(from) == canonical(root_);
+		std::uint64_t moved = in_place ? unblock() : 0;
+
+		auto dp = ::opendir(from.c_str());
+		if (dp == nullptr)
+			throw fs_error::get("opendir()");
+
+		// Entries are only taken out while reading, which readdir()
+		// copes with: every entry left in place is still seen once.
+		try {
+			while (auto ent = ::readdir(dp)) {
+				const std::string name = ent->d_name;
+				const auto src = from + "/" + name;
+				if (name == "." || name == "..")
+					continue;
+
+				struct stat st;
+				if (in_place && is_shard_name(name) &&
+				    ::lstat(src.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+					continue;
+
+				if (adopt(src, prepare(name)))
+					++moved;
+			}
+		} catch (...) {
+			::closedir(dp);
+			throw;
+		}
+		::closedir(dp);
+
+		return moved;
+	}
+
+private:
+	std::string shard(const std::string& key) const
+	{
+		if (key.empty() || key.find('/') != std::string::npos || key == "." || key == "..")
+			throw fs_error::get(EINVAL, "sharded_dir: bad key");
+
+		auto h = checksum64(key.data(), key.size());
+		std::string out = root_;
+
+		for (unsigned level = 0; level < depth_; ++level) {
+			out += '/';
+			out += shard_name(h % fanout_);
+			h /= fanout_;
+		}
+
+		return out;
+	}
+
+	std::string shard_name(std::uint64_t v) const
+	{
+		std::string out(width_, '0');
+		for (auto i = out.size(); v > 0; v >>= 4)
+			out[--i] = "0123456789abcdef"[v & 15];
+		return out;
+	}
+
+	bool is_shard_name(const std::string& name) const
+	{
+		return name.size() == width_ &&
+			name.find_first_not_of("0123456789abcdef") == std::string::npos;
+	}
+
+	// Flat keys named like top-level shards keep those shards from being
+	// created, possibly their own; move them all aside before moving
+	// them in.
+	std::uint64_t unblock()
+	{
+		std::vector<std::string> names;
+		for (unsigned v = 0; v < fanout_; ++v) {
+			const auto name = shard_name(v);
+			const auto p = root_ + "/" + name;
+			struct stat st;
+			if (::lstat(p.c_str(), &st) == -1 || S_ISDIR(st.st_mode))
+				continue;
+			if (::rename(p.c_str(), (p + ".fs_mini.migrate").c_str()) == -1)
+				throw fs_error::get("rename()");
+			names.push_back(name);
+		}
+
+		std::uint64_t moved = 0;
+		for (const auto& name : names) {
+			if (adopt(root_ + "/" + name + ".fs_mini.migrate", prepare(name)))
+				++moved;
+		}
+		return moved;
+	}
+
+	// Move a flat entry to its sharded path. RENAME_NOREPLACE keeps a
+	// newer sharded copy, and the flat one is then dropped.
+	static bool adopt(const std::string& src, const std::string& dst)
+	{
+		if (::renameat2(AT_FDCWD, src.c_str(), AT_FDCWD, dst.c_str(),
+				RENAME_NOREPLACE) == 0)
+			return true;
+		if (errno == EEXIST) {
+			if (::unlink(src.c_str()) == -1 && errno != ENOENT)
+				throw fs_error::get("unlink()");
+			return false;
+		}
+		if (errno != ENOENT)
+			throw fs_error::get("renameat2()");
+		return false;
+	}
+
+	void ensure(const std::string& dir)
+	{
+		{
+			std::lock_guard<std::mutex> lk(mtx_);
+			if (known_.count(dir))
+				return;
+		}
+
+		// Create the levels top-down; EEXIST is the common case.
+		for (auto pos = root_.size() + 1; pos <= dir.size(); ++pos) {
+			if (pos != dir.size() && dir[pos] != '/')
+				continue;
+			const auto sub = dir.substr(0, pos);
+			if (::mkdir(sub.c_str(), fs_perms::owner_all | fs_perms::group_read |
+				    fs_perms::group_exec | fs_perms::others_read |
+				    fs_perms::others_exec) == 0)
+				continue;
+			if (errno != EEXIST)
+				throw fs_error::get("mkdir()");
+
+			// A flat key named like a shard can sit in the way when the
+			// root is also the legacy directory.
+			struct stat st;
+			if (::stat(sub.c_str(), &st) == -1)
+				throw fs_error::get("stat()");
+			if (!S_ISDIR(st.st_mode))
+				throw fs_error::get(ENOTDIR, "sharded_dir: " + sub +
+						    " is a legacy file, migrate() it first");
+		}
+
+		std::lock_guard<std::mutex> lk(mtx_);
+		known_.insert(dir);
+	}
+
+	void forget(const std::string& dir)
+	{
+		std::lock_guard<std::mutex> lk(mtx_);
+		known_.erase(dir);
+	}
+
+	std::string root_;
+	std::string legacy_;
+	unsigned fanout_;
+	unsigned depth_;
+	unsigned width_ = 0;
+
+	std::mutex mtx_;
+	std::unordered_set<std::string> known_;
+};
+
+/**
+ *  @breif  Kinds of change a watcher reports.
+ */
+enum class watch_kind {
+	created,
+	removed,
+	modified,
+	attributes,
+	replaced,
+};
+
+/**
+ *  @breif  One change reported by a watcher.
+ */
+struct watch_event {
+	std::string path;
+	watch_kind kind;
+};
+
+#ifdef __linux__
+/**
+ *  @breif  Knobs for polling_watcher.
+ *
+ *  rate caps the stat calls per second over all paths; with more paths
+ *  than that each one is simply looked at less often. A path that just
+ *  changed is checked every min_interval, and the interval doubles up
+ *  to max_interval while it stays quiet. force_sync makes network
+ *  filesystems revalidate instead of answering from the attribute
+ *  cache.
+ */
+struct poll_options {
+	unsigned rate = 1000;
+	std::chrono::milliseconds min_interval { 100 };
+	std::chrono::milliseconds max_interval { 10000 };
+	bool force_sync = true;
+};
+
+/**
+ *  @breif  Change detection by polling, for filesystems where inotify
+ *  stays silent (NFS, most FUSE filesystems).
+ *
+ *  Each tracked path keeps its last (inode, size, mtime, ctime). Due
+ *  paths are statx()-ed in batches through one io_uring submission
+ *  (one statx() per path where io_uring is not available), within the
+ *  rate budget, and the differences come back as watch_events:
+ *  created, removed, replaced (another inode under the name), modified
+ *  (size or mtime) or attributes (ctime only). Not thread safe.
+ */
+class polling_watcher {
+public:
+	explicit polling_watcher(const poll_options& opts = poll_options())
+		: opts_(opts), last_refill_(clock::now())
+	{
+		if (opts_.rate == 0)
+			throw fs_error::get(EINVAL, "polling_watcher: rate");
+
+		try {
+			ring_.reset(new uring(batch_max));
+			if (!ring_->supports(IORING_OP_STATX))
+				ring_.reset();
+		} catch (const std::system_error&) {
+		}
+		tokens_ = opts_.rate;
+	}
+
+	polling_watcher(const polling_watcher&) = delete;
+	polling_watcher& operator=(const polling_watcher&) = delete;
+
+	/**
+	 *  @breif  Start tracking a path. It is queued rather than stat()-ed
+	 *  here: the next poll() takes its baseline within the rate budget,
+	 *  without reporting anything for it.
+	 *  @return None.
+	 */
+	void add(const std::string& path)
+	{
+		if (entries_.count(path))
+			return;
+
+		auto& e = entries_[path];
+		e.path = path;
+		e.interval = opts_.min_interval;
+		// Due right away.
+		schedule(e, clock::now() - e.interval);
+	}
+
+	/**
+	 *  @breif  Stop tracking a path.
+	 *  @return None.
+	 */
+	void remove(const std::string& path)
+	{
+		auto it = entries_.find(path);
+		if (it == entries_.end())
+			return;
+
+		unschedule(it->second);
+		entries_.erase(it);
+	}
+
+	/**
+	 *  @breif  Number of tracked paths.
+	 */
+	[[nodiscard]]
+	std::size_t size() const noexcept
+	{ return entries_.size(); }
+
+	/**
+	 *  @breif  Check the paths that are due, waiting up to timeout_ms
+	 *  (-1 for no limit) for something to change.
+	 *  @return The changes found, possibly none on timeout.
+	 */
+	std::vector<watch_event> poll(int timeout_ms = -1)
+	{
+		const auto deadline = timeout_ms < 0 ? clock::time_point::max() :
+			clock::now() + std::chrono::milliseconds(timeout_ms);
+		std::vector<watch_event> out;
+
+		for (;;) {
+			refill();
+			const auto now = clock::now();
+
+			std::vector<entry*> due;
+			for (auto it = queue_.begin(); it != queue_.end() && it->first <= now &&
+				     due.size() < tokens_; ++it)
+				due.push_back(it->second);
+
+			if (!due.empty()) {
+				tokens_ -= static_cast<unsigned>(due.size());
+				check(due, now, out);
+				if (!out.empty())
+					return out;
+				continue;
+			}
+
+			// Sleep until the next path is due and there is budget for it.
+			auto wake = queue_.empty() ? deadline : queue_.begin()->first;
+			if (tokens_ == 0)
+				wake = std::max(wake, now + std::chrono::microseconds(1000000 / opts_.rate));
+			if (wake >= deadline) {
+				if (deadline == clock::time_point::max())
+					return out;
+				std::this_thread::sleep_until(deadline);
+				return out;
+			}
+			std::this_thread::sleep_until(wake);
+		}
+	}
+
+private:
+	using clock = std::chrono::steady_clock;
+	static constexpr unsigned batch_max = 256;
+
+	struct entry {
+		std::string path;
+		struct statx st;
+		bool exists = false;
+		bool baseline = true;
+		std::chrono::milliseconds interval;
+		std::multimap<clock::time_point, entry*>::iterator slot;
+		bool queued = false;
+	};
+
+	static bool same_time(const struct statx_timestamp& a, const struct statx_timestamp& b)
+	{ return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec; }
+
+	int statx_flags() const noexcept
+	{ return opts_.force_sync ? AT_STATX_FORCE_SYNC : AT_STATX_SYNC_AS_STAT; }
+
+	static constexpr unsigned statx_mask = STATX_INO | STATX_SIZE | STATX_MTIME | STATX_CTIME;
+
+	void schedule(entry& e, clock::time_point now)
+	{
+		e.slot = queue_.emplace(now + e.interval, &e);
+		e.queued = true;
+	}
+
+	void unschedule(entry& e)
+	{
+		if (e.queued)
+			queue_.erase(e.slot);
+		e.queued = false;
+	}
+
+	void refill()
+	{
+		const auto now = clock::now();
+		const auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+			now - last_refill_).count();
+		const auto add = static_cast<std::uint64_t>(us) * opts_.rate / 1000000;
+
+		if (add > 0) {
+			tokens_ = static_cast<unsigned>(std::min<std::uint64_t>(opts_.rate, tokens_ + add));
+			last_refill_ = now;
+		}
+	}
+
+	void check(const std::vector<entry*>& due, clock::time_point now,
+		   std::vector<watch_event>& out)
+	{
+		std::vector<struct statx> fresh(due.size());
+		std::vector<int> err(due.size(), 0);
+		io_probe probe;
+
+		if (ring_) {
+			for (std::size_t base = 0; base < due.size(); base += batch_max) {
+				const auto n = std::min<std::size_t>(batch_max, due.size() - base);
+				for (std::size_t i = base; i < base + n; ++i) {
+					auto sqe = ring_->get_sqe();
+					sqe->opcode = IORING_OP_STATX;
+					sqe->fd = AT_FDCWD;
+					sqe->addr = reinterpret_cast<std::uintptr_t>(due[i]->path.c_str());
+					sqe->len = statx_mask;
+					sqe->off = reinterpret_cast<std::uintptr_t>(&fresh[i]);
+					sqe->statx_flags = static_cast<std::uint32_t>(statx_flags());
+					sqe->user_data = i;
+				}
+
+				ring_->submit(static_cast<unsigned>(n));
+				struct io_uring_cqe cqe;
+				for (std::size_t got = 0; got < n; ) {
+					if (!ring_->pop(cqe)) {
+						ring_->submit(1);
+						continue;
+					}
+					probe.call();
+					err[cqe.user_data] = cqe.res < 0 ? -cqe.res : 0;
+					++got;
+				}
+			}
+		} else {
+			for (std::size_t i = 0; i < due.size(); ++i) {
+				probe.call();
+				if (::statx(AT_FDCWD, due[i]->path.c_str(), statx_flags(),
+					    statx_mask, &fresh[i]) == -1)
+					err[i] = errno;
+			}
+		}
+
+		for (std::size_t i = 0; i < due.size(); ++i) {
+			auto& e = *due[i];
+			if (err[i] != 0 && err[i] != ENOENT && err[i] != ENOTDIR)
+				throw fs_error::get(err[i], "statx(): " + e.path);
+
+			const bool exists = err[i] == 0;
+			const auto& st = fresh[i];
+			bool changed = true;
+
+			if (e.baseline)
+				e.baseline = false;
+			else if (!e.exists && exists)
+				out.push_back({ e.path, watch_kind::created });
+			else if (e.exists && !exists)
+				out.push_back({ e.path, watch_kind::removed });
+			else if (!exists)
+				changed = false;
+			else if (st.stx_ino != e.st.stx_ino || st.stx_dev_major != e.st.stx_dev_major ||
+				 st.stx_dev_minor != e.st.stx_dev_minor)
+				out.push_back({ e.path, watch_kind::replaced });
+			else if (st.stx_size != e.st.stx_size || !same_time(st.stx_mtime, e.st.stx_mtime))
+				out.push_back({ e.path, watch_kind::modified });
+			else if (!same_time(st.stx_ctime, e.st.stx_ctime))
+				out.push_back({ e.path, watch_kind::attributes });
+			else
+				changed = false;
+
+			e.exists = exists;
+			if (exists)
+				e.st = st;
+			e.interval = changed ? opts_.min_interval :
+				std::min(e.interval * 2, opts_.max_interval);
+
+			unschedule(e);
+			schedule(e, now);
+		}
+	}
+
+	poll_options opts_;
+	std::unique_ptr<uring> ring_;
+	std::unordered_map<std::string, entry> entries_;
+	std::multimap<clock::time_point, entry*> queue_;
+
+	unsigned tokens_ = 0;
+	clock::time_point last_refill_;
+};
+#endif
+
 };
 
 #endif
@@ -1,8 +1,1294 @@
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include <sys/wait.h>
 
 #include "fs_mini.hpp"
 
+static int failures = 0;
+
+static void check(bool ok, const char* what)
+{
+	if (!ok) {
+		std::cerr << "FAILED: " << what << '\n';
+		++failures;
+	}
+}
+
+#ifdef __linux__
+static void test_follower()
+{
+	const auto file = "follow.txt";
+	fs::write_file(file, "abc", 3);
+
+	fs::file_follower f(file, false, 4);
+	std::string out = "x";
+
+	check(f.read(out, 0) == 3 && out == "xabc", "follower reads existing data");
+	// An idle poll must not touch the caller's string.
+	out.reserve(64);
+	const auto cap = out.capacity();
+	check(f.read(out, 0) == 0 && out == "xabc" && out.capacity() == cap,
+	      "follower idle poll leaves out alone");
+
+	auto fd = fs::open_file(file, fs_omode::writeonly | fs_omode::append);
+	fs::write_object(fd, "defghi", 6);
+	fs::close_file(fd);
+	check(f.read(out, 0) == 4 && out == "xabcdefg", "follower honours chunk size");
+	check(f.read(out, 0) == 2 && out == "xabcdefghi", "follower reads the rest");
+
+	fs::remove_file(file);
+}
+#endif
+
+static void test_rotation_retention()
+{
+	for (int i = 1; i <= 5; ++i)
+		fs::write_file("rot.log." + std::to_string(i), "x", 1);
+
+	fs::rotate_policy policy;
+	policy.max_files = 2;
+	{
+		fs::rotating_writer w("rot.log", policy);
+		check(!fs::is_file_exists("rot.log.1") && !fs::is_file_exists("rot.log.3") &&
+		      fs::is_file_exists("rot.log.4") && fs::is_file_exists("rot.log.5"),
+		      "rotating_writer prunes old segments on construction");
+	}
+
+	for (int i = 4; i <= 5; ++i)
+		fs::remove_file("rot.log." + std::to_string(i));
+	fs::remove_file("rot.log");
+
+	policy.compress = true;
+#ifdef FS_MINI_ZLIB
+	{
+		fs::rotating_writer w("rot.log", policy);
+		w.write("hello", 5);
+		w.rotate();
+	}
+	char back[16] = {};
+	auto gz = ::gzopen("rot.log.1.gz", "rb");
+	check(gz != nullptr && ::gzread(gz, back, sizeof(back)) == 5 &&
+	      std::memcmp(back, "hello", 5) == 0 && !fs::is_file_exists("rot.log.1"),
+	      "rotating_writer compresses rotated segments");
+	if (gz != nullptr)
+		::gzclose(gz);
+	fs::remove_file("rot.log.1.gz");
+	fs::remove_file("rot.log");
+#else
+	int err = 0;
+	try {
+		fs::rotating_writer w("rot.log", policy);
+	} catch (const std::system_error& e) {
+		err = e.code().value();
+	}
+	check(err == EOPNOTSUPP && !fs::is_file_exists("rot.log"),
+	      "rotating_writer refuses compress without zlib");
+#endif
+}
+
+static std::vector<std::uint32_t> read_u32(const std::string& path)
+{
+	const auto data = fs::read_file<std::string>(path);
+	std::vector<std::uint32_t> v(data.size() / sizeof(std::uint32_t));
+	std::memcpy(v.data(), data.data(), v.size() * sizeof(std::uint32_t));
+	return v;
+}
+
+static void test_external_sort()
+{
+	std::vector<std::uint32_t> v(100000);
+	std::uint32_t x = 12345;
+	for (auto& e : v)
+		e = x = x * 1103515245u + 12345u;
+	fs::write_file("sort.bin", v);
+	::chmod("sort.bin", 0600);
+	std::sort(v.begin(), v.end());
+
+	// Many runs through the merge, then the in-memory path, both
+	// sorting the file onto itself.
+	fs::sort_options opts;
+	opts.threads = 3;
+	fs::external_sort<std::uint32_t>("sort.bin", "sort.bin", std::less<std::uint32_t>(),
+					 16 << 10, opts);
+	check(read_u32("sort.bin") == v, "external_sort merge in place");
+
+	fs::external_sort<std::uint32_t>("sort.bin", "sort.out", std::greater<std::uint32_t>());
+	std::reverse(v.begin(), v.end());
+	check(read_u32("sort.out") == v, "external_sort in memory");
+
+	struct stat st1, st2;
+	check(::stat("sort.bin", &st1) == 0 && (st1.st_mode & 0777) == 0600 &&
+	      ::stat("sort.out", &st2) == 0 && (st2.st_mode & 0777) == 0600,
+	      "external_sort keeps the file mode");
+
+	fs::remove_file("sort.bin");
+	fs::remove_file("sort.out");
+}
+
+static void test_broker()
+{
+	::mkdir("broker", 0755);
+	::mkdir("broker/root", 0755);
+	fs::write_file("broker/root/in", "in", 2);
+	fs::write_file("broker/out", "out", 3);
+	::symlink("../out", "broker/root/escape");
+
+	fs::broker_options opts;
+	opts.root = "broker/root";
+	{
+		fs::fd_broker b("broker/sock", fs_omode::readonly, opts);
+
+		struct stat st;
+		check(::stat("broker/sock", &st) == 0 && (st.st_mode & 0777) == 0600,
+		      "broker socket is 0600");
+
+		fs::fd_broker_client c("broker/sock");
+		std::vector<int> errors;
+		auto fds = c.open_files({ "/in", "in", "/../out", "/escape" }, &errors);
+
+		char buf[4] = { 0 };
+		check(fds[0] != -1 && ::pread(fds[0], buf, 4, 0) == 2,
+		      "broker serves paths inside its root");
+		check(fds[1] == -1 && errors[1] == EINVAL, "broker refuses relative paths");
+		std::string names;
+		for (std::size_t i = 2; i < fds.size(); ++i) {
+			// Either refused or resolved back inside the root.
+			char c0 = 0;
+			check(fds[i] == -1 || (::pread(fds[i], &c0, 1, 0) == 1 && c0 == 'i'),
+			      "broker does not leave its root");
+		}
+		for (auto fd : fds)
+			if (fd != -1)
+				::close(fd);
+
+		// A file replaced by rename() is reopened, not served stale.
+		::close(c.open_file("/in"));
+		fs::write_file("broker/root/in.new", "new", 3);
+		::rename("broker/root/in.new", "broker/root/in");
+		auto fd = c.open_file("/in");
+		check(::pread(fd, buf, 4, 0) == 3 && std::memcmp(buf, "new", 3) == 0,
+		      "broker reopens replaced files");
+		::close(fd);
+
+		// A live broker's socket is not taken over.
+		bool refused = false;
+		try {
+			fs::fd_broker twin("broker/sock", fs_omode::readonly, opts);
+		} catch (const std::system_error& e) {
+			refused = e.code().value() == EADDRINUSE;
+		}
+		check(refused && ::stat("broker/sock", &st) == 0, "broker leaves a live socket alone");
+
+		// Other users are turned away even when they can reach the socket.
+		if (::geteuid() == 0) {
+			::chmod("broker/sock", 0666);
+			auto pid = ::fork();
+			if (pid == 0) {
+				int ok = 1;
+				if (::setuid(65534) == 0) {
+					try {
+						fs::fd_broker_client other("broker/sock");
+						::close(other.open_file("/in"));
+					} catch (const std::system_error&) {
+						ok = 0;
+					}
+				}
+				::_exit(ok);
+			}
+			int status = -1;
+			::waitpid(pid, &status, 0);
+			check(WIFEXITED(status) && WEXITSTATUS(status) == 0,
+			      "broker refuses other uids");
+		}
+	}
+
+	// Nor is a file that is not a socket; a stale socket is replaced.
+	bool refused = false;
+	try {
+		fs::fd_broker b("broker/out", fs_omode::readonly, opts);
+	} catch (const std::system_error& e) {
+		refused = e.code().value() == EADDRINUSE;
+	}
+	check(refused && fs::read_file<std::string>("broker/out") == "out",
+	      "broker does not remove other files");
+	{
+		int s = ::socket(AF_UNIX, SOCK_SEQPACKET, 0);
+		struct sockaddr_un addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		std::strcpy(addr.sun_path, "broker/stale");
+		::bind(s, reinterpret_cast<struct sockaddr*>(&addr), sizeof(addr));
+		::close(s);
+		fs::fd_broker b("broker/stale", fs_omode::readonly, opts);
+		fs::fd_broker_client c("broker/stale");
+		::close(c.open_file("/in"));
+	}
+
+	fs::remove_all("broker");
+}
+
+static void test_move()
+{
+	// /dev/shm is tmpfs, so this is a cross-device move.
+	const std::string other = "/dev/shm/fs_mini_move";
+	fs::remove_all(other);
+	::mkdir(other.c_str(), 0755);
+	::mkdir("move", 0755);
+	::mkdir("move/src", 0755);
+	fs::write_file("move/src/a", "a", 1);
+	fs::write_file(other + "/dst.fs_mini_move", "keep", 4);
+
+	fs::move_path("move/src", other + "/dst");
+	check(fs::read_file<std::string>(other + "/dst/a") == "a" && !fs::is_file_exists("move/src"),
+	      "move_path across devices");
+	check(fs::read_file<std::string>(other + "/dst.fs_mini_move") == "keep",
+	      "move_path leaves unrelated files alone");
+
+	// Like rename(): a file never replaces a directory, a directory
+	// replaces an empty one.
+	fs::write_file("move/file", "f", 1);
+	::mkdir((other + "/empty").c_str(), 0755);
+	int err = 0;
+	try {
+		fs::move_path("move/file", other + "/empty");
+	} catch (const std::system_error& e) {
+		err = e.code().value();
+	}
+	check(err == EISDIR && fs::is_file_exists("move/file") &&
+	      fs::is_directory_exists(other + "/empty"), "move_path keeps a directory from a file");
+	::mkdir("move/dir", 0755);
+	fs::write_file("move/dir/b", "b", 1);
+	fs::move_path("move/dir", other + "/empty");
+	check(fs::read_file<std::string>(other + "/empty/b") == "b",
+	      "move_path replaces an empty directory with a directory");
+	fs::remove_file("move/file");
+
+	std::vector<std::pair<std::string, std::string>> moves;
+	for (int i = 0; i < 40; ++i) {
+		const auto name = "move/f" + std::to_string(i);
+		fs::write_file(name, "z", 1);
+		moves.emplace_back(name, (i % 3 == 0 ? other : i % 3 == 1 ? "move/a" : "move/b") +
+				   ("/" + std::to_string(i)));
+	}
+	::mkdir("move/a", 0755);
+	::mkdir("move/b", 0755);
+	fs::move_paths(moves, 4);
+
+	bool all = true;
+	for (const auto& m : moves)
+		all = all && !fs::is_file_exists(m.first) && fs::read_file<std::string>(m.second) == "z";
+	check(all, "move_paths");
+
+	fs::remove_all(other);
+	fs::remove_all("move");
+}
+
+static void test_canonical()
+{
+	::mkdir("canon", 0755);
+	::mkdir("canon/a", 0755);
+	::mkdir("canon/a/b", 0755);
+	fs::write_file("canon/a/x", "x", 1);
+	::symlink("a/b", "canon/lnk");
+	::symlink("loop", "canon/loop");
+
+	const auto real = fs::canonical("canon/a/x");
+	check(fs::canonical("canon/lnk/../x") == real, "canonical takes .. after the symlink");
+	check(fs::weakly_canonical("canon/lnk/../x") == real,
+	      "weakly_canonical takes .. after the symlink");
+	check(fs::weakly_canonical("canon/lnk/../new/../y") == fs::canonical("canon/a") + "/y",
+	      "weakly_canonical normalizes the missing tail");
+
+	fs::path_resolver r;
+	bool same = true;
+	for (int i = 0; i < 3; ++i)
+		same = same && r.canonical("canon/lnk/../x") == real &&
+			r.canonical(real) == real && r.canonical("canon/lnk/") == real.substr(0, real.size() - 1) + "b";
+	check(same, "path_resolver matches canonical");
+	check(r.hits() > 0, "path_resolver caches directories");
+
+	int errs = 0;
+	for (const auto p : { "canon/loop", "canon/a/x/y", "canon/nope/x" }) {
+		try {
+			(void)r.canonical(p);
+		} catch (const std::system_error&) {
+			++errs;
+		}
+	}
+	check(errs == 3, "path_resolver errors");
+
+	fs::remove_all("canon");
+}
+
+static void test_read_file()
+{
+	std::string data(300000, '\0');
+	for (std::size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<char>(i % 251);
+	fs::write_file("whole.bin", data);
+
+	auto same = [&data](const auto& c)
+	{
+		return c.size() == data.size() && std::memcmp(c.data(), data.data(), c.size()) == 0;
+	};
+	const fs::byte_buffer buf = fs::read_file("whole.bin");
+	check(same(buf) && same(fs::read_file<std::vector<std::byte>>("whole.bin")) &&
+	      same(fs::read_file<std::string>("whole.bin", 0)) &&
+	      same(fs::read_file<std::string>("whole.bin", 1)), "read_file round trip");
+
+#ifdef __linux__
+	// procfs reports a size of 0.
+	check(fs::read_file<std::string>("/proc/self/status").find("Name:") == 0,
+	      "read_file grows past a size of 0");
+#endif
+	fs::remove_file("whole.bin");
+}
+
+static void test_sparse()
+{
+	const std::string ones(64 << 10, '\x01');
+	fs::write_file("sparse.bin", ones);
+
+	// Zero blocks over existing data must read back as zeros.
+	std::string mixed(96 << 10, '\0');
+	std::memset(&mixed[0], 2, 4096);
+	std::memset(&mixed[40 << 10], 3, 100);
+	auto fd = fs::open_file("sparse.bin", fs_omode::read_write);
+	fs::pwrite_sparse(fd, mixed.data(), mixed.size(), 1000);
+	fs::close_file(fd);
+
+	auto expect = ones.substr(0, 1000) + mixed;
+	check(fs::read_file<std::string>("sparse.bin") == expect, "pwrite_sparse over existing data");
+
+	fs::write_file("sparse.bin", mixed.data(), mixed.size(),
+		       fs_perms::owner_read | fs_perms::owner_write, true);
+	fs::copy_file("sparse.bin", "sparse.copy", true);
+	struct stat st;
+	check(fs::read_file<std::string>("sparse.copy") == mixed && ::stat("sparse.copy", &st) == 0 &&
+	      st.st_blocks * 512 < static_cast<off_t>(mixed.size()),
+	      "sparse write_file and copy_file");
+
+	fs::remove_file("sparse.bin");
+	fs::remove_file("sparse.copy");
+}
+
+#ifdef __linux__
+static void test_memfd()
+{
+	auto fd = fs::memfd("fs_mini_test");
+	fs::write_object(fd, "sealed", 6);
+	check(fs::get_seals(fd) == 0 && !fs::has_seals(fd, fs_seal::write),
+	      "memfd starts without seals");
+
+	fs::add_seals(fd, fs_seal::write | fs_seal::shrink | fs_seal::grow);
+	check(fs::has_seals(fd, fs_seal::write | fs_seal::grow) &&
+	      !fs::has_seals(fd, fs_seal::immutable), "has_seals checks every bit");
+
+	// Every way to change the contents is refused now.
+	int errs = 0;
+	const auto expect_eperm = [&errs](void (*f)(int), int fd)
+	{
+		try {
+			f(fd);
+		} catch (const std::system_error& e) {
+			errs += e.code().value() == EPERM;
+		}
+	};
+	expect_eperm([](int fd) { (void)fs::write_object(fd, "x", 1); }, fd);
+	expect_eperm([](int fd) { fs::resize_file(fd, 1); }, fd);
+	expect_eperm([](int fd) { fs::resize_file(fd, 100); }, fd);
+	char buf[6];
+	check(errs == 3 && ::pread(fd, buf, 6, 0) == 6 && std::memcmp(buf, "sealed", 6) == 0,
+	      "sealed memfd rejects writes");
+
+	fs::add_seals(fd, fs_seal::seal);
+	check(fs::has_seals(fd, fs_seal::immutable), "memfd is immutable");
+	errs = 0;
+	expect_eperm([](int fd) { fs::add_seals(fd, fs_seal::future_write); }, fd);
+	check(errs == 1, "sealed memfd takes no more seals");
+	fs::close_file(fd);
+
+	// Without allow_sealing the memfd comes sealed against seals, and a
+	// regular file has no seals at all.
+	fd = fs::memfd("fs_mini_test", fs_mfd::close_exec);
+	check(fs::get_seals(fd) == fs_seal::seal, "memfd without sealing");
+	fs::close_file(fd);
+	fs::write_file("seals.txt", "s", 1);
+	fd = fs::open_file("seals.txt", fs_omode::readonly);
+	check(!fs::has_seals(fd, fs_seal::write), "regular file has no seals");
+	fs::close_file(fd);
+	fs::remove_file("seals.txt");
+}
+#endif
+
+#ifdef __linux__
+static void test_bulk_create()
+{
+	// Far more files than chains in flight, so every direct descriptor
+	// slot is closed and reused many times, twice over the same paths.
+	const auto lowest_fd = [] { const auto fd = ::dup(0); ::close(fd); return fd; };
+	const auto before = lowest_fd();
+	std::vector<fs::bulk_entry> entries;
+	fs::bulk_entry dir;
+	dir.path = "bulk/private";
+	dir.mode = 0700;
+	dir.directory = true;
+	entries.push_back(dir);
+
+	bool same = true, modes = true;
+	for (int round = 0; round < 2; ++round) {
+		entries.resize(1);
+		for (int i = 0; i < 300; ++i) {
+			fs::bulk_entry e;
+			e.path = (i % 2 ? "bulk/private/" : "bulk/a/b/") + std::to_string(i);
+			e.mode = 0600;
+			e.contents.assign(static_cast<std::size_t>(i * 7 % 5000 / (round + 1)),
+					  static_cast<char>('a' + i % 26));
+			entries.push_back(e);
+		}
+		fs::bulk_create(entries, 8);
+
+		for (std::size_t i = 1; i < entries.size(); ++i) {
+			struct stat st;
+			same = same && fs::read_file<std::string>(entries[i].path) == entries[i].contents;
+			modes = modes && ::stat(entries[i].path.c_str(), &st) == 0 && (st.st_mode & 0777) == 0600;
+		}
+	}
+	struct stat st;
+	check(same, "bulk_create writes every file");
+	check(modes && ::stat("bulk/private", &st) == 0 && (st.st_mode & 0777) == 0700,
+	      "bulk_create applies the modes");
+
+	// A file where a directory should be is reported.
+	entries.resize(1);
+	fs::bulk_entry bad;
+	bad.path = "bulk/private/1/x";
+	entries.push_back(bad);
+	int err = 0;
+	try {
+		fs::bulk_create(entries, 8);
+	} catch (const std::system_error& e) {
+		err = e.code().value();
+	}
+	check(err == ENOTDIR, "bulk_create reports a failed entry");
+	check(lowest_fd() == before, "bulk_create leaves no descriptors behind");
+
+	fs::remove_all("bulk");
+}
+#endif
+
+#ifdef __linux__
+static void test_extents()
+{
+	// A 1 MiB hole, 8 KiB of data, then a hole up to the size.
+	const std::string data(8192, 'd');
+	auto fd = fs::open_file("extents.bin", fs_omode::read_write | fs_omode::create |
+				fs_omode::truncate, fs_perms::owner_read | fs_perms::owner_write);
+	fs::pwrite_all(fd, data.data(), data.size(), 1 << 20);
+	fs::resize_file(fd, 2 << 20);
+
+	std::vector<fs::extent> map;
+	try {
+		map = fs::extent_map(fd);
+	} catch (const std::system_error& e) {
+		// No FIEMAP here, nothing to check.
+		fs::close_file(fd);
+		fs::remove_file("extents.bin");
+		check(e.code().value() == EOPNOTSUPP, "extent_map without FIEMAP");
+		return;
+	}
+	fs::close_file(fd);
+
+	std::uint64_t pos = 0, data_bytes = 0;
+	bool contiguous = true;
+	for (const auto& e : map) {
+		contiguous = contiguous && e.logical == pos;
+		pos = e.logical + e.length;
+		if (!e.hole)
+			data_bytes += e.length;
+	}
+	check(map.size() >= 3 && map.front().hole && map.front().logical == 0 &&
+	      map.front().length == 1 << 20 && !map[1].hole && map[1].logical == 1 << 20 &&
+	      map.back().hole && contiguous && pos == 2 << 20 && data_bytes >= data.size() &&
+	      data_bytes < (1 << 20), "extent_map lists holes and data in order");
+
+	const auto frag = fs::fragmentation("extents.bin");
+	check(frag.files == 1 && frag.fragments >= 1 && frag.score() == 0.0,
+	      "fragmentation of a small file");
+
+	// Not fragmented, so it stays in place; either way nothing changes.
+	struct stat st;
+	const auto before = ::stat("extents.bin", &st) == 0 ? st.st_blocks : -1;
+	fs::defragment("extents.bin");
+	const auto back = fs::read_file<std::string>("extents.bin");
+	check(back.size() == 2 << 20 && back.compare(1 << 20, data.size(), data) == 0 &&
+	      back.find_first_not_of('\0') == 1 << 20 && ::stat("extents.bin", &st) == 0 &&
+	      st.st_blocks == before, "defragment keeps the data and the holes");
+
+	fs::remove_file("extents.bin");
+}
+#endif
+
+#ifdef __linux__
+static void test_nowait()
+{
+	std::string data(1 << 20, '\0');
+	for (std::size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<char>(i % 241);
+	fs::write_file("nowait.bin", data);
+	auto fd = fs::open_file("nowait.bin", fs_omode::readonly);
+
+	// Just written, so it all comes from the page cache.
+	std::string back(data.size(), '\0');
+	bool would_block = true;
+	check(fs::pread_nowait(fd, &back[0], back.size(), 0, would_block) == data.size() &&
+	      !would_block && back == data, "pread_nowait reads cached data");
+	check(fs::pread_nowait(fd, &back[0], 100, data.size() - 10, would_block) == 10 &&
+	      !would_block, "pread_nowait stops at EOF");
+
+	// procfs has no RWF_NOWAIT, so reads there always miss.
+	const auto cmdline = fs::read_file<std::string>("/proc/self/cmdline");
+	auto pfd = fs::open_file("/proc/self/cmdline", fs_omode::readonly);
+	std::size_t hit_got = 0, miss_got = 0;
+	int miss_err = -1;
+	bool inline_hit, inline_miss;
+	std::thread::id miss_thread;
+	std::string cold(4096, '\0');
+	{
+		fs::nowait_reader r(2);
+		inline_hit = r.read_object(fd, &back[0], 4096, 8192,
+					   [&](std::size_t got, int) { hit_got = got; });
+		inline_miss = r.read_object(pfd, &cold[0], cold.size(), 0,
+					    [&](std::size_t got, int err) {
+						    miss_got = got;
+						    miss_err = err;
+						    miss_thread = std::this_thread::get_id();
+					    });
+		check(r.hits() == 1 && r.misses() == 1, "nowait_reader counts hits and misses");
+	}
+	fs::close_file(pfd);
+	check(inline_hit && hit_got == 4096 && back.compare(0, 4096, data, 8192, 4096) == 0,
+	      "nowait_reader serves a hit inline");
+	check(!inline_miss && miss_got == cmdline.size() && miss_err == 0 &&
+	      cold.compare(0, miss_got, cmdline) == 0 && miss_thread != std::this_thread::get_id(),
+	      "nowait_reader defers a miss to the pool");
+
+	fs::close_file(fd);
+	fs::remove_file("nowait.bin");
+}
+#endif
+
+#ifdef __linux__
+static void test_direct()
+{
+	std::string data((3 << 20) + 1234, '\0');
+	for (std::size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<char>(i * 7);
+
+	std::size_t pos = 0;
+	const auto wrote = fs::write_direct("direct.bin", [&](char* buf, std::size_t cap)
+	{
+		const auto n = std::min(cap, data.size() - pos);
+		std::memcpy(buf, data.data() + pos, n);
+		pos += n;
+		return n;
+	}, 0, 1 << 20, 4);
+
+	std::string back;
+	std::uint64_t expect_off = 0;
+	bool ordered = true;
+	const auto read = fs::read_direct("direct.bin", [&](const char* p, std::size_t n,
+							   std::uint64_t off)
+	{
+		ordered = ordered && off == expect_off;
+		expect_off += n;
+		back.append(p, n);
+	}, 0, 0, 1 << 20, 4);
+
+	check(wrote == data.size() && read == data.size() && ordered && back == data,
+	      "write_direct and read_direct round trip");
+
+	// A sink that gives up halfway leaves reads in flight behind it.
+	std::size_t seen = 0;
+	bool thrown = false;
+	try {
+		fs::read_direct("direct.bin", [&](const char*, std::size_t n, std::uint64_t)
+		{
+			if ((seen += n) >= (1 << 20))
+				throw std::runtime_error("sink");
+		}, 0, 0, 256 << 10, 8);
+	} catch (const std::runtime_error&) {
+		thrown = true;
+	}
+
+	std::size_t fills = 0;
+	try {
+		fs::write_direct("direct.bin", [&](char* buf, std::size_t cap)
+		{
+			if (++fills > 6)
+				throw std::runtime_error("source");
+			std::memset(buf, 1, cap);
+			return cap;
+		}, 0, 256 << 10, 4);
+	} catch (const std::runtime_error&) {
+		thrown = thrown && fills == 7;
+	}
+	check(thrown && seen == 1 << 20, "read_direct and write_direct unwind with I/O in flight");
+	fs::remove_file("direct.bin");
+}
+#endif
+
+#ifdef __linux__
+static void test_fd_budget()
+{
+	auto& budget = fs::fd_budget::global();
+	const auto before = budget.available();
+	{
+		auto some = budget.reserve(10);
+		check(some.count() == 10 && budget.available() == before - 10,
+		      "fd_budget reserves");
+	}
+	check(budget.available() == before, "fd_budget gives back");
+
+	fs::write_file("budget.txt", "budget", 6);
+	fs::block_cache cache(1 << 20, 4096);
+	std::vector<std::pair<std::string, std::string>> moves;
+	::mkdir("budget", 0755);
+	for (int i = 0; i < 8; ++i) {
+		fs::write_file("budget/" + std::to_string(i), "m", 1);
+		moves.emplace_back("budget/" + std::to_string(i), "budget/m" + std::to_string(i));
+	}
+
+	{
+		// With the whole budget taken everything still works, only
+		// without keeping descriptors around.
+		auto all = budget.reserve(SIZE_MAX);
+		check(budget.available() == 0, "fd_budget exhausted");
+
+		fs::cached_file f(cache, "budget.txt");
+		char buf[6];
+		check(f.read_object(buf, 6, 0) == 6 && std::memcmp(buf, "budget", 6) == 0,
+		      "cached_file without budget");
+
+		fs::move_paths(moves, 4);
+		bool moved = true;
+		for (const auto& m : moves)
+			moved = moved && fs::is_file_exists(m.second);
+		check(moved, "move_paths without budget");
+
+		fs::fd_broker b("budget/sock");
+		fs::fd_broker_client c("budget/sock");
+		const auto fd = c.open_file(fs::canonical("budget.txt"));
+		check(fd != -1 && b.cached() == 0, "fd_broker without budget");
+		::close(fd);
+	}
+
+	// A forked child closes everything above stderr.
+	const auto extra = fs::open_file("budget.txt", fs_omode::readonly);
+	auto pid = ::fork();
+	if (pid == 0) {
+		fs::close_fds(3);
+		::_exit(::fcntl(extra, F_GETFD) == -1 && ::fcntl(2, F_GETFD) != -1 ? 0 : 1);
+	}
+	int status = -1;
+	::waitpid(pid, &status, 0);
+	check(WIFEXITED(status) && WEXITSTATUS(status) == 0, "close_fds");
+	fs::close_file(extra);
+
+	fs::remove_all("budget");
+	fs::remove_file("budget.txt");
+}
+#endif
+
+#ifdef __linux__
+static void test_io_scope()
+{
+	fs::io_account acct("test");
+	const std::string data(100000, 'x');
+	const auto start = std::chrono::steady_clock::now();
+	{
+		fs::io_scope scope(&acct);
+		fs::bulk_create({ { "scope.dir", 0755, "", true },
+				  { "scope.dir/a", 0644, "abc", false },
+				  { "scope.dir/b", 0644, "defgh", false } });
+		fs::write_file("scope.src", data);
+	}
+	auto st = acct.exchange();
+	check(st.opens >= 3 && st.write_bytes == 8 + data.size(),
+	      "io_scope counts bulk_create through io_uring");
+
+	{
+		fs::io_scope scope(&acct);
+		fs::copy_file("scope.src", "scope.dst");
+	}
+	const auto wall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now() - start).count();
+	const auto cp = acct.snapshot();
+	check(cp.read_bytes == data.size() && cp.write_bytes == data.size(),
+	      "io_scope counts copied bytes once as read and written");
+	check(st.nanoseconds + cp.nanoseconds <= static_cast<std::uint64_t>(wall),
+	      "io_scope counts nested time once");
+
+	fs::remove_file("scope.src");
+	fs::remove_file("scope.dst");
+	fs::remove_file("scope.dir/a");
+	fs::remove_file("scope.dir/b");
+	::rmdir("scope.dir");
+}
+#endif
+
+static void test_appender()
+{
+	struct rec {
+		std::uint64_t off;
+		std::string data;
+	};
+	std::vector<std::vector<rec>> recs(8);
+	std::uint64_t total = 0;
+	{
+		fs::concurrent_appender app("append.bin", 1 << 20);
+		std::vector<std::thread> pool;
+		for (unsigned t = 0; t < recs.size(); ++t) {
+			pool.emplace_back([&, t]
+			{
+				for (unsigned i = 0; i < 500; ++i) {
+					// Sizes differ per thread, so ranges interleave unevenly.
+					std::string d(1 + t * 37 + i % 13, static_cast<char>('a' + t));
+					const auto off = app.append(d.data(), d.size());
+					recs[t].push_back({ off, std::move(d) });
+				}
+			});
+		}
+		for (auto& th : pool)
+			th.join();
+		for (const auto& r : recs)
+			for (const auto& x : r)
+				total += x.data.size();
+		check(app.written() == total && app.reserved() == total,
+		      "concurrent_appender written() reaches the end");
+	}
+
+	const auto back = fs::read_file<std::string>("append.bin");
+	bool same = back.size() == total;
+	for (const auto& r : recs)
+		for (const auto& x : r)
+			same = same && back.compare(x.off, x.data.size(), x.data) == 0;
+	check(same, "concurrent_appender keeps every append at its offset");
+	fs::remove_file("append.bin");
+}
+
+static void test_sharded()
+{
+	::mkdir("legacy.d", 0755);
+	for (int i = 0; i < 4; ++i)
+		fs::write_file("legacy.d/k" + std::to_string(i), "old" + std::to_string(i));
+
+	{
+		fs::sharded_dir sd("shard.d", 16, 2, "legacy.d");
+
+		// Creating a legacy key moves it over, contents and all.
+		auto fd = sd.open("k0", fs_omode::writeonly | fs_omode::create);
+		fs::close_file(fd);
+		check(fs::read_file<std::string>(sd.path("k0")) == "old0" && !fs::is_file_exists("legacy.d/k0"),
+		      "sharded_dir create adopts the legacy copy");
+
+		// A newer sharded copy wins and the flat one goes away.
+		fs::write_file(sd.prepare("k1"), std::string("new1"));
+		check(sd.migrate() == 2 && fs::read_file<std::string>(sd.path("k1")) == "new1" &&
+		      !fs::is_file_exists("legacy.d/k1"), "sharded_dir migrate drops shadowed legacy copies");
+
+		fs::write_file("legacy.d/k2", std::string("stale"));
+		check(sd.remove("k2") && !sd.exists("k2"), "sharded_dir remove clears both layouts");
+	}
+
+	{
+		// In place, a flat key named like a shard blocks that shard.
+		fs::sharded_dir sd("inplace.d", 16, 1, "inplace.d");
+		std::string key;
+		for (int i = 0; key.empty(); ++i) {
+			auto k = "key" + std::to_string(i);
+			if (sd.path(k) == "inplace.d/3/" + k)
+				key = k;
+		}
+		fs::write_file("inplace.d/3", std::string("three"));
+
+		int err = 0;
+		try {
+			fs::close_file(sd.open(key, fs_omode::writeonly | fs_omode::create));
+		} catch (const std::system_error& e) {
+			err = e.code().value();
+		}
+		check(err == ENOTDIR, "sharded_dir reports a legacy file in the way of a shard");
+
+		sd.migrate();
+		fs::close_file(sd.open(key, fs_omode::writeonly | fs_omode::create));
+		check(fs::read_file<std::string>(sd.path("3")) == "three", "sharded_dir migrate moves blocking files");
+	}
+
+	fs::remove_all("legacy.d");
+	fs::remove_all("shard.d");
+	fs::remove_all("inplace.d");
+}
+
+#ifdef __linux__
+static void test_polling()
+{
+	::mkdir("poll.d", 0755);
+	for (int i = 0; i < 25; ++i)
+		fs::write_file("poll.d/f" + std::to_string(i), std::string("x"));
+
+	fs::poll_options opts;
+	opts.rate = 10;
+	opts.min_interval = std::chrono::milliseconds(1);
+	fs::polling_watcher w(opts);
+
+	// Adding stats nothing, the first poll() stats only what the
+	// budget allows and reports no baseline.
+	fs::io_account acct;
+	fs::io_stats st;
+	std::vector<fs::watch_event> ev;
+	{
+		fs::io_scope scope(&acct);
+		for (int i = 0; i < 25; ++i)
+			w.add("poll.d/f" + std::to_string(i));
+		st = acct.exchange();
+		ev = w.poll(0);
+	}
+	const auto first = acct.exchange();
+	check(st.syscalls == 0 && first.syscalls >= 10 && first.syscalls <= 11 && ev.empty(),
+	      "polling_watcher add() waits for the stat budget");
+
+	fs::poll_options fast;
+	fast.min_interval = std::chrono::milliseconds(1);
+	fs::polling_watcher v(fast);
+	v.add("poll.d/f0");
+	ev = v.poll(50);
+	fs::write_file("poll.d/f0", std::string("changed"));
+	auto got = v.poll(1000);
+	check(ev.empty() && got.size() == 1 && got[0].path == "poll.d/f0" &&
+	      got[0].kind == fs::watch_kind::modified, "polling_watcher reports a change after the baseline");
+
+	fs::remove_all("poll.d");
+}
+#endif
+
+#ifdef __linux__
+static void test_shm_ring()
+{
+	const std::string path = "/dev/shm/fs_mini_test_ring";
+	const unsigned per = 3000;
+
+	// A small ring, so it wraps and fills many times over.
+	fs::shm_ring ring(path, 1024);
+
+	// One producer in another process, two more threads here.
+	auto pid = ::fork();
+	if (pid == 0) {
+		fs::shm_ring child(path);
+		for (unsigned i = 0; i < per; ++i) {
+			auto m = "0:" + std::to_string(i) + std::string(i % 50, '.');
+			child.push(m.data(), m.size());
+		}
+		::_exit(0);
+	}
+
+	std::vector<std::thread> pool;
+	for (unsigned t = 1; t <= 2; ++t) {
+		pool.emplace_back([&ring, t, per]
+		{
+			for (unsigned i = 0; i < per; ++i) {
+				auto m = std::to_string(t) + ":" + std::to_string(i) +
+					std::string(i % 50, '.');
+				ring.push(m.data(), m.size());
+			}
+		});
+	}
+
+	std::vector<unsigned> next(3, 0);
+	bool ordered = true;
+	std::string msg;
+	for (unsigned n = 0; n < 3 * per && ordered; ++n) {
+		if (!ring.pop(msg, 10000)) {
+			ordered = false;
+			break;
+		}
+		const auto t = static_cast<unsigned>(msg[0] - '0');
+		if (t >= 3) {
+			ordered = false;
+			break;
+		}
+		const auto i = next[t]++;
+		ordered = msg == std::to_string(t) + ":" + std::to_string(i) + std::string(i % 50, '.');
+	}
+
+	for (auto& th : pool)
+		th.join();
+	int status = 0;
+	::waitpid(pid, &status, 0);
+	check(ordered && next[0] == per && next[1] == per && next[2] == per &&
+	      !ring.try_pop(msg), "shm_ring delivers every message in producer order");
+	::unlink(path.c_str());
+}
+#endif
+
+static void test_shared_file()
+{
+	std::string data(5000, '\0');
+	for (std::size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<char>(i % 239);
+	fs::write_file("shared.bin", data);
+
+	// O_APPEND is dropped, writes still land where they are aimed.
+	fs::shared_file f("shared.bin", fs_omode::read_write | fs_omode::append);
+	check(f.size() == data.size(), "shared_file takes the size on open");
+
+	// Growth by someone else is not seen, reads stop at the logical size.
+	auto fd = fs::open_file("shared.bin", fs_omode::writeonly | fs_omode::append);
+	fs::write_object(fd, "tail", 4);
+	fs::close_file(fd);
+	std::string back(6000, '\0');
+	check(f.read_object(&back[0], back.size(), 0) == data.size() &&
+	      back.compare(0, data.size(), data) == 0 && f.read_object(&back[0], 10, 5000) == 0,
+	      "shared_file clamps reads to the logical size");
+
+	// Threads write disjoint blocks past the end.
+	std::vector<std::thread> pool;
+	for (int t = 0; t < 4; ++t)
+		pool.emplace_back([&f, t] {
+			const std::string blk(1000, static_cast<char>('A' + t));
+			for (int i = t; i < 20; i += 4)
+				f.write_object(blk.data(), blk.size(), 5000 + 1000 * static_cast<std::uint64_t>(i));
+		});
+	for (auto& t : pool)
+		t.join();
+	for (int i = 0; i < 20; ++i)
+		data.append(1000, static_cast<char>('A' + i % 4));
+	check(f.size() == data.size() && fs::read_file<std::string>("shared.bin") == data,
+	      "shared_file grows with positional writes");
+
+	// More iovecs than IOV_MAX, of mixed sizes, clamped at the end.
+	f.resize(20000);
+	data.resize(20000);
+	std::vector<std::string> bufs;
+	for (int i = 0; i < 1500; ++i)
+		bufs.emplace_back(static_cast<std::size_t>(1 + i % 30), '?');
+	std::vector<struct iovec> iov;
+	std::size_t total = 0;
+	for (auto& b : bufs) {
+		iov.push_back({ &b[0], b.size() });
+		total += b.size();
+	}
+	const std::uint64_t off = 100;
+	const auto got = f.read_vector(iov.data(), static_cast<int>(iov.size()), off);
+	std::string joined;
+	for (const auto& b : bufs)
+		joined += b;
+	check(total > 20000 - off && got == 20000 - off &&
+	      joined.compare(0, got, data, off, got) == 0 &&
+	      joined.find_first_not_of('?', got) == std::string::npos &&
+	      iov[0].iov_len == bufs[0].size(), "shared_file read_vector spans iovecs");
+
+	fs::remove_file("shared.bin");
+}
+
+static void test_merkle()
+{
+	// 11 blocks and a partial one, so the tree has unpaired nodes.
+	std::string data(11 * 4096 + 100, '\0');
+	for (std::size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<char>(i * 31 + i / 4096);
+	fs::write_file("merkle.bin", data);
+
+	const auto root = fs::build_merkle("merkle.bin", 4096, 3);
+	check(root == fs::merkle_root("merkle.bin") && fs::verify_range("merkle.bin", 0, data.size()) &&
+	      fs::verify_range("merkle.bin", 5000, 10), "verify_range accepts an intact file");
+
+	std::string back(6000, '\0');
+	{
+		fs::merkle_reader r("merkle.bin");
+		check(r.read_object(&back[0], back.size(), 40000) == data.size() - 40000 &&
+		      back.compare(0, data.size() - 40000, data, 40000, std::string::npos) == 0,
+		      "merkle_reader reads up to the end");
+	}
+
+	// Flip one byte in block 5.
+	auto fd = fs::open_file("merkle.bin", fs_omode::read_write);
+	const char bad = static_cast<char>(data[5 * 4096 + 7] ^ 1);
+	fs::pwrite_all(fd, &bad, 1, 5 * 4096 + 7);
+	fs::close_file(fd);
+
+	check(!fs::verify_range("merkle.bin", 5 * 4096, 1) &&
+	      !fs::verify_range("merkle.bin", 0, data.size()) &&
+	      fs::verify_range("merkle.bin", 0, 5 * 4096) &&
+	      fs::verify_range("merkle.bin", 6 * 4096, 4096), "verify_range finds the corrupt block only");
+
+	fs::merkle_reader r("merkle.bin");
+	int err = 0;
+	try {
+		r.read_object(&back[0], 100, 5 * 4096 + 4000);
+	} catch (const std::system_error& e) {
+		err = e.code().value();
+	}
+	check(err == EILSEQ && r.read_object(&back[0], 100, 0) == 100,
+	      "merkle_reader rejects only corrupt blocks");
+
+	// Concurrent builders each stage their own sidecar.
+	fs::write_file("merkle.bin", data);
+	std::vector<std::thread> pool;
+	for (int t = 0; t < 4; ++t)
+		pool.emplace_back([] {
+			for (int i = 0; i < 10; ++i)
+				fs::build_merkle("merkle.bin", 4096, 1);
+		});
+	for (auto& t : pool)
+		t.join();
+	check(fs::merkle_root("merkle.bin") == root && fs::verify_range("merkle.bin", 0, data.size()),
+	      "concurrent build_merkle leaves a valid sidecar");
+
+	fs::remove_file("merkle.bin");
+	fs::remove_file("merkle.bin.merkle");
+}
+
+static void test_block_cache()
+{
+	std::string data(10000, '\0');
+	for (std::size_t i = 0; i < data.size(); ++i)
+		data[i] = static_cast<char>(i % 253);
+	fs::write_file("bcache.bin", data);
+
+	// Four 4 KiB blocks in all.
+	fs::block_cache cache(16 << 10, 4096, 1);
+	std::string back(data.size(), '\0');
+	{
+		fs::cached_file f(cache, "bcache.bin");
+		check(f.read_object(&back[0], back.size(), 0) == data.size() && back == data &&
+		      cache.misses() == 3 && cache.hits() == 0, "cached_file reads through the cache");
+	}
+	{
+		fs::cached_file f(cache, "bcache.bin");
+		check(f.read_object(&back[0], 100, 5000) == 100 &&
+		      back.compare(0, 100, data, 5000, 100) == 0 && cache.hits() == 1,
+		      "block_cache keeps blocks of a closed file");
+	}
+
+	data.append(100, 'n');
+	data[0] = 'x';
+	fs::write_file("bcache.bin", data);
+	{
+		fs::cached_file f(cache, "bcache.bin");
+		back.assign(data.size(), '\0');
+		check(f.read_object(&back[0], back.size(), 0) == data.size() && back == data,
+		      "block_cache drops blocks of a changed file");
+	}
+
+	// Files that are neither open nor cached are forgotten.
+	for (int i = 0; i < 20; ++i) {
+		const auto name = "bcache." + std::to_string(i);
+		fs::write_file(name, data);
+		fs::cached_file f(cache, name);
+		(void)f.read_object(&back[0], back.size(), 0);
+		fs::remove_file(name);
+	}
+	check(cache.files() <= 4, "block_cache forgets evicted files");
+	cache.clear();
+	check(cache.files() == 0, "block_cache forgets everything on clear");
+
+	fs::remove_file("bcache.bin");
+}
+
+static void test_write_cache()
+{
+	std::string ref(50000, 'o');
+	fs::write_file("cache.bin", ref);
+	auto fd = fs::open_file("cache.bin", fs_omode::read_write);
+
+	std::uint32_t seed = 12345;
+	auto rnd = [&seed](std::uint32_t n)
+	{
+		seed = seed * 1103515245 + 12345;
+		return (seed >> 8) % n;
+	};
+
+	bool same = true, counted = true;
+	for (std::size_t threshold : { std::size_t(1) << 30, std::size_t(4096) }) {
+		fs::write_cache cache(fd, threshold);
+		std::vector<bool> dirty(80000, false);
+
+		for (int n = 0; n < 3000; ++n) {
+			const auto off = rnd(70000);
+			const std::string d(1 + rnd(400), static_cast<char>('a' + rnd(26)));
+			cache.write_object(d.data(), d.size(), off);
+
+			if (ref.size() < off + d.size())
+				ref.resize(off + d.size(), '\0');
+			ref.replace(off, d.size(), d);
+
+			// Extents merge exactly the overlapping and touching
+			// writes, so dirty() is the size of their union.
+			if (threshold > 4096) {
+				std::fill(dirty.begin() + off, dirty.begin() + off + d.size(), true);
+				const auto want = static_cast<std::size_t>(
+					std::count(dirty.begin(), dirty.end(), true));
+				counted = counted && cache.dirty() == want;
+			}
+
+			const auto roff = rnd(static_cast<std::uint32_t>(ref.size()));
+			std::string back(1 + rnd(2000), '\0');
+			const auto got = cache.read_object(&back[0], back.size(), roff);
+			same = same && got == std::min(back.size(), ref.size() - roff) &&
+				back.compare(0, got, ref, roff, got) == 0;
+		}
+		cache.flush();
+		counted = counted && cache.dirty() == 0;
+	}
+	fs::close_file(fd);
+
+	check(same, "write_cache reads see every buffered write");
+	check(counted, "write_cache merges overlapping and adjacent extents");
+	check(fs::read_file<std::string>("cache.bin") == ref, "write_cache flushes to the file");
+
+	// 100 extents 1000 bytes apart leave in one pwritev(), and the
+	// gaps keep what the file had; a write-only descriptor cannot read
+	// the gaps back, so it gets one write per extent.
+	fs::io_account acct;
+	for (auto mode : { fs_omode::read_write, fs_omode::writeonly }) {
+		fs::write_file("cache.bin", ref);
+		fd = fs::open_file("cache.bin", mode);
+		{
+			fs::write_cache cache(fd);
+			for (std::size_t off = 0; off < 200000; off += 2000) {
+				cache.write_object("0123456789", 10, off);
+				if (ref.size() < off + 10)
+					ref.resize(off + 10, '\0');
+				ref.replace(off, 10, "0123456789");
+			}
+			fs::io_scope scope(acct);
+			cache.flush();
+		}
+		fs::close_file(fd);
+		const auto st = acct.exchange();
+		check(st.writes == (mode == fs_omode::read_write ? 1u : 100u),
+		      "write_cache batches nearby extents into one pwritev()");
+		check(fs::read_file<std::string>("cache.bin") == ref, "write_cache keeps the gaps intact");
+	}
+	fs::remove_file("cache.bin");
+}
+
+static void test_smart_reader()
+{
+	const std::size_t size = 4 << 20;
+	fs::write_file("smart.bin", std::string(size, 's'));
+	auto fd = fs::open_file("smart.bin", fs_omode::readonly);
+	std::vector<char> buf(64 << 10);
+
+	{
+		// A window small against the file, so the overshoot past EOF
+		// stays small.
+		fs::smart_reader r(fd, 512 << 10);
+		for (std::size_t off = 0; off < size; off += buf.size())
+			r.read_object(buf.data(), buf.size(), off);
+		check(r.pattern() == fs::access_pattern::sequential && r.stats().prefetches > 0 &&
+		      r.stats().accuracy() > 0.5, "smart_reader follows a sequential stream");
+	}
+	{
+		fs::smart_reader r(fd);
+		for (std::size_t off = 0; off < size; off += 256 << 10)
+			r.read_object(buf.data(), 4096, off);
+		check(r.pattern() == fs::access_pattern::strided && r.stats().accuracy() > 0.5,
+		      "smart_reader prefetches forward strides");
+	}
+	{
+		// Backward strides end near offset 0, where nothing may be
+		// prefetched below the start of the file.
+		fs::smart_reader r(fd);
+		const std::size_t step = 192 << 10;
+		const std::size_t first = size - 4096 - 5000;
+		std::size_t reads = 0;
+		for (std::size_t off = first; off < size; off -= step, ++reads)
+			r.read_object(buf.data(), 4096, off);
+		const auto& st = r.stats();
+		check(r.pattern() == fs::access_pattern::strided && st.prefetches > 0 &&
+		      st.prefetches < reads && st.useful_bytes == st.prefetched_bytes,
+		      "smart_reader prefetches backward strides within the file");
+	}
+	{
+		fs::smart_reader r(fd);
+		std::uint32_t seed = 7;
+		for (int i = 0; i < 64; ++i) {
+			seed = seed * 1103515245 + 12345;
+			r.read_object(buf.data(), 4096, (seed >> 4) % (size - 4096));
+		}
+		check(r.pattern() == fs::access_pattern::random && r.stats().prefetches == 0,
+		      "smart_reader does not prefetch random reads");
+	}
+
+	fs::close_file(fd);
+	fs::remove_file("smart.bin");
+}
+
+static void test_records()
+{
+	struct point {
+		std::int32_t x, y;
+	};
+	std::vector<point> pts;
+	for (int i = 0; i < 1000; ++i)
+		pts.push_back({ i, -i });
+
+	fs::write_records("points.rec", pts.data(), pts.size());
+	{
+		fs::record_view<point> v("points.rec", true);
+		check(v.size() == pts.size() && v[999].x == 999 && v[999].y == -999,
+		      "write_records and record_view round trip");
+	}
+
+	auto error_of = [](auto&& fn)
+	{
+		try {
+			fn();
+		} catch (const std::system_error& e) {
+			return e.code().value();
+		}
+		return 0;
+	};
+	check(error_of([] { fs::record_view<std::int32_t> v("points.rec"); }) == EINVAL,
+	      "record_view rejects a wrong record size");
+
+	auto fd = fs::open_file("points.rec", fs_omode::read_write);
+	const char flip = 'x';
+	fs::pwrite_all(fd, &flip, 1, 100);
+	check(error_of([] { fs::record_view<point> v("points.rec", true); }) == EILSEQ,
+	      "record_view rejects a corrupt payload");
+	fs::pwrite_all(fd, &flip, 1, 0);
+	fs::close_file(fd);
+	check(error_of([] { fs::record_view<point> v("points.rec"); }) == EINVAL,
+	      "record_view rejects a bad magic");
+
+	// Writers racing on one path each stage into a file of their own.
+	std::vector<std::thread> pool;
+	for (int t = 0; t < 4; ++t) {
+		pool.emplace_back([&pts]
+		{
+			for (int i = 0; i < 20; ++i)
+				fs::write_records("points.rec", pts.data(), pts.size());
+		});
+	}
+	for (auto& th : pool)
+		th.join();
+	check(error_of([] { fs::record_view<point> v("points.rec", true); }) == 0,
+	      "concurrent write_records leave a valid file");
+
+	fs::remove_file("points.rec");
+}
+
 int main()
 {
 	const auto file = "test.txt";
@@ -26,4 +1312,36 @@ int main()
 	fs::close_file(rfd);
 
 	std::cout << p.get();
+
+#ifdef __linux__
+	test_follower();
+#endif
+	test_rotation_retention();
+	test_records();
+	test_external_sort();
+	test_canonical();
+	test_read_file();
+	test_sparse();
+	test_appender();
+	test_sharded();
+	test_shared_file();
+	test_merkle();
+	test_block_cache();
+	test_write_cache();
+	test_smart_reader();
+#ifdef __linux__
+	test_memfd();
+	test_bulk_create();
+	test_extents();
+	test_nowait();
+	test_broker();
+	test_move();
+	test_direct();
+	test_fd_budget();
+	test_shm_ring();
+	test_io_scope();
+	test_polling();
+#endif
+
+	return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
 }